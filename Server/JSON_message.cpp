@@ -3,12 +3,61 @@
 #include "lib/rapidjson/stringbuffer.h"
 #include "lib/rapidjson/prettywriter.h"
 #include "include/JSON_message.h"
+#include "include/metrics.h"
+#include "include/logger.h"
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 
 namespace JSON_message
 {
+/*
+ * Reads the cell ranges out of a message, either a single "range"
+ * or an array of "ranges". Anything that isn't a string is skipped.
+ */
+static std::vector<std::string> get_ranges(const rapidjson::Document &doc)
+{
+    std::vector<std::string> ranges;
+
+    if (doc.HasMember("range") && doc["range"].IsString())
+    {
+        ranges.push_back(doc["range"].GetString());
+    }
+
+    if (doc.HasMember("ranges") && doc["ranges"].IsArray())
+    {
+        for (auto &range : doc["ranges"].GetArray())
+        {
+            if (range.IsString())
+                ranges.push_back(range.GetString());
+        }
+    }
+
+    return ranges;
+}
+
+/*
+ * Reads an array of strings out of a message. Missing means empty,
+ * anything that isn't a string is skipped.
+ */
+static std::vector<std::string> get_strings(const rapidjson::Document &doc, const char *key)
+{
+    std::vector<std::string> strings;
+
+    if (doc.HasMember(key) && doc[key].IsArray())
+    {
+        for (auto &element : doc[key].GetArray())
+        {
+            if (element.IsString())
+                strings.push_back(element.GetString());
+        }
+    }
+
+    return strings;
+}
+
 /* This JSON_Message class used to build JSON_message strings on the server side
  * 
  * The command that is returned needs to be freed
@@ -16,13 +65,15 @@ namespace JSON_message
  */
 command *get_type(char const *const data)
 {
+    metric_timer timer(metrics::parse_time);
     command *cmd = NULL;
     rapidjson::Document doc;
 
     //Parse the document using Parse(const char *);
     if (doc.Parse(data).HasParseError())
     {
-        std::cout << "Error parsing JSON str\n";
+        LOG(LOG_WARN, "unable to parse message");
+        metrics::messages_parsed("").add();
         return cmd;
     }
     //Make sure that doc is an object (it was parsed correctly)
@@ -41,6 +92,11 @@ command *get_type(char const *const data)
                 cmd = new close_command();
             }
 
+            if (doc["type"].IsString() && doc["type"] == "stats")
+            {
+                cmd = new stats_command();
+            }
+
             if (doc["type"].IsString() && doc["type"] == "user")
             {
                 if (doc["order"].IsString() &&
@@ -69,9 +125,37 @@ command *get_type(char const *const data)
                     doc["username"].IsString() &&
                     doc["password"].IsString())
                 {
-                    cmd = new open_command(doc["name"].GetString(),
-                                           doc["username"].GetString(),
-                                           doc["password"].GetString());
+                    open_command *open = new open_command(doc["name"].GetString(),
+                                                          doc["username"].GetString(),
+                                                          doc["password"].GetString());
+
+                    // A reconnecting client tells us the last version it saw, and
+                    // the epoch it was numbered in
+                    if (doc.HasMember("version") && doc["version"].IsUint64())
+                    {
+                        unsigned long epoch = 0;
+                        if (doc.HasMember("epoch") && doc["epoch"].IsUint64())
+                            epoch = doc["epoch"].GetUint64();
+                        open->set_version(epoch, doc["version"].GetUint64());
+                    }
+                    // The client can start out only showing part of the spreadsheet
+                    open->set_ranges(get_ranges(doc));
+                    // The client can ask for everything we send to be compressed
+                    if (doc.HasMember("compression") && doc["compression"].IsString())
+                    {
+                        open->set_compression(doc["compression"].GetString());
+                    }
+                    // "mode": "view" opens the spreadsheet read only
+                    if (doc.HasMember("mode") && doc["mode"].IsString() && doc["mode"] == "view")
+                    {
+                        open->set_read_only(true);
+                    }
+                    // "values": true asks for the values of formulas too
+                    if (doc.HasMember("values") && doc["values"].IsBool())
+                    {
+                        open->set_values(doc["values"].GetBool());
+                    }
+                    cmd = open;
                 }
             }
 
@@ -112,8 +196,74 @@ command *get_type(char const *const data)
                     cmd = new revert_command(doc["cell"].GetString());
                 }
             }
+
+            if (doc["type"].IsString() && doc["type"] == "subscribe")
+            {
+                cmd = new subscribe_command(get_ranges(doc));
+            }
+
+            if (doc["type"].IsString() && doc["type"] == "fill")
+            {
+                if (doc.HasMember("source") && doc["source"].IsString() &&
+                    doc.HasMember("range") && doc["range"].IsString())
+                {
+                    cmd = new fill_command(doc["source"].GetString(), doc["range"].GetString());
+                }
+            }
+
+            if (doc["type"].IsString() && doc["type"] == "clear")
+            {
+                if (doc.HasMember("range") && doc["range"].IsString())
+                {
+                    cmd = new clear_command(doc["range"].GetString());
+                }
+            }
+
+            if (doc["type"].IsString() && doc["type"] == "aggregate")
+            {
+                if (doc.HasMember("range") && doc["range"].IsString())
+                {
+                    cmd = new aggregate_command(doc["range"].GetString());
+                }
+            }
+
+            if (doc["type"].IsString() && (doc["type"] == "insert_rows" || doc["type"] == "delete_rows"))
+            {
+                if (doc.HasMember("row") && doc["row"].IsInt() &&
+                    doc.HasMember("count") && doc["count"].IsInt())
+                {
+                    cmd = new rows_command(doc["type"].GetString(), doc["row"].GetInt(), doc["count"].GetInt());
+                }
+            }
+
+            if (doc["type"].IsString() && doc["type"] == "tap")
+            {
+                unsigned int sample = 1;
+                int rate = -1;
+                if (doc.HasMember("sample") && doc["sample"].IsUint())
+                {
+                    sample = doc["sample"].GetUint();
+                }
+                if (doc.HasMember("rate") && doc["rate"].IsInt())
+                {
+                    rate = doc["rate"].GetInt();
+                }
+                cmd = new tap_command(get_strings(doc, "sheets"), get_strings(doc, "users"),
+                                      get_strings(doc, "types"), sample, rate);
+            }
+
+            if (doc["type"].IsString() && doc["type"] == "move")
+            {
+                if (doc.HasMember("range") && doc["range"].IsString() &&
+                    doc.HasMember("to") && doc["to"].IsString())
+                {
+                    cmd = new move_command(doc["range"].GetString(), doc["to"].GetString());
+                }
+            }
         }
     }
+
+    metrics::messages_parsed(cmd != NULL ? cmd->get_type() : "").add();
     return cmd;
 }
 
@@ -182,6 +332,12 @@ std::string full_send_message(const spreadsheet &s)
     //end the list of cells once we iterate through every cell
     writer.EndObject();
 
+    //the version of the spreadsheet this describes
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+    writer.Key("epoch");
+    writer.Uint64(s.getEpoch());
+
     //end the JSON string
     writer.EndObject();
 
@@ -246,6 +402,50 @@ std::string error_message(ERROR_TYPE e, std::string bad_cell)
         // Return our string with two newlines on the end
         return (std::string)(sb.GetString()) + "\n\n";
     }
+    else if (e == INVALID_RANGE)
+    {
+        //start the JSON string
+        writer.StartObject();
+
+        //populate the type field
+        writer.Key("type");
+        writer.String("error");
+
+        //populate the code field
+        writer.Key("code");
+        writer.Int(INVALID_RANGE);
+
+        //populate source field
+        writer.Key("source");
+        writer.String(bad_cell.c_str());
+
+        writer.EndObject();
+
+        // Return our string with two newlines on the end
+        return (std::string)(sb.GetString()) + "\n\n";
+    }
+    else if (e == READ_ONLY)
+    {
+        //start the JSON string
+        writer.StartObject();
+
+        //populate the type field
+        writer.Key("type");
+        writer.String("error");
+
+        //populate the code field
+        writer.Key("code");
+        writer.Int(READ_ONLY);
+
+        //populate source field
+        writer.Key("source");
+        writer.String(bad_cell.c_str());
+
+        writer.EndObject();
+
+        // Return our string with two newlines on the end
+        return (std::string)(sb.GetString()) + "\n\n";
+    }
     else
     {
         return NULL;
@@ -258,7 +458,7 @@ std::string error_message(ERROR_TYPE e, std::string bad_cell)
 * the spreadsheet list message for the official 
 * communications protocol.
 **/
-std::string spreadsheet_list_message(std::vector<std::string> list)
+std::string spreadsheet_list_message(const std::vector<std::string> &list)
 {
     //Rapid JSON will require a string buffer to serialize our JSON string
     rapidjson::StringBuffer sb;
@@ -295,7 +495,171 @@ std::string spreadsheet_list_message(std::vector<std::string> list)
     return (std::string)(sb.GetString()) + "\n\n";
 }
 
+/*
+* Starts a spreadsheet that is sent in pages. The pages that follow are
+* ordinary full send messages, and a full send end message comes last.
+* cell_count is how many cells the spreadsheet had when it started, it
+* can change while the pages are being sent.
+**/
+std::string full_send_begin_message(const spreadsheet &s, std::size_t cell_count)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("full send begin");
+    writer.Key("cells");
+    writer.Uint64(cell_count);
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+    writer.Key("epoch");
+    writer.Uint64(s.getEpoch());
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* A range operation (fill, clear, insert_rows, delete_rows or move) as
+* it was applied, with the version it made. Clients showing the whole
+* spreadsheet apply it themselves instead of getting every cell it changed.
+**/
+std::string range_message(command *cmd, unsigned long version)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String(cmd->get_type().c_str());
+
+    if (cmd->get_type() == "fill")
+    {
+        writer.Key("source");
+        writer.String(((fill_command *)(cmd))->get_source().c_str());
+        writer.Key("range");
+        writer.String(((fill_command *)(cmd))->get_range().c_str());
+    }
+    else if (cmd->get_type() == "clear")
+    {
+        writer.Key("range");
+        writer.String(((clear_command *)(cmd))->get_range().c_str());
+    }
+    else if (cmd->get_type() == "insert_rows" || cmd->get_type() == "delete_rows")
+    {
+        writer.Key("row");
+        writer.Int(((rows_command *)(cmd))->get_row());
+        writer.Key("count");
+        writer.Int(((rows_command *)(cmd))->get_count());
+    }
+    else if (cmd->get_type() == "move")
+    {
+        writer.Key("range");
+        writer.String(((move_command *)(cmd))->get_range().c_str());
+        writer.Key("to");
+        writer.String(((move_command *)(cmd))->get_to().c_str());
+    }
+
+    writer.Key("version");
+    writer.Uint64(version);
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* The numbers in a range, as an aggregate command asked for them. The
+* average is null when the range has no numbers.
+**/
+std::string aggregate_message(const std::string &range, const range_stats &stats, unsigned long version)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("aggregate");
+    writer.Key("range");
+    writer.String(range.c_str());
+    writer.Key("sum");
+    writer.Double(stats.sum);
+    writer.Key("count");
+    writer.Uint64(stats.count);
+    writer.Key("average");
+    if (stats.count > 0)
+        writer.Double(stats.sum / stats.count);
+    else
+        writer.Null();
+    writer.Key("version");
+    writer.Uint64(version);
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* The values the server worked out for formulas, null for one that has no
+* value (it doesn't work out, or refers to itself).
+**/
+std::string values_message(const spreadsheet &s, const std::vector<std::string> &cell_names)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("values");
+    writer.Key("values");
+    writer.StartObject();
+    for (const auto &cell_name : cell_names)
+    {
+        double value = s.getCellValue(cell_name);
+        writer.Key(cell_name.c_str());
+        if (std::isnan(value))
+            writer.Null();
+        else
+            writer.Double(value);
+    }
+    writer.EndObject();
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* Ends a paged spreadsheet. The client has every cell as of version.
+**/
+std::string full_send_end_message(const spreadsheet &s)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("full send end");
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+    writer.Key("epoch");
+    writer.Uint64(s.getEpoch());
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
 std::string full_send_message(const spreadsheet &s, const std::string &cell_name)
+{
+    return full_send_message(s, std::vector<std::string>(1, cell_name));
+}
+
+/*
+* Same as the full send message, but only includes the given cells.
+* Used to send clients just the cells that changed. A cell that
+* doesn't exist is sent as empty.
+**/
+std::string full_send_message(const spreadsheet &s, const std::vector<std::string> &cell_names)
 {
     //Rapid JSON will require a string buffer to serialize our JSON string
     rapidjson::StringBuffer sb;
@@ -316,35 +680,59 @@ std::string full_send_message(const spreadsheet &s, const std::string &cell_name
     //begin our array of cells
     writer.StartObject();
 
-    std::string cell_contents = s.getCellContents(cell_name);
+    for (unsigned int i = 0; i < cell_names.size(); i++)
+    {
+        writer.Key(cell_names[i].c_str());
 
-    writer.Key(cell_name.c_str());
+        if (!s.hasCell(cell_names[i]))
+        {
+            writer.String("");
+            continue;
+        }
 
-    //Check to see if the contents are a number
-    size_t parse_len;
-    try
-    {
-        writer.Double(stod(cell_contents, &parse_len));
-    }
-    catch (std::exception &e)
-    {
-        writer.String(cell_contents.c_str());
-    }
+        std::string cell_contents = s.getCellContents(cell_names[i]);
 
-    //Make sure the whole string parsed into a double
-    if (parse_len != cell_contents.size())
-    {
-        writer.String(cell_contents.c_str());
+        if (cell_contents.empty())
+        {
+            writer.String("");
+            continue;
+        }
+
+        //Check to see if the contents are a number
+        size_t parse_len;
+        try
+        {
+            double check = stod(cell_contents, &parse_len);
+
+            //Make sure the whole string parsed into a double
+            if (parse_len != cell_contents.size())
+            {
+                writer.String(cell_contents.c_str());
+            }
+            else
+            {
+                writer.Double(check);
+            }
+        }
+        catch (std::exception &e)
+        {
+            writer.String(cell_contents.c_str());
+        }
     }
 
     //end the list of cells once we iterate through every cell
     writer.EndObject();
 
+    //the version of the spreadsheet this describes
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+    writer.Key("epoch");
+    writer.Uint64(s.getEpoch());
+
     //end the JSON string
     writer.EndObject();
 
     //return our JSON string double newline deliminated
-    //std::cout << sb.GetString() << std::endl;
     return (std::string)(sb.GetString()) + "\n\n";
 }
 
@@ -366,6 +754,9 @@ std::string save_spreadsheet(spreadsheet &s)
     writer.Key("name");
     writer.String(s.getName().c_str());
 
+    writer.Key("version");
+    writer.Uint64(s.getVersion());
+
     writer.Key("spreadsheet");
 
     //begin our object of cells
@@ -501,19 +892,17 @@ spreadsheet open_spreadsheet(const std::string &filename)
 {
     spreadsheet sheet;
     std::string file_string;
-    std::string temp_string;
 
     std::ifstream spread_file;
     std::string path = "spreadsheets/" + filename + ".sprd";
     spread_file.open(path.c_str(), std::fstream::in);
 
-    // Read in the file
+    // Read in the whole file at once
     if (spread_file.is_open())
     {
-        while (getline(spread_file, temp_string))
-        {
-            file_string += temp_string;
-        }
+        std::ostringstream contents;
+        contents << spread_file.rdbuf();
+        file_string = contents.str();
         spread_file.close();
     }
     else
@@ -527,7 +916,7 @@ spreadsheet open_spreadsheet(const std::string &filename)
     //Parse the document using Parse(const char *);
     if (doc.Parse(file_string.c_str()).HasParseError())
     {
-        std::cout << "Error parsing JSON spreadsheet file\n";
+        LOG(LOG_ERROR, "unable to parse spreadsheet file").field("file", filename);
     }
     //Make sure that doc is an object (it was parsed correctly)
     if (doc.IsObject())
@@ -544,32 +933,61 @@ spreadsheet open_spreadsheet(const std::string &filename)
         {
             if (doc["spreadsheet"].IsObject())
             {
-                // Iterate through all of the cells and store them
-                for (auto it = doc["spreadsheet"].GetObject().MemberBegin(); it != doc["spreadsheet"].GetObject().MemberEnd(); ++it)
+                std::vector<cell_data> loaded;
+                loaded.reserve(doc["spreadsheet"].MemberCount());
+
+                // Iterate through all of the cells and collect them
+                for (auto it = doc["spreadsheet"].MemberBegin(); it != doc["spreadsheet"].MemberEnd(); ++it)
                 {
-                    const auto &cell_obj = doc["spreadsheet"].GetObject()[it->name.GetString()]; //make object value
+                    const auto &cell_obj = it->value;
+
+                    cell_data data;
+                    data.cellName = it->name.GetString();
 
                     // Get the cell dependenceies and put into a vector
-                    std::vector<std::string> dependencies;
-                    for (auto &element : cell_obj["dependencies"].GetArray())
+                    if (cell_obj.HasMember("dependencies") && cell_obj["dependencies"].IsArray())
                     {
-                        dependencies.push_back(element.GetString());
+                        for (auto &element : cell_obj["dependencies"].GetArray())
+                        {
+                            if (element.IsString())
+                                data.dependencies.push_back(element.GetString());
+                        }
                     }
 
                     // Get cell contents and store as a string, regardless of if it is a double or string
-                    if (cell_obj["contents"].IsString())
+                    if (cell_obj.HasMember("contents") && cell_obj["contents"].IsString())
                     {
-                        sheet.setCellContents(it->name.GetString(), cell_obj["contents"].GetString(), dependencies);
+                        data.contents = cell_obj["contents"].GetString();
                     }
-                    else if (cell_obj["contents"].IsDouble())
+                    else if (cell_obj.HasMember("contents") && cell_obj["contents"].IsDouble())
                     {
-                        sheet.setCellContents(it->name.GetString(), std::to_string(cell_obj["contents"].GetDouble()), dependencies);
+                        data.contents = std::to_string(cell_obj["contents"].GetDouble());
                     }
                     else
-                        std::cout << "Bad cell contents in saved JSON" << std::endl;
+                    {
+                        LOG(LOG_WARN, "bad cell contents in spreadsheet file").field("file", filename).field("cell", data.cellName);
+                        continue;
+                    }
+
+                    loaded.push_back(data);
+                }
+
+                // A saved spreadsheet was valid when it was saved, so the cells
+                // go in all at once. Only if that finds a cycle are they
+                // replayed one at a time, which leaves out the bad ones
+                if (!sheet.bulkLoad(loaded))
+                {
+                    LOG(LOG_WARN, "circular dependency in spreadsheet file").field("file", filename);
+                    for (const auto &data : loaded)
+                        sheet.setCellContents(data.cellName, data.contents, data.dependencies);
                 }
             }
         }
+        // Put back the version the spreadsheet was saved at
+        if (doc.HasMember("version") && doc["version"].IsUint64())
+        {
+            sheet.setVersion(doc["version"].GetUint64());
+        }
     }
 
     return sheet;
@@ -604,7 +1022,7 @@ std::unordered_map<std::string, std::string> deserialize_users()
     //Parse the document using Parse(const char *);
     if (doc.Parse(file_string.c_str()).HasParseError())
     {
-        std::cout << "Error parsing JSON spreadsheet file\n";
+        LOG(LOG_ERROR, "unable to parse users file");
     }
     //Make sure that doc is an object (it was parsed correctly)
     if (doc.IsObject())
@@ -658,6 +1076,104 @@ std::string state_message(std::unordered_map<std::string, std::string> users)
     return (std::string)(sb.GetString()) + "\n\n";
 }
 
+/*
+* A state message with only the one user that changed in it, so the admin
+* doesn't get every user again whenever one logs in. The password is null
+* when the user was deleted.
+**/
+std::string user_state_message(const std::string &username, const std::string *password)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("state");
+    writer.Key("users");
+    writer.StartObject();
+    writer.Key(username.c_str());
+    if (password != NULL)
+        writer.String(password->c_str());
+    else
+        writer.Null();
+    writer.EndObject();
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* Tells the client that everything after this message is compressed
+**/
+std::string compression_message(const std::string &codec)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("compression");
+    writer.Key("codec");
+    writer.String(codec.c_str());
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
+/*
+* Every metric the server keeps, for the admin's stats command
+**/
+std::string stats_message(const std::vector<metric_sample> &samples)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("stats");
+
+    writer.Key("metrics");
+    writer.StartArray();
+    for (const metric_sample &s : samples)
+    {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(s.name.c_str());
+        if (!s.labels.empty())
+        {
+            writer.Key("labels");
+            writer.String(s.labels.c_str());
+        }
+
+        if (s.type == METRIC_HISTOGRAM)
+        {
+            writer.Key("count");
+            writer.Uint64(s.count);
+            writer.Key("sum");
+            writer.Uint64(s.sum);
+            writer.Key("p50");
+            writer.Uint64(s.p50);
+            writer.Key("p90");
+            writer.Uint64(s.p90);
+            writer.Key("p99");
+            writer.Uint64(s.p99);
+            writer.Key("max");
+            writer.Uint64(s.max);
+        }
+        else
+        {
+            writer.Key("value");
+            writer.Int64(s.value);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.EndObject();
+
+    return (std::string)(sb.GetString()) + "\n\n";
+}
+
 std::string send_message(std::string message)
 {
     //Rapid JSON will require a string buffer to serialize our JSON string
@@ -0,0 +1,159 @@
+#include "admin_tap.h"
+#include "metrics.h"
+#include <chrono>
+
+tap_filter::tap_filter()
+    : sample(1), rate(ADMIN_TAP_DEFAULT_RATE)
+{
+}
+
+bool tap_filter::wants(const std::string &sheet, const std::string &user, const std::string &type) const
+{
+    return (sheets.empty() || sheets.count(sheet) > 0) &&
+           (users.empty() || users.count(user) > 0) &&
+           (types.empty() || types.count(type) > 0);
+}
+
+admin_tap::admin_tap()
+    : active_(false), filter_(std::make_shared<const tap_filter>()), passed_(0),
+      rate_second_(0), rate_count_(0), draining_(false), stream_(0)
+{
+}
+
+void admin_tap::subscribe(const client_ptr &admin, const tap_filter &filter)
+{
+    std::atomic_store(&filter_, std::shared_ptr<const tap_filter>(std::make_shared<const tap_filter>(filter)));
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (admin_.lock() != admin)
+        queue_.clear();
+    // A stream still on another admin's write queue may never run again,
+    // it sees it was replaced if it does and stops
+    if (draining_ && stream_admin_.lock() != admin)
+    {
+        draining_ = false;
+        stream_++;
+    }
+    admin_ = admin;
+    active_ = true;
+}
+
+void admin_tap::unsubscribe(const client_ptr &admin)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    if (admin_.lock() != admin)
+        return;
+
+    active_ = false;
+    admin_.reset();
+    queue_.clear();
+}
+
+/*
+ * Same as the logger's rate limit, a count of messages kept in the
+ * current second
+ */
+bool admin_tap::under_rate_limit(unsigned int rate)
+{
+    if (rate == 0)
+        return true;
+
+    long long now = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+
+    long long second = rate_second_.load(std::memory_order_relaxed);
+    if (second != now && rate_second_.compare_exchange_strong(second, now, std::memory_order_relaxed))
+        rate_count_.store(0, std::memory_order_relaxed);
+
+    return rate_count_.fetch_add(1, std::memory_order_relaxed) < rate;
+}
+
+void admin_tap::offer(const std::string &sheet, const std::string &user, const std::string &type, const std::string &message)
+{
+    if (!active_.load(std::memory_order_relaxed))
+        return;
+
+    std::shared_ptr<const tap_filter> filter = std::atomic_load(&filter_);
+    if (!filter->wants(sheet, user, type))
+        return;
+    if (filter->sample > 1 && passed_.fetch_add(1, std::memory_order_relaxed) % filter->sample != 0)
+        return;
+    if (!under_rate_limit(filter->rate))
+        return;
+
+    // The message is framed here, c->message doesn't have its terminator
+    std::shared_ptr<const std::string> framed = std::make_shared<const std::string>(message + "\n\n");
+
+    client_ptr admin;
+    unsigned long stream;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        admin = admin_.lock();
+        if (admin == NULL)
+            return;
+
+        if (queue_.size() >= ADMIN_TAP_QUEUE)
+        {
+            queue_.pop_front();
+            metrics::admin_tap_dropped.add();
+        }
+        queue_.push_back(framed);
+
+        if (draining_)
+            return;
+        draining_ = true;
+        stream = ++stream_;
+        stream_admin_ = admin;
+    }
+
+    drain(admin, stream);
+}
+
+/*
+ * Queues a stream on the admin that sends up to ADMIN_TAP_BATCH queued
+ * messages. If there are more, the stream queues another one behind
+ * whatever else was written to the admin meanwhile, so replies to the
+ * admin's own commands don't wait for the tap to run dry.
+ */
+void admin_tap::drain(const client_ptr &admin, unsigned long stream)
+{
+    std::weak_ptr<client> weak_admin = admin;
+    std::shared_ptr<int> batch_left = std::make_shared<int>(ADMIN_TAP_BATCH);
+
+    admin->write_stream([this, weak_admin, stream, batch_left]() -> std::shared_ptr<const std::string> {
+        client_ptr admin = weak_admin.lock();
+        if (admin == NULL)
+            return NULL;
+        return next_message(admin, stream, *batch_left);
+    });
+}
+
+std::shared_ptr<const std::string> admin_tap::next_message(const client_ptr &admin, unsigned long stream, int &batch_left)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        // A stream for another admin took over
+        if (stream != stream_)
+            return NULL;
+
+        // This admin unsubscribed, or there's nothing left to send
+        if (admin_.lock() != admin || queue_.empty())
+        {
+            draining_ = false;
+            return NULL;
+        }
+
+        if (batch_left > 0)
+        {
+            batch_left--;
+            std::shared_ptr<const std::string> message = queue_.front();
+            queue_.pop_front();
+            return message;
+        }
+    }
+
+    // The batch is done but the queue isn't, draining_ stays set
+    drain(admin, stream);
+    return NULL;
+}
@@ -0,0 +1,638 @@
+/* Microbenchmarks for the spreadsheet core.
+ *
+ * Builds synthetic spreadsheets with a few generators, times the core
+ * spreadsheet operations on them, and prints one JSON object with a result
+ * per benchmark, so runs before and after a change can be compared.
+ *
+ * Generators:
+ *   grid  - size cells laid out in a square, plain numbers, no dependencies
+ *   chain - A1 <- A2 <- ... every cell depends on the one above it
+ *   star  - size leaves and one cell that depends on all of them (fan in)
+ *   dag   - every cell depends on up to 3 random cells before it
+ *
+ * Usage: bench [--size 10000] [--history 10000] [--repeat 3] [--only NAME]
+ *
+ * The kernel benchmarks always use 1M row columns, whatever --size is.
+ *
+ * --only runs the benchmarks whose name contains NAME. The round trip
+ * benchmark writes and removes a file under spreadsheets/.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lib/rapidjson/writer.h"
+#include "lib/rapidjson/stringbuffer.h"
+#include "spreadsheet.h"
+#include "JSON_message.h"
+#include "cell_ref.h"
+#include "metrics.h"
+#include "numeric_columns.h"
+#include "numeric_kernels.h"
+#include "work_pool.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct bench_options
+{
+    int size;
+    int history;
+    int repeat;
+    std::string only;
+
+    bench_options()
+        : size(10000), history(10000), repeat(3)
+    {
+    }
+};
+
+struct bench_result
+{
+    std::string name;
+    int size;
+    unsigned long ops;
+    double total_ns;
+};
+
+/*
+ * One cell a generator wants set
+ */
+struct cell_spec
+{
+    std::string name;
+    std::string contents;
+    std::vector<std::string> dependencies;
+};
+
+typedef std::vector<cell_spec> sheet_spec;
+
+// ======== Generators ========
+static sheet_spec grid_sheet(int size)
+{
+    int side = 1;
+    while (side * side < size)
+        side++;
+
+    sheet_spec spec;
+    for (int i = 0; i < size; i++)
+    {
+        cell_spec cell;
+        cell.name = cell_ref::name(i % side, i / side + 1);
+        cell.contents = std::to_string(i);
+        spec.push_back(cell);
+    }
+    return spec;
+}
+
+static sheet_spec chain_sheet(int size)
+{
+    sheet_spec spec;
+    for (int i = 1; i <= size; i++)
+    {
+        cell_spec cell;
+        cell.name = cell_ref::name(0, i);
+        if (i == 1)
+        {
+            cell.contents = "1";
+        }
+        else
+        {
+            std::string above = cell_ref::name(0, i - 1);
+            cell.contents = "=" + above + "+1";
+            cell.dependencies.push_back(above);
+        }
+        spec.push_back(cell);
+    }
+    return spec;
+}
+
+static sheet_spec star_sheet(int size)
+{
+    sheet_spec spec;
+    cell_spec hub;
+    hub.name = "A1";
+    hub.contents = "=SUM(B1:B" + std::to_string(size) + ")";
+
+    for (int i = 1; i <= size; i++)
+    {
+        cell_spec leaf;
+        leaf.name = cell_ref::name(1, i);
+        leaf.contents = std::to_string(i);
+        spec.push_back(leaf);
+        hub.dependencies.push_back(leaf.name);
+    }
+
+    spec.push_back(hub);
+    return spec;
+}
+
+static sheet_spec dag_sheet(int size)
+{
+    std::mt19937 rng(42);
+    sheet_spec spec;
+
+    for (int i = 0; i < size; i++)
+    {
+        cell_spec cell;
+        cell.name = cell_ref::name(i % 26, i / 26 + 1);
+
+        if (i == 0)
+        {
+            cell.contents = "1";
+        }
+        else
+        {
+            std::uniform_int_distribution<int> earlier(0, i - 1);
+            cell.contents = "=";
+            for (int d = 0; d < 3 && d < i; d++)
+            {
+                const std::string &dep = spec[earlier(rng)].name;
+                cell.contents += (d > 0 ? "+" : "") + dep;
+                cell.dependencies.push_back(dep);
+            }
+        }
+        spec.push_back(cell);
+    }
+    return spec;
+}
+
+static void build(spreadsheet &sheet, const sheet_spec &spec)
+{
+    for (const cell_spec &cell : spec)
+        sheet.setCellContents(cell.name, cell.contents, cell.dependencies);
+}
+
+// ======== Harness ========
+class bench_runner
+{
+public:
+    bench_runner(const bench_options &options)
+        : options_(options)
+    {
+    }
+
+    bool wanted(const std::string &name) const
+    {
+        return options_.only.empty() || name.find(options_.only) != std::string::npos;
+    }
+
+    /*
+     * Times ops runs of body (body does all of them at once) and keeps the result
+     */
+    void run(const std::string &name, int size, unsigned long ops, const std::function<void()> &body)
+    {
+        if (!wanted(name))
+            return;
+
+        bench_clock::time_point start = bench_clock::now();
+        body();
+        std::chrono::nanoseconds elapsed = bench_clock::now() - start;
+
+        record(name, size, ops, elapsed.count());
+    }
+
+    void record(const std::string &name, int size, unsigned long ops, double total_ns)
+    {
+        bench_result result;
+        result.name = name;
+        result.size = size;
+        result.ops = ops;
+        result.total_ns = total_ns;
+        results_.push_back(result);
+
+        std::cerr << name << ": " << (ops > 0 ? total_ns / ops : 0) << " ns/op" << std::endl;
+    }
+
+    void print() const
+    {
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+        writer.StartObject();
+        writer.Key("results");
+        writer.StartArray();
+        for (const bench_result &result : results_)
+        {
+            writer.StartObject();
+            writer.Key("name");
+            writer.String(result.name.c_str());
+            writer.Key("size");
+            writer.Int(result.size);
+            writer.Key("ops");
+            writer.Uint64(result.ops);
+            writer.Key("total_ms");
+            writer.Double(result.total_ns / 1e6);
+            writer.Key("ns_per_op");
+            writer.Double(result.ops > 0 ? result.total_ns / result.ops : 0);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+
+        std::cout << sb.GetString() << std::endl;
+    }
+
+private:
+    const bench_options &options_;
+    std::vector<bench_result> results_;
+};
+
+/*
+ * Setting cells, new and existing, and the cycle check that runs inside
+ * every set. The cycle check time comes from its metrics histogram.
+ */
+static void bench_set_cells(bench_runner &runner, const std::string &generator, const sheet_spec &spec, int size)
+{
+    spreadsheet sheet("bench");
+    runner.run("set_new/" + generator, size, spec.size(), [&]() { build(sheet, spec); });
+
+    metric_sample before = metrics::cycle_check_time.sample();
+    runner.run("set_existing/" + generator, size, spec.size(), [&]() { build(sheet, spec); });
+    metric_sample after = metrics::cycle_check_time.sample();
+
+    if (runner.wanted("set_existing/" + generator))
+        runner.record("cycle_check/" + generator, size, after.count - before.count, after.sum - before.sum);
+}
+
+static void bench_copy(bench_runner &runner, const std::string &generator, const sheet_spec &spec, int size, int repeat)
+{
+    if (!runner.wanted("copy/" + generator))
+        return;
+
+    spreadsheet sheet("bench");
+    build(sheet, spec);
+
+    runner.run("copy/" + generator, size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+        {
+            spreadsheet copy(sheet);
+            (void)copy;
+        }
+    });
+}
+
+/*
+ * A snapshot like the one a viewer or a save takes, then one edit to the
+ * spreadsheet it was taken from, which has to copy what it changes
+ */
+static void bench_snapshot_edit(bench_runner &runner, const std::string &generator, const sheet_spec &spec, int size, int repeat)
+{
+    if (!runner.wanted("snapshot_edit/" + generator))
+        return;
+
+    spreadsheet sheet("bench");
+    build(sheet, spec);
+
+    runner.run("snapshot_edit/" + generator, size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+        {
+            spreadsheet snapshot = sheet.snapshot();
+            sheet.setCellContents(spec[i % spec.size()].name, std::to_string(i), std::vector<std::string>());
+        }
+    });
+}
+
+/*
+ * history edits spread over a few cells, then every one of them undone
+ */
+static void bench_undo(bench_runner &runner, int history)
+{
+    if (!runner.wanted("undo/history"))
+        return;
+
+    spreadsheet sheet("bench");
+    for (int i = 0; i < history; i++)
+        sheet.setCellContents(cell_ref::name(i % 10, 1), std::to_string(i), std::vector<std::string>());
+
+    runner.run("undo/history", history, history, [&]() {
+        std::string cell_name;
+        for (int i = 0; i < history; i++)
+            sheet.undo(cell_name);
+    });
+}
+
+/*
+ * One cell edited history times, then reverted all the way back
+ */
+static void bench_revert(bench_runner &runner, int history)
+{
+    if (!runner.wanted("revert/history"))
+        return;
+
+    spreadsheet sheet("bench");
+    for (int i = 0; i < history; i++)
+        sheet.setCellContents("A1", std::to_string(i), std::vector<std::string>());
+
+    runner.run("revert/history", history, history, [&]() {
+        for (int i = 0; i < history; i++)
+            sheet.revertCell("A1");
+    });
+}
+
+/*
+ * A column of size numbers, each op edits one of them and asks for the
+ * sum of the whole column
+ */
+static void bench_aggregate(bench_runner &runner, int size)
+{
+    if (!runner.wanted("aggregate/column"))
+        return;
+
+    spreadsheet sheet("bench");
+    for (int row = 1; row <= size; row++)
+        sheet.setCellContents(cell_ref::name(0, row), std::to_string(row), std::vector<std::string>());
+
+    cell_range column;
+    column.first_col = column.last_col = 0;
+    column.first_row = 1;
+    column.last_row = size;
+
+    std::mt19937 random(7);
+    double total = 0;
+    runner.run("aggregate/column", size, size, [&]() {
+        for (int i = 0; i < size; i++)
+        {
+            sheet.setCellContents(cell_ref::name(0, random() % size + 1), std::to_string(i), std::vector<std::string>());
+            total += sheet.getRangeStats(column).sum;
+        }
+    });
+    (void)total;
+}
+
+/*
+ * A column of size numbers and RANGE_FORMULAS formulas that add all of it
+ * up. range_formula sets the formulas, with every cell of the range as a
+ * dependency like a client sends, range_edit then edits the numbers
+ */
+#define RANGE_FORMULAS 10
+
+static void bench_ranges(bench_runner &runner, int size)
+{
+    if (!runner.wanted("range_formula/column") && !runner.wanted("range_edit/column"))
+        return;
+
+    spreadsheet sheet("bench");
+    for (int row = 1; row <= size; row++)
+        sheet.setCellContents(cell_ref::name(0, row), std::to_string(row), std::vector<std::string>());
+
+    std::string formula = "=SUM(A1:A" + std::to_string(size) + ")";
+    std::vector<std::string> dependencies;
+    cell_ref::references(formula, dependencies);
+
+    runner.run("range_formula/column", size, RANGE_FORMULAS, [&]() {
+        for (int i = 0; i < RANGE_FORMULAS; i++)
+            sheet.setCellContents(cell_ref::name(1, i + 1), formula, dependencies);
+    });
+
+    std::mt19937 random(7);
+    runner.run("range_edit/column", size, size, [&]() {
+        for (int i = 0; i < size; i++)
+            sheet.setCellContents(cell_ref::name(0, random() % size + 1), std::to_string(i), std::vector<std::string>());
+    });
+}
+
+/*
+ * The range function kernels over a column of KERNEL_ROWS numbers with
+ * every 16th row empty, once with each implementation the CPU runs, so the
+ * vector ones can be compared with the scalar one. kernel_* times them over
+ * one packed array, column_stats reads the same column through the
+ * numeric columns
+ */
+#define KERNEL_ROWS 1000000
+
+static void bench_kernels(bench_runner &runner, int repeat)
+{
+    if (!runner.wanted("kernel_") && !runner.wanted("column_stats/"))
+        return;
+
+    std::vector<double> a(KERNEL_ROWS), b(KERNEL_ROWS);
+    numeric_columns columns;
+    std::mt19937 random(7);
+    std::uniform_real_distribution<double> number(-1000, 1000);
+    for (int row = 0; row < KERNEL_ROWS; row++)
+    {
+        a[row] = row % 16 == 0 ? NAN : number(random);
+        b[row] = number(random);
+        if (!std::isnan(a[row]))
+            columns.set(0, row + 1, a[row]);
+    }
+
+    cell_range column;
+    column.first_col = column.last_col = 0;
+    column.first_row = 1;
+    column.last_row = KERNEL_ROWS;
+
+    unsigned long ops = (unsigned long)KERNEL_ROWS * repeat;
+    std::string best = numeric_kernels::implementation();
+    double total = 0;
+    for (const std::string &name : numeric_kernels::implementations())
+    {
+        numeric_kernels::use(name);
+        runner.run("kernel_sum/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += numeric_kernels::sum(a.data(), KERNEL_ROWS);
+        });
+        runner.run("kernel_count/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += numeric_kernels::count(a.data(), KERNEL_ROWS);
+        });
+        runner.run("kernel_min/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += numeric_kernels::min(a.data(), KERNEL_ROWS);
+        });
+        runner.run("kernel_max/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += numeric_kernels::max(a.data(), KERNEL_ROWS);
+        });
+        runner.run("kernel_sumproduct/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += numeric_kernels::sumproduct(a.data(), b.data(), KERNEL_ROWS);
+        });
+        runner.run("column_stats/" + name, KERNEL_ROWS, ops, [&]() {
+            for (int i = 0; i < repeat; i++)
+                total += columns.stats(column).sum;
+        });
+    }
+    numeric_kernels::use(best);
+    (void)total;
+}
+
+/*
+ * A1 and size formulas that use it, each with a formula of its own that
+ * uses it in turn, so editing A1 recalculates two levels of size formulas.
+ * recalc_serial does it on one thread, recalc_parallel with a work pool of
+ * a thread per core
+ */
+static void bench_recalc(bench_runner &runner, int size, int repeat)
+{
+    if (!runner.wanted("recalc_"))
+        return;
+
+    spreadsheet sheet("bench");
+    sheet.setCellContents("A1", "1", std::vector<std::string>());
+    for (int row = 1; row <= size; row++)
+    {
+        std::string middle = cell_ref::name(1, row);
+        sheet.setCellContents(middle, "=A1*2+" + std::to_string(row), std::vector<std::string>(1, "A1"));
+        sheet.setCellContents(cell_ref::name(2, row), "=" + middle + "/2+SUM(A1:A1)", std::vector<std::string>(1, middle));
+    }
+
+    std::vector<std::string> recalculated;
+    sheet.recalculate(NULL, recalculated);
+
+    work_pool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    int edits = 0;
+    auto edit = [&](work_pool *with) {
+        for (int i = 0; i < repeat; i++)
+        {
+            sheet.setCellContents("A1", std::to_string(++edits), std::vector<std::string>());
+            recalculated.clear();
+            sheet.recalculate(with, recalculated);
+        }
+    };
+
+    runner.run("recalc_serial/fanout", size, repeat, [&]() { edit(NULL); });
+    runner.run("recalc_parallel/fanout", size, repeat, [&]() { edit(&pool); });
+
+    // The same shape behind a clamp that holds, so every edit stops at the
+    // first formula
+    spreadsheet clamped("bench");
+    clamped.setCellContents("A1", "100", std::vector<std::string>());
+    clamped.setCellContents("B1", "=MIN(A1, 10)", std::vector<std::string>(1, "A1"));
+    for (int row = 1; row <= size; row++)
+    {
+        std::string middle = cell_ref::name(2, row);
+        clamped.setCellContents(middle, "=B1*2+" + std::to_string(row), std::vector<std::string>(1, "B1"));
+        clamped.setCellContents(cell_ref::name(3, row), "=" + middle + "/2", std::vector<std::string>(1, middle));
+    }
+
+    recalculated.clear();
+    clamped.recalculate(NULL, recalculated);
+    runner.run("recalc_serial/clamped", size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+        {
+            clamped.setCellContents("A1", std::to_string(100 + ++edits), std::vector<std::string>());
+            recalculated.clear();
+            clamped.recalculate(NULL, recalculated);
+        }
+    });
+}
+
+static void bench_cell_names(bench_runner &runner, const sheet_spec &spec, int size, int repeat)
+{
+    if (!runner.wanted("get_all_cell_names/grid"))
+        return;
+
+    spreadsheet sheet("bench");
+    build(sheet, spec);
+
+    runner.run("get_all_cell_names/grid", size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+            sheet.getAllCellNames();
+    });
+}
+
+/*
+ * Serializing, saving to a file and opening the file again
+ */
+static void bench_round_trip(bench_runner &runner, const std::string &generator, const sheet_spec &spec, int size, int repeat)
+{
+    std::string name = "bench_round_trip_" + std::to_string(getpid());
+    spreadsheet sheet(name);
+    build(sheet, spec);
+
+    runner.run("serialize/" + generator, size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+            JSON_message::save_spreadsheet(sheet);
+    });
+
+    if (!runner.wanted("save/" + generator) && !runner.wanted("open/" + generator))
+        return;
+
+    mkdir("spreadsheets", 0755);
+
+    runner.run("save/" + generator, size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+            sheet.saveSpreadsheet();
+    });
+
+    // Open needs the file there even when save wasn't timed
+    if (!runner.wanted("save/" + generator))
+        sheet.saveSpreadsheet();
+
+    runner.run("open/" + generator, size, repeat, [&]() {
+        for (int i = 0; i < repeat; i++)
+            JSON_message::open_spreadsheet(name);
+    });
+
+    std::remove(("spreadsheets/" + name + ".sprd").c_str());
+}
+
+static bool parse_options(int argc, char *argv[], bench_options &options)
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--size")
+            options.size = std::atoi(argv[i + 1]);
+        else if (arg == "--history")
+            options.history = std::atoi(argv[i + 1]);
+        else if (arg == "--repeat")
+            options.repeat = std::atoi(argv[i + 1]);
+        else if (arg == "--only")
+            options.only = argv[i + 1];
+        else
+            return false;
+    }
+
+    return argc % 2 == 1 && options.size > 0 && options.history > 0 && options.repeat > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "Usage: bench [--size N] [--history N] [--repeat N] [--only NAME]" << std::endl;
+        return 1;
+    }
+
+    bench_runner runner(options);
+
+    std::vector<std::pair<std::string, sheet_spec>> generators;
+    generators.push_back(std::make_pair("grid", grid_sheet(options.size)));
+    generators.push_back(std::make_pair("chain", chain_sheet(options.size)));
+    generators.push_back(std::make_pair("star", star_sheet(options.size)));
+    generators.push_back(std::make_pair("dag", dag_sheet(options.size)));
+
+    for (const auto &generator : generators)
+    {
+        bench_set_cells(runner, generator.first, generator.second, options.size);
+        bench_copy(runner, generator.first, generator.second, options.size, options.repeat);
+        bench_snapshot_edit(runner, generator.first, generator.second, options.size, options.repeat);
+    }
+
+    bench_undo(runner, options.history);
+    bench_revert(runner, options.history);
+    bench_cell_names(runner, generators[0].second, options.size, options.repeat);
+    bench_aggregate(runner, options.size);
+    bench_ranges(runner, options.size);
+    bench_kernels(runner, options.repeat);
+    bench_recalc(runner, options.size, options.repeat);
+    bench_round_trip(runner, "grid", generators[0].second, options.size, options.repeat);
+    bench_round_trip(runner, "dag", generators[3].second, options.size, options.repeat);
+
+    runner.print();
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include "cell_ref.h"
+#include <algorithm>
+#include <cctype>
+#include <unordered_set>
+
+/*
+ * A cell reference found in a formula, e.g. "$B12" at [begin, end)
+ */
+struct formula_reference
+{
+    std::size_t begin;
+    std::size_t end;
+    int col;
+    int row;
+    bool abs_col;
+    bool abs_row;
+};
+
+static bool is_name_char(char ch)
+{
+    return std::isalnum((unsigned char)ch) || ch == '_' || ch == '.';
+}
+
+/*
+ * Finds the references in a formula, in order. Text in double quotes,
+ * function names (followed by a '(') and numbers like 1E10 aren't
+ * references. Contents that aren't a formula have none.
+ */
+static std::vector<formula_reference> find_references(const std::string &formula)
+{
+    std::vector<formula_reference> found;
+    if (formula.empty() || formula[0] != '=')
+        return found;
+
+    std::size_t i = 1;
+    while (i < formula.size())
+    {
+        char ch = formula[i];
+
+        if (ch == '"')
+        {
+            std::size_t close = formula.find('"', i + 1);
+            i = close == std::string::npos ? formula.size() : close + 1;
+            continue;
+        }
+
+        if ((ch != '$' && !std::isalpha((unsigned char)ch)) || is_name_char(formula[i - 1]) || formula[i - 1] == '$')
+        {
+            i++;
+            continue;
+        }
+
+        formula_reference ref;
+        ref.begin = i;
+        std::size_t j = i;
+
+        ref.abs_col = formula[j] == '$';
+        if (ref.abs_col)
+            j++;
+        std::size_t letters = j;
+        while (j < formula.size() && std::isalpha((unsigned char)formula[j]))
+            j++;
+        std::size_t letters_end = j;
+
+        ref.abs_row = j < formula.size() && formula[j] == '$';
+        if (ref.abs_row)
+            j++;
+        std::size_t digits = j;
+        while (j < formula.size() && std::isdigit((unsigned char)formula[j]))
+            j++;
+
+        bool ends = j == formula.size() || (!is_name_char(formula[j]) && formula[j] != '(');
+        if (letters_end > letters && j > digits && ends &&
+            cell_ref::parse(formula.substr(letters, letters_end - letters) + formula.substr(digits, j - digits), ref.col, ref.row))
+        {
+            ref.end = j;
+            found.push_back(ref);
+        }
+
+        // Skip the rest of the word either way
+        while (j < formula.size() && is_name_char(formula[j]))
+            j++;
+        i = std::max(j, i + 1);
+    }
+
+    return found;
+}
+
+static void append_reference(std::string &out, const formula_reference &ref, int col, int row)
+{
+    if (ref.abs_col)
+        out += '$';
+    out += cell_ref::column_name(col);
+    if (ref.abs_row)
+        out += '$';
+    out += std::to_string(row);
+}
+
+/*
+ * Whether the reference at i is the first corner of a range, "A1:B3" is two
+ * references with a colon between them
+ */
+static bool starts_range(const std::string &formula, const std::vector<formula_reference> &found, std::size_t i)
+{
+    const formula_reference &ref = found[i];
+    return i + 1 < found.size() && ref.end < formula.size() && formula[ref.end] == ':' && found[i + 1].begin == ref.end + 1;
+}
+
+bool cell_range::contains(int col, int row) const
+{
+    return col >= first_col && col <= last_col && row >= first_row && row <= last_row;
+}
+
+bool cell_range::operator==(const cell_range &other) const
+{
+    return first_col == other.first_col && first_row == other.first_row &&
+           last_col == other.last_col && last_row == other.last_row;
+}
+
+namespace cell_ref
+{
+/*
+ * Splits a cell name into its column and row. Column letters may be
+ * upper or lower case.
+ * Returns false if the name isn't letters followed by a row number.
+ */
+bool parse(const std::string &cell_name, int &col, int &row)
+{
+    std::size_t i = 0;
+    long c = 0;
+
+    while (i < cell_name.size() && std::isalpha((unsigned char)cell_name[i]))
+    {
+        c = c * 26 + (std::toupper((unsigned char)cell_name[i]) - 'A' + 1);
+        if (c > 1000000)
+            return false;
+        i++;
+    }
+
+    if (i == 0 || i == cell_name.size())
+        return false;
+
+    long r = 0;
+    for (; i < cell_name.size(); i++)
+    {
+        if (!std::isdigit((unsigned char)cell_name[i]))
+            return false;
+        r = r * 10 + (cell_name[i] - '0');
+        if (r > 100000000)
+            return false;
+    }
+
+    col = (int)(c - 1);
+    row = (int)r;
+    return true;
+}
+
+/*
+ * Builds the cell name for a column and row, the opposite of parse
+ */
+std::string name(int col, int row)
+{
+    return column_name(col) + std::to_string(row);
+}
+
+/*
+ * The letters of a zero based column, 0 is "A", 26 is "AA"
+ */
+std::string column_name(int col)
+{
+    std::string letters;
+    for (int c = col + 1; c > 0; c = (c - 1) / 26)
+        letters.insert(letters.begin(), (char)('A' + (c - 1) % 26));
+
+    return letters;
+}
+
+/*
+ * Parses "A1:C10" (either corner order) or a single cell "B2".
+ * Returns false if either end isn't a cell name.
+ */
+bool parse_range(const std::string &range, cell_range &out)
+{
+    std::size_t colon = range.find(':');
+    int col1, row1, col2, row2;
+
+    if (colon == std::string::npos)
+    {
+        if (!parse(range, col1, row1))
+            return false;
+        col2 = col1;
+        row2 = row1;
+    }
+    else if (!parse(range.substr(0, colon), col1, row1) || !parse(range.substr(colon + 1), col2, row2))
+    {
+        return false;
+    }
+
+    out.first_col = std::min(col1, col2);
+    out.last_col = std::max(col1, col2);
+    out.first_row = std::min(row1, row2);
+    out.last_row = std::max(row1, row2);
+    return true;
+}
+/*
+ * Rewrites every cell reference in a formula with where the mapper moves
+ * it, keeping its $ signs. References to cells that are gone become #REF!
+ * Given range_mover, ranges are moved by it as a whole, each corner keeping
+ * the side of the range it was on. Otherwise their corners are moved by the
+ * mapper like any other reference.
+ * Contents that aren't a formula come back unchanged.
+ */
+std::string rewrite_references(const std::string &formula, const reference_mapper &mapper, const range_mapper &range_mover)
+{
+    std::vector<formula_reference> found = find_references(formula);
+    if (found.empty())
+        return formula;
+
+    std::string rewritten;
+    std::size_t copied = 0;
+
+    for (std::size_t i = 0; i < found.size(); i++)
+    {
+        const formula_reference &ref = found[i];
+        rewritten.append(formula, copied, ref.begin - copied);
+        copied = ref.end;
+
+        if (range_mover && starts_range(formula, found, i))
+        {
+            const formula_reference &other = found[++i];
+            copied = other.end;
+
+            cell_range range;
+            range.first_col = std::min(ref.col, other.col);
+            range.last_col = std::max(ref.col, other.col);
+            range.first_row = std::min(ref.row, other.row);
+            range.last_row = std::max(ref.row, other.row);
+            if (!range_mover(range) || range.first_col < 0 || range.first_row < 1 ||
+                range.last_col < range.first_col || range.last_row < range.first_row)
+            {
+                rewritten += "#REF!";
+                continue;
+            }
+
+            append_reference(rewritten, ref, ref.col <= other.col ? range.first_col : range.last_col,
+                             ref.row <= other.row ? range.first_row : range.last_row);
+            rewritten += ':';
+            append_reference(rewritten, other, ref.col <= other.col ? range.last_col : range.first_col,
+                             ref.row <= other.row ? range.last_row : range.first_row);
+            continue;
+        }
+
+        int col = ref.col;
+        int row = ref.row;
+        if (!mapper(col, row, ref.abs_col, ref.abs_row) || col < 0 || row < 1)
+        {
+            rewritten += "#REF!";
+            continue;
+        }
+        append_reference(rewritten, ref, col, row);
+    }
+
+    rewritten.append(formula, copied, std::string::npos);
+    return rewritten;
+}
+
+/*
+ * Finds the cells and ranges a formula refers to, in order. A single cell
+ * is a range with one cell in it.
+ */
+static std::vector<cell_range> find_ranges(const std::string &formula)
+{
+    std::vector<formula_reference> found = find_references(formula);
+    std::vector<cell_range> ranges;
+
+    for (std::size_t i = 0; i < found.size(); i++)
+    {
+        const formula_reference &ref = found[i];
+
+        cell_range range;
+        range.first_col = range.last_col = ref.col;
+        range.first_row = range.last_row = ref.row;
+
+        if (starts_range(formula, found, i))
+        {
+            const formula_reference &other = found[++i];
+            range.first_col = std::min(ref.col, other.col);
+            range.last_col = std::max(ref.col, other.col);
+            range.first_row = std::min(ref.row, other.row);
+            range.last_row = std::max(ref.row, other.row);
+        }
+
+        ranges.push_back(range);
+    }
+
+    return ranges;
+}
+
+/*
+ * Appends the name of every cell a formula refers to, once each. A range
+ * like A1:B3 refers to every cell in it.
+ */
+void references(const std::string &formula, std::vector<std::string> &cell_names)
+{
+    std::unordered_set<std::string> seen;
+
+    for (const auto &range : find_ranges(formula))
+    {
+        for (int col = range.first_col; col <= range.last_col; col++)
+        {
+            for (int row = range.first_row; row <= range.last_row; row++)
+            {
+                std::string cell_name = name(col, row);
+                if (seen.insert(cell_name).second)
+                    cell_names.push_back(cell_name);
+            }
+        }
+    }
+}
+
+/*
+ * Like references, but ranges of more than one cell are appended to
+ * ranges as they are instead of one name per cell, once each.
+ */
+void references(const std::string &formula, std::vector<std::string> &cell_names, std::vector<cell_range> &ranges)
+{
+    std::unordered_set<std::string> seen;
+
+    for (const auto &range : find_ranges(formula))
+    {
+        if (range.first_col != range.last_col || range.first_row != range.last_row)
+        {
+            if (std::find(ranges.begin(), ranges.end(), range) == ranges.end())
+                ranges.push_back(range);
+            continue;
+        }
+
+        std::string cell_name = name(range.first_col, range.first_row);
+        if (seen.insert(cell_name).second)
+            cell_names.push_back(cell_name);
+    }
+}
+} // namespace cell_ref
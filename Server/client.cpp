@@ -14,135 +14,294 @@
 #include <utility>
 #include "asio.hpp"
 #include "client.h"
+#include "metrics.h"
+#include "logger.h"
 
 using asio::ip::tcp;
 
 client::client(tcp::socket socket, int id)
-    : socket_(std::move(socket)), id_(id)
+    : state(AWAITING_OPEN), wants_values(false), socket_(std::move(socket)), id_(id)
 {
-    message_length = 0;
-    newlines = 0;
+    connected_ = true;
+    reading_ = false;
+    writing_ = false;
 }
 
-void client::get_data()
+client::~client()
 {
-    socket_.async_read_some(asio::buffer(this->message, max_length),
-                            [this](std::error_code ec, std::size_t length) {
+    // Nothing to free, the socket closes itself
+}
+
+void client::start()
+{
+    do_read();
+}
+
+/*
+ * Reads whatever the socket has, then hands every complete frame to
+ * message_func. The handler keeps the client alive while the read is pending.
+ */
+void client::do_read()
+{
+    reading_ = true;
+    auto self(shared_from_this());
+    socket_.async_read_some(asio::buffer(buffer_, max_length),
+                            [this, self](std::error_code ec, std::size_t length) {
                                 if (!ec)
                                 {
-                                    char buf[2048];
-                                    snprintf(buf, length, message);
-                                    buf[length] = 0;
-                                    std::cout << "recieved id: " << this->id_
-                                              << " w/ length: " << length << ": " << buf << std::endl;
-                                    message_length = length;
-
-                                    for(int i = length; i < max_length; i++)
-                                        message[i] = '\0';
-                                    
-                                    callback_func(this);
+                                    stream_.append(buffer_, length);
+
+                                    if (stream_.size() > max_message_length)
+                                    {
+                                        // No terminator in sight, drop the client
+                                        close();
+                                        return;
+                                    }
+
+                                    dispatch_frames();
+
+                                    if (!connected_)
+                                        return;
+
+                                    // Wait for the client to drain its writes before reading more
+                                    if (pending_writes() > max_pending_writes)
+                                        reading_ = false;
+                                    else
+                                        do_read();
                                 }
                                 else
                                 {
-                                    disconnect_func(this);
-                                    // Now, provided there are no more references or pointers to the socket, the
-                                    // socket will fall out of scope and the destructor will clean everything up
+                                    close();
                                 }
                             });
 }
 
-// void client::get_data()
-// {
-//     socket_.async_read_some(asio::buffer(this->buffer, max_length),
-//                             [this](std::error_code ec, std::size_t length) {
-//                                 if (!ec)
-//                                 {
-//                                     // char buf[2048];
-//                                     // snprintf(buf, length, message);
-//                                     // buf[length] = 0;
-//                                     // std::cout << buf << std::endl;
-
-//                                     // If the message recieved filled the buffer
-//                                     if (length == max_length)
-//                                     {
-//                                         stream.append(buffer);
-//                                         this->get_data();
-//                                         return;
-//                                     }
-
-//                                     // Check and make sure the message ends in two newlines
-//                                     if(buffer[max_length - 2] != '\n')
-//                                         newlines++;
-//                                     if(buffer[max_length - 1] != '\n')
-//                                         newlines++;
-
-//                                     if (newlines == 2)
-//                                     {
-//                                         // Didn't end in two newlines, add the data to the message, then get more data
-//
-//                                         this->get_data();
-//                                     }
-//                                     else
-//                                     {
-//                                         message_length = length;
-//                                         callback_func(this);
-//                                     }
-//                                 }
-//                                 else
-//                                 {
-//                                     disconnect_func(this);
-//                                     // Now, provided there are no more references or pointers to the socket, the
-//                                     // socket will fall out of scope and the destructor will clean everything up
-//                                 }
-//                             });
-// }
-
-void client::write_data(char *data, std::size_t length)
-{
-    asio::async_write(socket_, asio::buffer(data, length),
-                      [this](std::error_code ec, std::size_t length) {
-                          if (!ec)
-                          {
-                              // do nothing - no callback
-                              // do_read();
-                          }
-                          else
-                          {
-                              this->disconnect_client();
-                              // Now, provided there are no more references or pointers to the socket, the
-                              // socket will fall out of scope and the destructor will clean everything up
-                          }
-                      });
+/*
+ * Every message in the protocol ends with two newlines. Pull every
+ * complete message out of the stream and dispatch them in order.
+ */
+void client::dispatch_frames()
+{
+    std::size_t start = 0;
+    std::size_t end;
+
+    while (connected_ && (end = stream_.find("\n\n", start)) != std::string::npos)
+    {
+        message.assign(stream_, start, end - start);
+        start = end + 2;
+
+        // Ignore blank frames (e.g. extra newlines between messages)
+        if (message.find_first_not_of(" \r\n\t") == std::string::npos)
+            continue;
+
+        // Messages can hold anything a user typed, they're only logged when asked for
+        if (logger::payloads_enabled())
+        {
+            LOG(LOG_DEBUG, "received").field("id", id_).field("length", message.size()).field("payload", message);
+        }
+
+        message_func(shared_from_this());
+    }
+
+    stream_.erase(0, start);
 }
 
 void client::write_data(std::string data)
 {
-    // std::cout << "data: " << data << std::endl;
+    write_data(std::make_shared<const std::string>(std::move(data)));
+}
+
+/*
+ * Queues a message. The same buffer can be queued on any number of
+ * clients, so a broadcast only serializes its message once.
+ * Safe to call from any thread. Messages are sent in the order they were
+ * queued, the sending itself is handed over to the client's io_context.
+ */
+void client::write_data(const std::shared_ptr<const std::string> &data)
+{
+    queue_write(data, message_stream());
+}
+
+/*
+ * Queues a stream of messages. The stream is called on the client's
+ * io_context whenever the previous message has been sent, until it
+ * returns NULL. Nothing else is sent to the client in between.
+ * The stream is called without any of the client's locks held, it is
+ * free to take the server's lock.
+ */
+void client::write_stream(message_stream stream)
+{
+    queue_write(std::shared_ptr<const std::string>(), stream);
+}
+
+/*
+ * Compression starts at this point in the queue. The compressor keeps
+ * everything the client was sent recently, so the messages compress
+ * against each other.
+ */
+void client::enable_compression()
+{
+    write_stream([this]() -> std::shared_ptr<const std::string> {
+        compressor_.reset(new lz_compressor());
+        return NULL;
+    });
+}
+
+void client::queue_write(const std::shared_ptr<const std::string> &data, message_stream stream)
+{
+    bool start_writing = false;
+
+    write_lock_.lock();
+    if (connected_)
+    {
+        write_queue_.push_back(std::make_pair(data, stream));
+        metrics::write_queue_depth.record(write_queue_.size());
+
+        // If a write is already in flight, it will pick this one up when it finishes
+        start_writing = !writing_;
+        writing_ = true;
+    }
+    write_lock_.unlock();
+
+    if (start_writing)
+    {
+        auto self(shared_from_this());
+        asio::dispatch(socket_.get_executor(), [this, self]() { do_write(); });
+    }
+}
+
+void client::do_write()
+{
+    write_lock_.lock();
+    std::shared_ptr<const std::string> data = write_queue_.front().first;
+    message_stream stream = write_queue_.front().second;
+    write_lock_.unlock();
+
+    auto self(shared_from_this());
+
+    // do_write can run inside write_data, whose caller may hold locks the
+    // stream needs, so streams always run from a fresh handler
+    if (!data)
+    {
+        asio::post(socket_.get_executor(), [this, self, stream]() {
+            if (!connected_)
+                return;
+
+            std::shared_ptr<const std::string> next = stream();
+            if (next)
+                write_next(next);
+            else
+                finish_write(true);
+        });
+        return;
+    }
+
+    write_next(data);
+}
+
+void client::write_next(std::shared_ptr<const std::string> data)
+{
+    // A message queued on several clients is compressed separately for
+    // each of them, each compressor has its own history
+    if (compressor_)
+        data = std::make_shared<const std::string>(compressor_->compress(*data));
+
+    metrics::bytes_sent.add(data->size());
 
-    asio::async_write(socket_, asio::buffer(data),
-                      [this](std::error_code ec, std::size_t length) {
+    auto self(shared_from_this());
+    asio::async_write(socket_, asio::buffer(*data),
+                      [this, self, data](std::error_code ec, std::size_t length) {
                           if (!ec)
-                          {
-                              // do nothing - no callback
-                              // do_read();
-                          }
+                              finish_write(false);
                           else
-                          {
-                              this->disconnect_client();
-                              // Now, provided there are no more references or pointers to the socket, the
-                              // socket will fall out of scope and the destructor will clean everything up
-                          }
+                              close();
                       });
 }
 
 /*
- * Call the disconnect callback function
- * then free the client.
+ * Called once the front of the queue has been sent. A stream stays at the
+ * front until it runs out of messages.
+ */
+void client::finish_write(bool stream_done)
+{
+    write_lock_.lock();
+    if (write_queue_.front().first || stream_done)
+        write_queue_.pop_front();
+    std::size_t pending = write_queue_.size();
+    writing_ = pending > 0;
+    write_lock_.unlock();
+
+    if (pending > 0 && connected_)
+        do_write();
+
+    // Reading was paused for backpressure, resume it
+    if (!reading_ && connected_ && pending <= max_pending_writes / 2)
+        do_read();
+}
+
+/*
+ * Close the socket and call the disconnect callback function.
+ * Safe to call more than once, and from any thread, only the first call
+ * does anything. The client itself is freed once the last pending handler
+ * lets go of it.
  */
 void client::disconnect_client()
 {
-    disconnect_func(this);
-    delete (this);
+    auto self(shared_from_this());
+    asio::dispatch(socket_.get_executor(), [this, self]() { close(); });
+}
+
+void client::close()
+{
+    if (!connected_)
+        return;
+
+    connected_ = false;
+
+    std::error_code ignored;
+    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+
+    if (disconnect_func)
+        disconnect_func(shared_from_this());
+}
+
+bool client::is_connected() const
+{
+    return connected_;
+}
+
+/*
+ * Returns true if the cell is inside one of the client's viewports,
+ * or if the client didn't subscribe to any part of the spreadsheet.
+ */
+bool client::sees_cell(const std::string &cell_name) const
+{
+    if (viewports.empty())
+        return true;
+
+    int col, row;
+    if (!cell_ref::parse(cell_name, col, row))
+        return false;
+
+    for (const auto &viewport : viewports)
+    {
+        if (viewport.contains(col, row))
+            return true;
+    }
+
+    return false;
+}
+
+std::size_t client::pending_writes()
+{
+    std::lock_guard<std::mutex> guard(write_lock_);
+    return write_queue_.size();
+}
+
+asio::io_context::executor_type client::get_executor()
+{
+    return socket_.get_executor();
 }
 
 int client::get_id()
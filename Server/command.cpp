@@ -22,6 +22,11 @@ open_command::open_command(const std::string &name, const std::string &username,
 	this->name = name;
 	this->username = username;
 	this->password = password;
+	this->has_version = false;
+	this->epoch = 0;
+	this->version = 0;
+	this->read_only = false;
+	this->values = false;
 }
 
 open_command::~open_command()
@@ -43,6 +48,68 @@ const std::string open_command::get_password() const
 	return password;
 }
 
+void open_command::set_version(unsigned long epoch, unsigned long version)
+{
+	this->has_version = true;
+	this->epoch = epoch;
+	this->version = version;
+}
+
+bool open_command::has_last_version() const
+{
+	return has_version;
+}
+
+unsigned long open_command::get_version() const
+{
+	return version;
+}
+
+unsigned long open_command::get_epoch() const
+{
+	return epoch;
+}
+
+void open_command::set_ranges(const std::vector<std::string> &ranges)
+{
+	this->ranges = ranges;
+}
+
+const std::vector<std::string> open_command::get_ranges() const
+{
+	return ranges;
+}
+
+void open_command::set_compression(const std::string &compression)
+{
+	this->compression = compression;
+}
+
+const std::string open_command::get_compression() const
+{
+	return compression;
+}
+
+void open_command::set_read_only(bool read_only)
+{
+	this->read_only = read_only;
+}
+
+bool open_command::is_read_only() const
+{
+	return read_only;
+}
+
+void open_command::set_values(bool values)
+{
+	this->values = values;
+}
+
+bool open_command::wants_values() const
+{
+	return values;
+}
+
 // ======== Edit ========
 edit_command::edit_command(const std::string &cell, const std::string &value, const std::vector<std::string> &dependencies)
 	: command("edit")
@@ -120,6 +187,16 @@ close_command::~close_command()
 {
 }
 
+// ======== Stats ========
+stats_command::stats_command()
+	: command("stats")
+{
+}
+
+stats_command::~stats_command()
+{
+}
+
 // ======== User ========
 user_command::user_command(std::string order, std::string username, std::string password)
 	: command("user")
@@ -165,4 +242,159 @@ std::string sheet_command::get_order()
 std::string sheet_command::get_name()
 {
 	return name;
-}
\ No newline at end of file
+}
+
+// ======== Subscribe ========
+subscribe_command::subscribe_command(const std::vector<std::string> &ranges)
+	: command("subscribe")
+{
+	this->ranges = ranges;
+}
+
+subscribe_command::~subscribe_command()
+{
+}
+
+const std::vector<std::string> subscribe_command::get_ranges() const
+{
+	return ranges;
+}
+
+// ======== Fill ========
+fill_command::fill_command(const std::string &source, const std::string &range)
+	: command("fill")
+{
+	this->source = source;
+	this->range = range;
+}
+
+fill_command::~fill_command()
+{
+}
+
+const std::string fill_command::get_source() const
+{
+	return source;
+}
+
+const std::string fill_command::get_range() const
+{
+	return range;
+}
+
+// ======== Clear ========
+clear_command::clear_command(const std::string &range)
+	: command("clear")
+{
+	this->range = range;
+}
+
+clear_command::~clear_command()
+{
+}
+
+const std::string clear_command::get_range() const
+{
+	return range;
+}
+
+// ======== Insert/Delete Rows ========
+rows_command::rows_command(const std::string &type, int row, int count)
+	: command(type)
+{
+	this->row = row;
+	this->count = count;
+}
+
+rows_command::~rows_command()
+{
+}
+
+int rows_command::get_row() const
+{
+	return row;
+}
+
+int rows_command::get_count() const
+{
+	return count;
+}
+
+// ======== Move ========
+move_command::move_command(const std::string &range, const std::string &to)
+	: command("move")
+{
+	this->range = range;
+	this->to = to;
+}
+
+move_command::~move_command()
+{
+}
+
+const std::string move_command::get_range() const
+{
+	return range;
+}
+
+const std::string move_command::get_to() const
+{
+	return to;
+}
+
+// ======== Tap ========
+tap_command::tap_command(const std::vector<std::string> &sheets, const std::vector<std::string> &users,
+						 const std::vector<std::string> &types, unsigned int sample, int rate)
+	: command("tap")
+{
+	this->sheets = sheets;
+	this->users = users;
+	this->types = types;
+	this->sample = sample;
+	this->rate = rate;
+}
+
+tap_command::~tap_command()
+{
+}
+
+const std::vector<std::string> tap_command::get_sheets() const
+{
+	return sheets;
+}
+
+const std::vector<std::string> tap_command::get_users() const
+{
+	return users;
+}
+
+const std::vector<std::string> tap_command::get_types() const
+{
+	return types;
+}
+
+unsigned int tap_command::get_sample() const
+{
+	return sample;
+}
+
+int tap_command::get_rate() const
+{
+	return rate;
+}
+
+// ======== Aggregate ========
+aggregate_command::aggregate_command(const std::string &range)
+	: command("aggregate")
+{
+	this->range = range;
+}
+
+aggregate_command::~aggregate_command()
+{
+}
+
+const std::string aggregate_command::get_range() const
+{
+	return range;
+}
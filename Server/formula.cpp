@@ -0,0 +1,363 @@
+#include "formula.h"
+#include "cell_ref.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+/*
+ * A function argument, a range or a single value
+ */
+struct formula_argument
+{
+    bool is_range;
+    cell_range range;
+    double value;
+};
+
+/*
+ * Recursive descent over the formula, lowest precedence first:
+ *   comparison := additive [(= <> < > <= >=) additive]
+ *   additive   := term {(+ -) term}
+ *   term       := power {(* /) power}
+ *   power      := unary {^ unary}
+ *   unary      := (- +) unary | primary
+ *   primary    := number | reference | name(arguments) | (comparison)
+ * Errors make the value NaN, which carries through to the result.
+ */
+class formula_parser
+{
+public:
+    formula_parser(const std::string &text, const numeric_columns &values)
+        : text(text), pos(1), depth(0), failed(false), values(values)
+    {
+    }
+
+    double parse()
+    {
+        double result = comparison();
+        skip_spaces();
+        if (failed || pos != text.size() || !std::isfinite(result))
+            return std::numeric_limits<double>::quiet_NaN();
+        return result;
+    }
+
+private:
+    const std::string &text;
+    std::size_t pos;
+    int depth;
+    bool failed;
+    const numeric_columns &values;
+
+    double fail()
+    {
+        failed = true;
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    void skip_spaces()
+    {
+        while (pos < text.size() && std::isspace((unsigned char)text[pos]))
+            pos++;
+    }
+
+    bool eat(char ch)
+    {
+        skip_spaces();
+        if (pos < text.size() && text[pos] == ch)
+        {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    double comparison()
+    {
+        double left = additive();
+        skip_spaces();
+
+        std::string op;
+        if (text.compare(pos, 2, "<>") == 0 || text.compare(pos, 2, "<=") == 0 || text.compare(pos, 2, ">=") == 0)
+            op = text.substr(pos, 2);
+        else if (pos < text.size() && (text[pos] == '=' || text[pos] == '<' || text[pos] == '>'))
+            op = text.substr(pos, 1);
+        else
+            return left;
+
+        pos += op.size();
+        double right = additive();
+        if (op == "=")
+            return left == right;
+        if (op == "<>")
+            return left != right;
+        if (op == "<")
+            return left < right;
+        if (op == ">")
+            return left > right;
+        if (op == "<=")
+            return left <= right;
+        return left >= right;
+    }
+
+    double additive()
+    {
+        double result = term();
+        while (!failed)
+        {
+            if (eat('+'))
+                result += term();
+            else if (eat('-'))
+                result -= term();
+            else
+                break;
+        }
+        return result;
+    }
+
+    double term()
+    {
+        double result = power();
+        while (!failed)
+        {
+            if (eat('*'))
+                result *= power();
+            else if (eat('/'))
+                result /= power();
+            else
+                break;
+        }
+        return result;
+    }
+
+    double power()
+    {
+        double result = unary();
+        while (!failed && eat('^'))
+            result = std::pow(result, unary());
+        return result;
+    }
+
+    /*
+     * Every nested parenthesis, argument or sign comes through here, so
+     * this is where the depth is kept in check
+     */
+    double unary()
+    {
+        if (++depth > FORMULA_MAX_DEPTH)
+            return fail();
+
+        double result;
+        if (eat('-'))
+            result = -unary();
+        else if (eat('+'))
+            result = unary();
+        else
+            result = primary();
+
+        depth--;
+        return result;
+    }
+
+    double primary()
+    {
+        if (eat('('))
+        {
+            double result = comparison();
+            return eat(')') ? result : fail();
+        }
+        if (pos < text.size() && (std::isdigit((unsigned char)text[pos]) || text[pos] == '.'))
+            return number();
+        return name();
+    }
+
+    double number()
+    {
+        const char *begin = text.c_str() + pos;
+        char *end;
+        double result = std::strtod(begin, &end);
+        if (end == begin)
+            return fail();
+        pos += end - begin;
+        return result;
+    }
+
+    /*
+     * A reference or a function call, a function name is followed by '('
+     */
+    double name()
+    {
+        std::size_t begin = pos;
+        int col, row;
+        if (reference(col, row))
+        {
+            skip_spaces();
+            // A range only makes sense as a function argument
+            if (pos < text.size() && text[pos] == ':')
+                return fail();
+            double value = values.get(col, row);
+            return std::isnan(value) ? 0 : value;
+        }
+
+        pos = begin;
+        std::string function;
+        while (pos < text.size() && std::isalpha((unsigned char)text[pos]))
+            function += std::toupper((unsigned char)text[pos++]);
+        if (function.empty() || !eat('('))
+            return fail();
+
+        std::vector<formula_argument> arguments;
+        if (!eat(')'))
+        {
+            do
+            {
+                formula_argument argument;
+                if (!parse_argument(argument))
+                    return fail();
+                arguments.push_back(argument);
+            } while (eat(','));
+
+            if (!eat(')'))
+                return fail();
+        }
+
+        return call(function, arguments);
+    }
+
+    /*
+     * [$]letters[$]digits, not followed by anything that would make it a
+     * longer name or a function call
+     */
+    bool reference(int &col, int &row)
+    {
+        skip_spaces();
+        std::size_t i = pos;
+        std::string cell_name;
+        if (i < text.size() && text[i] == '$')
+            i++;
+        while (i < text.size() && std::isalpha((unsigned char)text[i]))
+            cell_name += text[i++];
+        if (i < text.size() && text[i] == '$')
+            i++;
+        while (i < text.size() && std::isdigit((unsigned char)text[i]))
+            cell_name += text[i++];
+
+        if (i < text.size() && (std::isalnum((unsigned char)text[i]) || text[i] == '_' || text[i] == '('))
+            return false;
+        if (!cell_ref::parse(cell_name, col, row))
+            return false;
+
+        pos = i;
+        return true;
+    }
+
+    bool parse_argument(formula_argument &argument)
+    {
+        std::size_t begin = pos;
+        argument.is_range = false;
+
+        int col, row;
+        if (reference(argument.range.first_col, argument.range.first_row) && eat(':'))
+        {
+            if (!reference(col, row))
+                return false;
+
+            argument.is_range = true;
+            argument.range.last_col = std::max(argument.range.first_col, col);
+            argument.range.last_row = std::max(argument.range.first_row, row);
+            argument.range.first_col = std::min(argument.range.first_col, col);
+            argument.range.first_row = std::min(argument.range.first_row, row);
+            return true;
+        }
+
+        pos = begin;
+        argument.value = comparison();
+        return !failed;
+    }
+
+    /*
+     * The numbers in all of the arguments together, a value counts as one
+     */
+    range_stats gather(const std::vector<formula_argument> &arguments)
+    {
+        range_stats total;
+        for (const formula_argument &argument : arguments)
+        {
+            range_stats part;
+            if (argument.is_range)
+            {
+                part = values.stats(argument.range);
+            }
+            else
+            {
+                part.sum = part.min = part.max = argument.value;
+                part.count = 1;
+            }
+
+            total.sum += part.sum;
+            total.count += part.count;
+            total.min = std::min(total.min, part.min);
+            total.max = std::max(total.max, part.max);
+        }
+        return total;
+    }
+
+    double call(const std::string &function, const std::vector<formula_argument> &arguments)
+    {
+        if (function == "IF")
+        {
+            if (arguments.size() < 2 || arguments.size() > 3 || arguments[0].is_range || arguments[1].is_range ||
+                (arguments.size() == 3 && arguments[2].is_range))
+                return fail();
+            if (arguments[0].value != 0)
+                return arguments[1].value;
+            return arguments.size() == 3 ? arguments[2].value : 0;
+        }
+
+        if (function == "ABS")
+        {
+            if (arguments.size() != 1 || arguments[0].is_range)
+                return fail();
+            return std::fabs(arguments[0].value);
+        }
+
+        if (function == "SUMPRODUCT")
+        {
+            double result;
+            if (arguments.size() == 1 && arguments[0].is_range)
+                return values.stats(arguments[0].range).sum;
+            if (arguments.size() != 2 || !arguments[0].is_range || !arguments[1].is_range ||
+                !values.sumproduct(arguments[0].range, arguments[1].range, result))
+                return fail();
+            return result;
+        }
+
+        range_stats stats = gather(arguments);
+        if (function == "SUM")
+            return stats.sum;
+        if (function == "COUNT")
+            return stats.count;
+        if (function == "AVERAGE")
+            return stats.count == 0 ? fail() : stats.sum / stats.count;
+        if (function == "MIN")
+            return stats.count == 0 ? 0 : stats.min;
+        if (function == "MAX")
+            return stats.count == 0 ? 0 : stats.max;
+
+        return fail();
+    }
+};
+
+namespace formula
+{
+double evaluate(const std::string &contents, const numeric_columns &values)
+{
+    if (contents.empty() || contents[0] != '=')
+        return std::numeric_limits<double>::quiet_NaN();
+
+    formula_parser parser(contents, values);
+    return parser.parse();
+}
+} // namespace formula
@@ -8,6 +8,7 @@
 
 #include "command.h"
 #include "spreadsheet.h"
+#include "metrics.h"
 #include <unordered_map>
 
 /**
@@ -16,7 +17,11 @@
 enum ERROR_TYPE
 {
   INVALID_USER_PASS = 1,
-  CIRC_DEP = 2
+  CIRC_DEP = 2,
+  // A viewer tried to change the spreadsheet
+  READ_ONLY = 3,
+  // A range operation named cells that don't exist or too many of them
+  INVALID_RANGE = 4
 };
 
 namespace JSON_message
@@ -24,12 +29,21 @@ namespace JSON_message
 command *get_type(char const *const data);
 std::string full_send_message(const spreadsheet &s);
 std::string full_send_message(const spreadsheet &s, const std::string &cell_name);
+std::string full_send_message(const spreadsheet &s, const std::vector<std::string> &cell_names);
+std::string full_send_begin_message(const spreadsheet &s, std::size_t cell_count);
+std::string full_send_end_message(const spreadsheet &s);
+std::string range_message(command *cmd, unsigned long version);
+std::string aggregate_message(const std::string &range, const range_stats &stats, unsigned long version);
+std::string values_message(const spreadsheet &s, const std::vector<std::string> &cell_names);
 std::string error_message(ERROR_TYPE, std::string bad_cell);
-std::string spreadsheet_list_message(std::vector<std::string> list);
+std::string spreadsheet_list_message(const std::vector<std::string> &list);
 std::string save_spreadsheet(spreadsheet &s);
 spreadsheet open_spreadsheet(const std::string &filename);
 std::string state_message(std::unordered_map<std::string, std::string> users);
+std::string user_state_message(const std::string &username, const std::string *password);
 std::string send_message(std::string message);
+std::string compression_message(const std::string &codec);
+std::string stats_message(const std::vector<metric_sample> &samples);
 std::unordered_map<std::string, std::string> deserialize_users();
 
 } // namespace JSON_message
@@ -0,0 +1,85 @@
+/* What the admin sees of the messages clients send. Instead of every
+ * message being written to the admin as it arrives, messages are offered
+ * to the tap, which keeps the ones the admin subscribed to in a bounded
+ * queue and sends them from the admin's own io_context as fast as the
+ * admin reads them.
+ *
+ * Offering a message never blocks on the admin. A message the filter
+ * doesn't want costs a few atomic operations and no lock. When the queue
+ * is full the oldest message is dropped, and counted in
+ * metrics::admin_tap_dropped.
+ */
+#ifndef ADMIN_TAP_H
+#define ADMIN_TAP_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include "client.h"
+
+// Most messages waiting for the admin, past that the oldest are dropped
+#define ADMIN_TAP_QUEUE 1024
+// Messages sent to the admin before anything else queued on it gets a turn
+#define ADMIN_TAP_BATCH 64
+// Messages per second the admin gets when it doesn't ask for a rate
+#define ADMIN_TAP_DEFAULT_RATE 1000
+
+/*
+ * Which messages the admin wants. An empty set lets everything through.
+ */
+struct tap_filter
+{
+  std::unordered_set<std::string> sheets;
+  std::unordered_set<std::string> users;
+  // Message types, e.g. "edit" or "open"
+  std::unordered_set<std::string> types;
+  // Keep one in every sample messages that pass the sets
+  unsigned int sample;
+  // Most messages kept per second, 0 for no limit
+  unsigned int rate;
+
+  tap_filter();
+  bool wants(const std::string &sheet, const std::string &user, const std::string &type) const;
+};
+
+class admin_tap
+{
+public:
+  admin_tap();
+
+  // Starts sending admin the messages the filter lets through, replacing
+  // any earlier subscription
+  void subscribe(const client_ptr &admin, const tap_filter &filter);
+  // Stops the tap if admin is the one subscribed
+  void unsubscribe(const client_ptr &admin);
+  // A message a client sent. Safe to call from any thread
+  void offer(const std::string &sheet, const std::string &user, const std::string &type, const std::string &message);
+
+private:
+  bool under_rate_limit(unsigned int rate);
+  std::shared_ptr<const std::string> next_message(const client_ptr &admin, unsigned long stream, int &batch_left);
+  void drain(const client_ptr &admin, unsigned long stream);
+
+  std::atomic<bool> active_;
+  // Only ever swapped with std::atomic_load/std::atomic_store
+  std::shared_ptr<const tap_filter> filter_;
+  std::atomic<unsigned long> passed_;
+  std::atomic<long long> rate_second_;
+  std::atomic<unsigned int> rate_count_;
+
+  // Guards queue_, draining_, stream_, stream_admin_ and admin_
+  std::mutex lock_;
+  std::deque<std::shared_ptr<const std::string>> queue_;
+  // Stream stream_ sending the queue is on stream_admin_'s write queue. It
+  // is left there when its admin unsubscribes, and carries on if the admin
+  // subscribes again before it ends, so there is only ever one
+  bool draining_;
+  unsigned long stream_;
+  std::weak_ptr<client> stream_admin_;
+  std::weak_ptr<client> admin_;
+};
+
+#endif
@@ -0,0 +1,52 @@
+/* Helpers for working with cell names (e.g. "A1", "BC23") as coordinates
+ * and with rectangular ranges of cells (e.g. "A1:C10").
+ */
+#ifndef CELL_REF_H
+#define CELL_REF_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * A rectangle of cells. Columns are zero based (A = 0), rows are the
+ * row numbers as written in the cell name. Both ends are inclusive.
+ **/
+struct cell_range
+{
+  int first_col;
+  int first_row;
+  int last_col;
+  int last_row;
+
+  bool contains(int col, int row) const;
+  bool operator==(const cell_range &other) const;
+};
+
+/**
+ * Moves a cell referenced in a formula. abs_col and abs_row say whether the
+ * reference has a $ in front of its column or row (e.g. $A$1). Returns false
+ * if the cell is gone, the reference becomes #REF!
+ **/
+typedef std::function<bool(int &col, int &row, bool abs_col, bool abs_row)> reference_mapper;
+
+/**
+ * Moves a range referenced in a formula (e.g. A1:A10) as a whole, instead of
+ * moving its corners one by one. Returns false if the whole range is gone,
+ * the reference becomes #REF!
+ **/
+typedef std::function<bool(cell_range &range)> range_mapper;
+
+namespace cell_ref
+{
+bool parse(const std::string &cell_name, int &col, int &row);
+std::string name(int col, int row);
+std::string column_name(int col);
+bool parse_range(const std::string &range, cell_range &out);
+std::string rewrite_references(const std::string &formula, const reference_mapper &mapper,
+                               const range_mapper &range_mover = range_mapper());
+void references(const std::string &formula, std::vector<std::string> &cell_names);
+void references(const std::string &formula, std::vector<std::string> &cell_names, std::vector<cell_range> &ranges);
+} // namespace cell_ref
+
+#endif
@@ -11,48 +11,124 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "asio.hpp"
+#include "cell_ref.h"
+#include "lz_stream.h"
 
 class client;
-//typedef void (*callback)(client *);
+typedef std::shared_ptr<client> client_ptr;
+
+// Produces the next message of a stream, or NULL once the stream is done
+typedef std::function<std::shared_ptr<const std::string>()> message_stream;
 
 using asio::ip::tcp;
 
+/*
+ * Where a connection is in its lifecycle. The server dispatches every
+ * received message on this instead of swapping callbacks around.
+ */
+enum CLIENT_STATE
+{
+  AWAITING_OPEN = 0,
+  EDITING = 1,
+  ADMIN = 2,
+  // Opened the spreadsheet read only, served from its published snapshot
+  VIEWING = 3
+};
+
+/*
+ * A single TCP connection. Clients are always owned through a client_ptr;
+ * every pending asio operation holds a reference, so a client lives until
+ * its socket is closed and the last handler has run.
+ *
+ * Once started, the client runs one read loop for its whole lifetime:
+ * read bytes -> split off every complete "\n\n" terminated frame ->
+ * dispatch each frame to message_func -> read again. Writes are queued and
+ * sent one at a time, in order. A queued stream is asked for its next
+ * message only once the previous one has been sent, so a large reply
+ * never has to sit in memory all at once.
+ *
+ * A client belongs to one io_context and all of its handlers run there.
+ * write_data and disconnect_client may be called from any thread.
+ * write_data queues in call order, then hands the sending over to the
+ * client's io_context.
+ */
 class client
     : public std::enable_shared_from_this<client>
 {
 public:
   client(asio::ip::tcp::socket socket, int id);
-  // Gets data and puts it into the data buffer. MAY BE AN INCOMPLETE MESSAGE
-  void get_data();
-  void write_data(char *data, std::size_t length);
+  ~client();
+
+  // Starts the read loop. Must be called on a client owned by a client_ptr
+  void start();
   void write_data(std::string data);
+  void write_data(const std::shared_ptr<const std::string> &data);
+  void write_stream(message_stream stream);
+  // Everything queued after this is sent as lz_stream frames
+  void enable_compression();
   int get_id();
   void disconnect_client();
+  bool is_connected() const;
+  bool sees_cell(const std::string &cell_name) const;
+  std::size_t pending_writes();
+  asio::io_context::executor_type get_executor();
 
   enum
   {
-    max_length = 2048
+    max_length = 2048,
+    // Largest frame we will buffer before deciding the peer is misbehaving
+    max_message_length = 1 << 20,
+    // Stop reading from a client once this many writes are waiting on it
+    max_pending_writes = 256
   };
-  char message[max_length];
-  char buffer[max_length];
-  std::string stream;
-  int message_length;
-  int newlines;
+  // The frame currently being dispatched, without its "\n\n" terminator
+  std::string message;
+  CLIENT_STATE state;
   std::string connected_spreadsheet;
+  // Who the client logged in as, set once it opens a spreadsheet
+  std::string username;
+  // The parts of the spreadsheet the client is showing, empty for all of it
+  std::vector<cell_range> viewports;
+  // Whether the client asked for the values of formulas
+  bool wants_values;
+
+  std::function<void(const client_ptr &)> message_func;
+  std::function<void(const client_ptr &)> disconnect_func;
 
-  // callback callback_func;
-  // callback disconnect_func;
-  // std::function<callback> callback_func;
-  // std::function<callback> disconnect_func;
-  std::function<void(client *)> callback_func;
-  std::function<void(client *)> disconnect_func;
+  // Released when the client is freed, gives back the connection's admission slot
+  std::shared_ptr<void> connection_slot;
 
 private:
+  void do_read();
+  void do_write();
+  void dispatch_frames();
+  void close();
+  void queue_write(const std::shared_ptr<const std::string> &data, message_stream stream);
+  void write_next(std::shared_ptr<const std::string> data);
+  void finish_write(bool stream_done);
+
   asio::ip::tcp::socket socket_;
   int id_;
+  std::atomic<bool> connected_;
+  bool reading_;
+  // write_lock_ guards the write queue and writing_ (a write is in flight)
+  std::mutex write_lock_;
+  bool writing_;
+  char buffer_[max_length];
+  // Bytes received that don't make up a complete frame yet
+  std::string stream_;
+  // Each entry is a message, or a stream when the message is NULL
+  std::deque<std::pair<std::shared_ptr<const std::string>, message_stream>> write_queue_;
+  // Only used on the client's io_context, NULL until compression is enabled
+  std::unique_ptr<lz_compressor> compressor_;
 };
 
 #endif
@@ -27,6 +27,13 @@ private:
   std::string name;
   std::string username;
   std::string password;
+  bool has_version;
+  unsigned long epoch;
+  unsigned long version;
+  std::vector<std::string> ranges;
+  std::string compression;
+  bool read_only;
+  bool values;
 
 public:
   /// <summary>
@@ -57,6 +64,55 @@ public:
   /// Returns the password of the user attempting to open the spreadsheet as a string
   /// </summary>
   const std::string get_password() const;
+  /// <summary>
+  /// Sets the last version of the spreadsheet a reconnecting client saw, and
+  /// the epoch of the spreadsheet it was numbered in (0 if the client didn't say)
+  /// </summary>
+  void set_version(unsigned long epoch, unsigned long version);
+  /// <summary>
+  /// Returns true if the client sent the last version of the spreadsheet it saw
+  /// </summary>
+  bool has_last_version() const;
+  /// <summary>
+  /// Returns the last version of the spreadsheet the client saw
+  /// </summary>
+  unsigned long get_version() const;
+  /// <summary>
+  /// Returns the epoch the last version the client saw was numbered in
+  /// </summary>
+  unsigned long get_epoch() const;
+  /// <summary>
+  /// Sets the cell ranges the client wants to see from the start
+  /// </summary>
+  void set_ranges(const std::vector<std::string> &ranges);
+  /// <summary>
+  /// Returns the cell ranges the client wants to see, empty for the whole spreadsheet
+  /// </summary>
+  const std::vector<std::string> get_ranges() const;
+  /// <summary>
+  /// Sets the compression the client asked for
+  /// </summary>
+  void set_compression(const std::string &compression);
+  /// <summary>
+  /// Returns the compression the client asked for, empty for none
+  /// </summary>
+  const std::string get_compression() const;
+  /// <summary>
+  /// Sets whether the client only wants to watch the spreadsheet
+  /// </summary>
+  void set_read_only(bool read_only);
+  /// <summary>
+  /// Returns true if the client opened the spreadsheet to view it, not edit it
+  /// </summary>
+  bool is_read_only() const;
+  /// <summary>
+  /// Sets whether the client wants the values of formulas as well as their contents
+  /// </summary>
+  void set_values(bool values);
+  /// <summary>
+  /// Returns true if the client wants to be sent the values the server works out for formulas
+  /// </summary>
+  bool wants_values() const;
 };
 
 class edit_command : public command
@@ -155,6 +211,16 @@ public:
   ~close_command();
 };
 
+class stats_command : public command
+{
+public:
+  /// <summary>
+  /// Constructor for a stats command, the admin asking for the server's metrics.
+  /// </summary>
+  stats_command();
+  ~stats_command();
+};
+
 class user_command : public command
 {
 private:
@@ -196,4 +262,132 @@ public:
   std::string get_name();
 };
 
+class fill_command : public command
+{
+private:
+  std::string source;
+  std::string range;
+
+public:
+  /// <summary>
+  /// Constructor for a fill command.
+  /// <param name="source">The cell to copy, e.g. "A1"</param>
+  /// <param name="range">The cells to copy it into, e.g. "A2:A10000"</param>
+  /// </summary>
+  fill_command(const std::string &source, const std::string &range);
+  ~fill_command();
+  const std::string get_source() const;
+  const std::string get_range() const;
+};
+
+class clear_command : public command
+{
+private:
+  std::string range;
+
+public:
+  /// <summary>
+  /// Constructor for a clear command.
+  /// <param name="range">The cells to empty, e.g. "B2:D20"</param>
+  /// </summary>
+  clear_command(const std::string &range);
+  ~clear_command();
+  const std::string get_range() const;
+};
+
+class rows_command : public command
+{
+private:
+  int row;
+  int count;
+
+public:
+  /// <summary>
+  /// Constructor for an insert_rows or delete_rows command.
+  /// <param name="type">"insert_rows" or "delete_rows"</param>
+  /// <param name="row">The first row inserted or deleted</param>
+  /// <param name="count">How many rows</param>
+  /// </summary>
+  rows_command(const std::string &type, int row, int count);
+  ~rows_command();
+  int get_row() const;
+  int get_count() const;
+};
+
+class move_command : public command
+{
+private:
+  std::string range;
+  std::string to;
+
+public:
+  /// <summary>
+  /// Constructor for a move command.
+  /// <param name="range">The cells to move, e.g. "A1:B10"</param>
+  /// <param name="to">Where the top left cell of the range ends up, e.g. "D5"</param>
+  /// </summary>
+  move_command(const std::string &range, const std::string &to);
+  ~move_command();
+  const std::string get_range() const;
+  const std::string get_to() const;
+};
+
+class subscribe_command : public command
+{
+private:
+  std::vector<std::string> ranges;
+
+public:
+  /// <summary>
+  /// Constructor for a subscribe command.
+  /// <param name="ranges">The cell ranges (e.g. "A1:Z40") the client is showing, empty for the whole spreadsheet</param>
+  /// </summary>
+  subscribe_command(const std::vector<std::string> &ranges);
+  ~subscribe_command();
+  const std::vector<std::string> get_ranges() const;
+};
+
+class tap_command : public command
+{
+private:
+  std::vector<std::string> sheets;
+  std::vector<std::string> users;
+  std::vector<std::string> types;
+  unsigned int sample;
+  int rate;
+
+public:
+  /// <summary>
+  /// Constructor for a tap command, the admin choosing which client messages it is sent.
+  /// <param name="sheets">Only messages about these spreadsheets, empty for all of them</param>
+  /// <param name="users">Only messages from these users, empty for all of them</param>
+  /// <param name="types">Only these message types (e.g. "edit"), empty for all of them</param>
+  /// <param name="sample">Send one in every sample messages, 0 to send none</param>
+  /// <param name="rate">Most messages sent per second, 0 for no limit, negative for the server's default</param>
+  /// </summary>
+  tap_command(const std::vector<std::string> &sheets, const std::vector<std::string> &users,
+              const std::vector<std::string> &types, unsigned int sample, int rate);
+  ~tap_command();
+  const std::vector<std::string> get_sheets() const;
+  const std::vector<std::string> get_users() const;
+  const std::vector<std::string> get_types() const;
+  unsigned int get_sample() const;
+  int get_rate() const;
+};
+
+class aggregate_command : public command
+{
+private:
+  std::string range;
+
+public:
+  /// <summary>
+  /// Constructor for an aggregate command, asking for the sum, count and average of the numbers in a range.
+  /// <param name="range">The cells to add up, e.g. "A1:A100000"</param>
+  /// </summary>
+  aggregate_command(const std::string &range);
+  ~aggregate_command();
+  const std::string get_range() const;
+};
+
 #endif
@@ -0,0 +1,324 @@
+/* Copy-on-write containers for the parts of a spreadsheet that get big.
+ * Copying one only copies a pointer, the copies share everything until one
+ * of them changes, and then only the chunk that changed is copied.
+ *
+ * A container is only ever changed by one thread at a time, like any
+ * other. Other threads can read copies of it meanwhile (e.g. a snapshot
+ * a viewer is being sent), since a chunk shared with another copy is
+ * never changed in place.
+ */
+#ifndef COW_H
+#define COW_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Chunks a cow_table is hashed into, must be a power of two
+#define COW_TABLE_CHUNKS 1024
+// Elements in each chunk of a cow_vector
+#define COW_VECTOR_CHUNK 128
+
+/*
+ * True if p is the only pointer to what it points to, so it can be
+ * changed in place. The fence pairs with the release of the last other
+ * owner, whatever it read happens before we write.
+ */
+template <typename T>
+bool cow_unique(const std::shared_ptr<T> &p)
+{
+  if (p.use_count() != 1)
+    return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return true;
+}
+
+/*
+ * What p points to, copied first if anything else points to it too, or
+ * made if there isn't anything yet
+ */
+template <typename T>
+T &cow_writable(std::shared_ptr<T> &p)
+{
+  if (!p)
+    p = std::make_shared<T>();
+  else if (!cow_unique(p))
+    p = std::make_shared<T>(*p);
+  return *p;
+}
+
+/*
+ * A map from names to V, split by hash over COW_TABLE_CHUNKS chunks.
+ * Reads look like std::unordered_map's. Changes go through operator[],
+ * writable() or erase(), each of which copies at most the list of chunks
+ * and the chunk the name is in.
+ */
+template <typename V>
+class cow_table
+{
+  typedef std::unordered_map<std::string, V> chunk;
+  typedef std::array<std::shared_ptr<chunk>, COW_TABLE_CHUNKS> chunk_list;
+
+public:
+  typedef typename chunk::value_type value_type;
+
+  class const_iterator
+  {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename chunk::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type *pointer;
+    typedef const value_type &reference;
+
+    const_iterator() : chunks_(NULL), index_(COW_TABLE_CHUNKS) {}
+
+    reference operator*() const { return *it_; }
+    pointer operator->() const { return &*it_; }
+
+    const_iterator &operator++()
+    {
+      ++it_;
+      settle();
+      return *this;
+    }
+
+    const_iterator operator++(int)
+    {
+      const_iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    bool operator==(const const_iterator &other) const
+    {
+      return index_ == other.index_ && (index_ == COW_TABLE_CHUNKS || it_ == other.it_);
+    }
+    bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+  private:
+    friend class cow_table;
+
+    const_iterator(const chunk_list *chunks, std::size_t index, typename chunk::const_iterator it)
+        : chunks_(chunks), index_(index), it_(it)
+    {
+    }
+
+    // Moves on past the end of empty chunks
+    void settle()
+    {
+      while (index_ < COW_TABLE_CHUNKS && (!(*chunks_)[index_] || it_ == (*chunks_)[index_]->end()))
+      {
+        if (++index_ < COW_TABLE_CHUNKS && (*chunks_)[index_])
+          it_ = (*chunks_)[index_]->begin();
+      }
+    }
+
+    const chunk_list *chunks_;
+    std::size_t index_;
+    typename chunk::const_iterator it_;
+  };
+
+  cow_table() : size_(0) {}
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const_iterator begin() const
+  {
+    if (!chunks_)
+      return end();
+
+    const_iterator it(chunks_.get(), 0, typename chunk::const_iterator());
+    if ((*chunks_)[0])
+      it.it_ = (*chunks_)[0]->begin();
+    it.settle();
+    return it;
+  }
+
+  const_iterator end() const { return const_iterator(); }
+
+  const_iterator find(const std::string &key) const
+  {
+    std::size_t index = chunk_of(key);
+    if (!chunks_ || !(*chunks_)[index])
+      return end();
+
+    const chunk &c = *(*chunks_)[index];
+    auto it = c.find(key);
+    if (it == c.end())
+      return end();
+    return const_iterator(chunks_.get(), index, it);
+  }
+
+  std::size_t count(const std::string &key) const { return find(key) == end() ? 0 : 1; }
+
+  const V &at(const std::string &key) const
+  {
+    const_iterator it = find(key);
+    if (it == end())
+      throw std::out_of_range("cow_table::at");
+    return it->second;
+  }
+
+  // The value to change, adding it if it isn't there
+  V &operator[](const std::string &key)
+  {
+    chunk &c = writable_chunk(chunk_of(key));
+    auto it = c.find(key);
+    if (it != c.end())
+      return it->second;
+
+    size_++;
+    return c.emplace(key, V()).first->second;
+  }
+
+  // The value to change, or NULL if it isn't there. Nothing is copied then
+  V *writable(const std::string &key)
+  {
+    if (find(key) == end())
+      return NULL;
+    return &writable_chunk(chunk_of(key)).find(key)->second;
+  }
+
+  std::size_t erase(const std::string &key)
+  {
+    if (find(key) == end())
+      return 0;
+
+    writable_chunk(chunk_of(key)).erase(key);
+    size_--;
+    return 1;
+  }
+
+  void clear()
+  {
+    chunks_.reset();
+    size_ = 0;
+  }
+
+  void swap(cow_table &other)
+  {
+    chunks_.swap(other.chunks_);
+    std::swap(size_, other.size_);
+  }
+
+private:
+  static std::size_t chunk_of(const std::string &key)
+  {
+    return std::hash<std::string>()(key) & (COW_TABLE_CHUNKS - 1);
+  }
+
+  chunk &writable_chunk(std::size_t index)
+  {
+    return cow_writable(cow_writable(chunks_)[index]);
+  }
+
+  std::shared_ptr<chunk_list> chunks_;
+  std::size_t size_;
+};
+
+/*
+ * A vector split into chunks of COW_VECTOR_CHUNK elements. Copying one
+ * copies a pointer, and the first change after that copies the list of
+ * chunks and the chunk the change is in. Elements are changed through
+ * writable() instead of a non-const operator[], so reading never copies.
+ */
+template <typename T>
+class cow_vector
+{
+  typedef std::vector<T> chunk;
+  typedef std::vector<std::shared_ptr<chunk>> chunk_list;
+
+public:
+  class const_iterator
+  {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const T *pointer;
+    typedef const T &reference;
+
+    const_iterator(const cow_vector *vec, std::size_t position) : vec_(vec), position_(position) {}
+
+    reference operator*() const { return (*vec_)[position_]; }
+    pointer operator->() const { return &(*vec_)[position_]; }
+    const_iterator &operator++()
+    {
+      position_++;
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const { return position_ == other.position_; }
+    bool operator!=(const const_iterator &other) const { return position_ != other.position_; }
+
+  private:
+    const cow_vector *vec_;
+    std::size_t position_;
+  };
+
+  cow_vector() : size_(0) {}
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const T &operator[](std::size_t position) const
+  {
+    return (*(*chunks_)[position / COW_VECTOR_CHUNK])[position % COW_VECTOR_CHUNK];
+  }
+
+  const T &back() const { return (*this)[size_ - 1]; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size_); }
+
+  // The element to change
+  T &writable(std::size_t position)
+  {
+    chunk &c = cow_writable(cow_writable(chunks_)[position / COW_VECTOR_CHUNK]);
+    return c[position % COW_VECTOR_CHUNK];
+  }
+
+  void push_back(const T &value)
+  {
+    chunk_list &chunks = cow_writable(chunks_);
+    if (size_ % COW_VECTOR_CHUNK == 0)
+    {
+      chunks.push_back(std::make_shared<chunk>());
+      chunks.back()->reserve(COW_VECTOR_CHUNK);
+    }
+
+    cow_writable(chunks.back()).push_back(value);
+    size_++;
+  }
+
+  void pop_back()
+  {
+    chunk_list &chunks = cow_writable(chunks_);
+    size_--;
+    if (size_ % COW_VECTOR_CHUNK == 0)
+      chunks.pop_back();
+    else
+      cow_writable(chunks.back()).pop_back();
+  }
+
+  void clear()
+  {
+    chunks_.reset();
+    size_ = 0;
+  }
+
+private:
+  std::shared_ptr<chunk_list> chunks_;
+  std::size_t size_;
+};
+
+#endif
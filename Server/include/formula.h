@@ -0,0 +1,27 @@
+/* Works out the value of a formula, so the server can recalculate the
+ * formulas an edit affects and send their values to the clients that ask.
+ *
+ * Formulas are numbers, cell references ($ allowed), + - * / ^, the
+ * comparisons = <> < > <= >= (1 for true, 0 for false), parentheses, and
+ * the functions SUM, COUNT, AVERAGE, MIN, MAX, SUMPRODUCT, IF and ABS,
+ * which take ranges (e.g. A1:B10) as well as values. A cell with no
+ * number in it counts as 0, and the range functions skip it.
+ */
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <string>
+#include "numeric_columns.h"
+
+// Deepest parentheses and function calls may nest
+#define FORMULA_MAX_DEPTH 64
+
+namespace formula
+{
+// The value of contents that start with '=', reading the cells it refers
+// to from values. NaN if it has no value: it isn't a formula, it doesn't
+// parse, it calls a function that doesn't exist, it divides by zero...
+double evaluate(const std::string &contents, const numeric_columns &values);
+} // namespace formula
+
+#endif
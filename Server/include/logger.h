@@ -0,0 +1,84 @@
+/* An asynchronous logger for the server. Logging a line formats it into
+ * a slot of a fixed size lock-free ring buffer and returns, a background
+ * thread writes the lines out to stdout. If the ring is full, or more than
+ * LOG_RATE_LIMIT debug and info lines were logged in the last second, the
+ * line is dropped and counted instead of making the caller wait.
+ *
+ * Lines are key=value pairs, e.g.
+ *   2019-04-20T18:02:11.482Z level=info msg="client connected" id=4
+ *
+ * Use the LOG macro, it doesn't build the line at all when the level is off:
+ *   LOG(LOG_INFO, "client connected").field("id", c->get_id());
+ */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstddef>
+#include <string>
+
+// Slots in the ring buffer, must be a power of two
+#define LOG_RING_SIZE 4096
+// Longest line kept, longer lines are cut short
+#define LOG_LINE_LENGTH 512
+// Debug and info lines per second, past that they are dropped until the
+// next second. Warnings and errors are never rate limited
+#define LOG_RATE_LIMIT 10000
+
+enum LOG_LEVEL
+{
+  LOG_DEBUG = 0,
+  LOG_INFO = 1,
+  LOG_WARN = 2,
+  LOG_ERROR = 3
+};
+
+#define LOG(level, event)           \
+  if (!logger::enabled(level))      \
+  {                                 \
+  }                                 \
+  else                              \
+    log_record(level, event)
+
+/**
+ * One line being built. It is queued when it goes out of scope.
+ **/
+class log_record
+{
+public:
+  log_record(LOG_LEVEL level, const char *event);
+  ~log_record();
+
+  log_record &field(const char *key, const std::string &value);
+  log_record &field(const char *key, const char *value);
+  template <typename T>
+  log_record &field(const char *key, T value)
+  {
+    append_key(key);
+    append(std::to_string(value));
+    return *this;
+  }
+
+private:
+  void append_key(const char *key);
+  void append_quoted(const char *value, std::size_t length);
+  void append(const std::string &text);
+
+  LOG_LEVEL level_;
+  std::size_t length_;
+  char text_[LOG_LINE_LENGTH];
+};
+
+namespace logger
+{
+// Starts the thread that writes lines out
+void start(LOG_LEVEL level, bool payloads);
+// Writes out everything still queued, then stops the thread
+void stop();
+
+bool enabled(LOG_LEVEL level);
+// Whether whole messages received from clients are logged, off by default
+bool payloads_enabled();
+bool parse_level(const std::string &name, LOG_LEVEL &level);
+} // namespace logger
+
+#endif
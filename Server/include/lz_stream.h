@@ -0,0 +1,66 @@
+/* A small LZ77 codec (in the style of LZ4) for compressing a stream of
+ * messages. Both ends keep the last LZ_WINDOW bytes of the stream, so a
+ * message can be encoded as references into the messages before it.
+ * That is where most of the savings come from: broadcasts look a lot
+ * like each other.
+ *
+ * A frame is a 4 byte big endian payload length followed by the payload.
+ * The payload is a list of sequences:
+ *
+ *   token (literal length << 4 | (match length - 4)), literal length
+ *   extension, literals, 2 byte little endian offset, match length extension
+ *
+ * A length of 15 in the token is followed by extension bytes that are added
+ * on, a byte of 255 means another byte follows. The last sequence of a frame
+ * only has literals.
+ */
+#ifndef LZ_STREAM_H
+#define LZ_STREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// How far back a match can reach, limited by the 2 byte offset
+#define LZ_WINDOW 65535
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+/**
+ * The sending side of a stream. Frames must be decompressed in the order
+ * they were compressed.
+ **/
+class lz_compressor
+{
+public:
+  lz_compressor();
+
+  // Returns the frame for one message
+  std::string compress(const std::string &message);
+
+private:
+  // The end of the stream, at most LZ_WINDOW bytes
+  std::string window_;
+  // Where window_ starts in the stream
+  std::uint64_t window_start_;
+  // Stream position of the last place each hash was seen
+  std::vector<std::uint64_t> table_;
+};
+
+/**
+ * The receiving side of a stream.
+ **/
+class lz_decompressor
+{
+public:
+  lz_decompressor();
+
+  // Decodes the payload of one frame (without its length) and appends the
+  // message to out. Returns false if the payload is corrupt
+  bool decompress(const std::string &payload, std::string &out);
+
+private:
+  std::string window_;
+};
+
+#endif
@@ -0,0 +1,180 @@
+/* Counters, gauges and latency histograms for seeing where the server
+ * spends its time. Every metric is a fixed global, registered once at
+ * startup, so recording one is a single atomic add and never takes a lock.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Each power of two is split into 2^METRICS_SUB_BUCKET_BITS buckets, so a
+// histogram is accurate to about 6%
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+enum METRIC_TYPE
+{
+  METRIC_COUNTER = 0,
+  METRIC_GAUGE = 1,
+  METRIC_HISTOGRAM = 2
+};
+
+/**
+ * What a metric looked like at one point in time. Histograms fill in the
+ * count, sum and percentiles, counters and gauges only value.
+ **/
+struct metric_sample
+{
+  std::string name;
+  // Prometheus labels, e.g. type="edit", empty for none
+  std::string labels;
+  std::string help;
+  METRIC_TYPE type;
+  std::int64_t value;
+  std::uint64_t count;
+  std::uint64_t sum;
+  std::uint64_t p50;
+  std::uint64_t p90;
+  std::uint64_t p99;
+  std::uint64_t max;
+};
+
+class metric
+{
+public:
+  metric(const std::string &name, const std::string &labels, const std::string &help, METRIC_TYPE type);
+  virtual ~metric();
+
+  virtual metric_sample sample() const = 0;
+
+protected:
+  metric_sample describe() const;
+
+  std::string name_;
+  std::string labels_;
+  std::string help_;
+  METRIC_TYPE type_;
+};
+
+class metric_counter : public metric
+{
+public:
+  metric_counter(const std::string &name, const std::string &labels, const std::string &help);
+
+  void add(std::uint64_t amount = 1);
+  metric_sample sample() const;
+
+private:
+  std::atomic<std::uint64_t> value_;
+};
+
+class metric_gauge : public metric
+{
+public:
+  metric_gauge(const std::string &name, const std::string &labels, const std::string &help);
+
+  void set(std::int64_t value);
+  void add(std::int64_t amount);
+  metric_sample sample() const;
+
+private:
+  std::atomic<std::int64_t> value_;
+};
+
+/**
+ * A log-linear histogram in the style of HdrHistogram. Values below
+ * METRICS_SUB_BUCKETS get a bucket each, above that every power of two
+ * gets METRICS_SUB_BUCKETS buckets.
+ **/
+class metric_histogram : public metric
+{
+public:
+  metric_histogram(const std::string &name, const std::string &labels, const std::string &help);
+
+  void record(std::uint64_t value);
+  std::uint64_t percentile(double p) const;
+  metric_sample sample() const;
+
+  static std::size_t bucket_index(std::uint64_t value);
+  static std::uint64_t bucket_value(std::size_t index);
+
+private:
+  std::atomic<std::uint64_t> buckets_[METRICS_BUCKETS];
+  std::atomic<std::uint64_t> count_;
+  std::atomic<std::uint64_t> sum_;
+  std::atomic<std::uint64_t> max_;
+};
+
+/**
+ * Records how long it lived into a histogram, in nanoseconds.
+ **/
+class metric_timer
+{
+public:
+  explicit metric_timer(metric_histogram &histogram);
+  ~metric_timer();
+
+private:
+  metric_histogram &histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * A std::mutex that records how long every lock() had to wait.
+ * An uncontended lock records 0 without reading the clock.
+ **/
+class metered_mutex
+{
+public:
+  explicit metered_mutex(metric_histogram &wait_time);
+
+  void lock();
+  void unlock();
+  bool try_lock();
+
+private:
+  std::mutex mutex_;
+  metric_histogram &wait_time_;
+};
+
+namespace metrics
+{
+// Every metric the server records
+extern metric_histogram parse_time;
+extern metric_histogram set_cell_time;
+extern metric_histogram range_op_time;
+extern metric_histogram cycle_check_time;
+extern metric_histogram broadcast_fanout;
+extern metric_histogram serialized_bytes;
+extern metric_counter bytes_sent;
+extern metric_histogram write_queue_depth;
+extern metric_histogram save_time;
+extern metric_histogram metadata_save_time;
+extern metric_histogram lock_wait_time;
+extern metric_gauge connected_clients;
+extern metric_counter admin_tap_dropped;
+extern metric_gauge connected_viewers;
+extern metric_gauge registered_clients;
+extern metric_gauge registered_sheet_clients;
+extern metric_histogram snapshot_publish_time;
+extern metric_histogram recalc_time;
+extern metric_histogram recalc_formulas;
+extern metric_histogram recalc_levels;
+extern metric_histogram recalc_unchanged;
+extern metric_histogram recalc_pruned;
+extern metric_counter recalc_parallel_levels;
+
+// The counter for a message type, unknown types share one counter
+metric_counter &messages_parsed(const std::string &type);
+
+std::vector<metric_sample> snapshot();
+std::string prometheus_text();
+} // namespace metrics
+
+#endif
@@ -0,0 +1,97 @@
+/* The numbers in a spreadsheet, typed in or worked out by a formula, laid
+ * out by column as packed doubles. This is the one place values are kept:
+ * formulas, the range functions and the aggregate command all read them
+ * from here.
+ *
+ * Each column is a map of chunks of NUMERIC_CHUNK_ROWS rows, row r of a
+ * column is slot r % NUMERIC_CHUNK_ROWS of chunk r / NUMERIC_CHUNK_ROWS,
+ * and a row with no number is NaN. A chunk only exists while a row in it
+ * has a number, so a number far down a column costs one chunk.
+ *
+ * Every chunk also has a segment tree over groups of NUMERIC_GROUP_ROWS
+ * rows holding the sum, count, min and max of each group. A range reads
+ * the groups it wholly covers off the tree, and runs the kernels in
+ * numeric_kernels.h over the rows of at most two groups at its ends, so
+ * SUM, COUNT, MIN and MAX over any range cost O(log rows) for each chunk
+ * it touches. The summaries are recomputed from the values whenever one
+ * changes, so sums don't drift and min and max survive erases.
+ *
+ * Columns and chunks are copy on write, see cow.h.
+ */
+#ifndef NUMERIC_COLUMNS_H
+#define NUMERIC_COLUMNS_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include "cell_ref.h"
+
+// Rows in each chunk of a column
+#define NUMERIC_CHUNK_ROWS 4096
+// Rows each leaf of a chunk's tree sums up, NUMERIC_CHUNK_ROWS must be a
+// power of two multiple of it
+#define NUMERIC_GROUP_ROWS 64
+#define NUMERIC_GROUPS (NUMERIC_CHUNK_ROWS / NUMERIC_GROUP_ROWS)
+
+/**
+ * What the range functions need to know about the numbers in a range.
+ * min and max are Infinity and -Infinity when there are no numbers
+ **/
+struct range_stats
+{
+  double sum;
+  std::size_t count;
+  double min;
+  double max;
+
+  range_stats();
+  // Takes the numbers in part in as well
+  void add(const range_stats &part);
+};
+
+class numeric_columns
+{
+public:
+  // Sets the number in a cell, replacing whatever was there
+  void set(int col, int row, double value);
+  // The cell has no number in it any more
+  void erase(int col, int row);
+  void clear();
+
+  // The number in a cell, NaN if it has none
+  double get(int col, int row) const;
+  range_stats stats(const cell_range &range) const;
+  // The sum of the products of the numbers in the same place in a and b,
+  // a cell with no number counts as 0. False if a and b aren't the same
+  // shape
+  bool sumproduct(const cell_range &a, const cell_range &b, double &result) const;
+
+private:
+  struct chunk
+  {
+    double values[NUMERIC_CHUNK_ROWS];
+    // 1 is the root, node i's children are 2i and 2i + 1, and the leaf for
+    // group g is NUMERIC_GROUPS + g. The root holds the whole chunk
+    range_stats groups[2 * NUMERIC_GROUPS];
+
+    chunk();
+    // Works out the summaries of the group the row is in again
+    void update(int offset);
+    // The numbers in rows [first, last] of the chunk
+    range_stats stats(int first, int last) const;
+  };
+
+  // Chunks by row / NUMERIC_CHUNK_ROWS
+  typedef std::map<int, std::shared_ptr<chunk>> column;
+
+  // The values of the column from row to the end of its chunk, n is set
+  // to how many there are. NULL when no row in the chunk has a number
+  static const double *rows(const column &values, int row, std::size_t &n);
+  // One past the last row of the column's last chunk
+  static long long end_row(const column &values);
+
+  typedef std::map<int, std::shared_ptr<column>> column_map;
+  std::shared_ptr<column_map> columns;
+};
+
+#endif
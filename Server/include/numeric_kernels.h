@@ -0,0 +1,35 @@
+/* Loops over packed doubles for the range functions: SUM, COUNT, MIN, MAX
+ * and SUMPRODUCT (AVERAGE is SUM over COUNT). A NaN is a cell with no
+ * number in it and is skipped, SUMPRODUCT counts it as 0.
+ *
+ * Each has an AVX2, an SSE2 and a plain version. The best one the CPU
+ * runs is picked once at startup, so the server runs anywhere it
+ * builds, and non x86 builds only have the plain ones.
+ */
+#ifndef NUMERIC_KERNELS_H
+#define NUMERIC_KERNELS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace numeric_kernels
+{
+double sum(const double *values, std::size_t n);
+std::size_t count(const double *values, std::size_t n);
+// Infinity if there are no numbers
+double min(const double *values, std::size_t n);
+// -Infinity if there are no numbers
+double max(const double *values, std::size_t n);
+double sumproduct(const double *a, const double *b, std::size_t n);
+
+// "avx2", "sse2" or "scalar"
+const char *implementation();
+// The implementations this CPU can run, best first
+std::vector<std::string> implementations();
+// Switches every kernel to the named implementation, false if this CPU
+// can't run it. For benchmarks, not while other threads are using them
+bool use(const std::string &name);
+} // namespace numeric_kernels
+
+#endif
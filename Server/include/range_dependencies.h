@@ -0,0 +1,80 @@
+/* The ranges formulas refer to, e.g. the A1:Z10000 in =SUM(A1:Z10000),
+ * kept as rectangles instead of a dependency on every cell in them. A
+ * formula over a range costs one entry per column the range spans, and
+ * finding the formulas whose ranges cover a cell costs O(log n + k) for
+ * the n ranges in the cell's column, k of which cover it.
+ *
+ * Ranges wider than RANGE_INDEX_COLUMNS columns, e.g. A1:ZZZZ1, would
+ * cost too many entries. They go in one more tree shared by every column
+ * instead, a lookup finds the wide ranges over its row and skips the ones
+ * that miss its column.
+ *
+ * Each column has an interval tree over the rows of the ranges in it: a
+ * treap ordered by first row, where every node also knows the last row
+ * of any range below it, so whole subtrees that end above a row are
+ * skipped. Nodes are never changed once made, an insert or erase copies
+ * the path down to where it changes, so copies of the index share
+ * everything else.
+ */
+#ifndef RANGE_DEPENDENCIES_H
+#define RANGE_DEPENDENCIES_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cell_ref.h"
+
+// Widest range that gets an entry in each of its columns
+#define RANGE_INDEX_COLUMNS 64
+
+class range_dependencies
+{
+public:
+  // The formula in cell formula refers to range
+  void add(const std::string &formula, const cell_range &range);
+  void remove(const std::string &formula, const cell_range &range);
+  void clear();
+
+  // Appends the formulas with a range that covers the cell. A formula
+  // appears once for each of its ranges that does
+  void find(int col, int row, std::vector<std::string> &formulas) const;
+  // True if any formula has a range that covers the cell
+  bool covers(int col, int row) const;
+
+private:
+  struct node;
+  typedef std::shared_ptr<const node> node_ptr;
+
+  struct node
+  {
+    int first_col;
+    int last_col;
+    int first_row;
+    int last_row;
+    std::string formula;
+    std::size_t priority;
+    // The last row of any range in this subtree
+    int max_last_row;
+    node_ptr left;
+    node_ptr right;
+  };
+
+  // Nodes are ordered by (first_row, last_row, formula, first_col, last_col)
+  static bool before(const node &a, const node &b);
+  static node_ptr make(const node &n, const node_ptr &left, const node_ptr &right);
+  static void split(const node_ptr &tree, const node &key, node_ptr &less_than, node_ptr &rest);
+  static node_ptr merge(const node_ptr &left, const node_ptr &right);
+  static node_ptr insert(const node_ptr &tree, const node &n);
+  static node_ptr erase(const node_ptr &tree, const node &key);
+  static node key(const std::string &formula, const cell_range &range);
+  static void stab(const node *tree, int col, int row, std::vector<std::string> &formulas);
+  static bool stabs(const node *tree, int col, int row);
+
+  typedef std::map<int, node_ptr> column_map;
+  std::shared_ptr<column_map> columns;
+  // The ranges wider than RANGE_INDEX_COLUMNS
+  node_ptr wide;
+};
+
+#endif
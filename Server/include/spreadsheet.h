@@ -3,16 +3,43 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
+#include <set>
 #include <stack>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
+#include "cell_ref.h"
+#include "cow.h"
+#include "numeric_columns.h"
+#include "range_dependencies.h"
+#include "work_pool.h"
 
 #define CIRCULAR_DEPENDENCY -1
 #define INVALID_DEPENDENCY -2
 
+// How many recent changes a spreadsheet remembers for resyncing clients
+#define DELTA_HISTORY 1024
+// A position in the edit log that isn't there
+#define NO_EDIT ((std::size_t)-1)
+// Rows of a column in each block of the coordinate index
+#define CELL_INDEX_BLOCK_ROWS 1024
+// Fewest formulas in a level of a recalculation for it to be spread over
+// the work pool, smaller levels cost less than handing them over
+#define RECALC_PARALLEL_MIN 256
+// Formulas a work pool thread takes at a time
+#define RECALC_GRAIN 32
+
 class spreadsheet;
 class cell;
 
+/*
+ * Where a cell sits in the coordinate index: (column, row, name).
+ * Names that aren't a column and a row get column -1.
+ */
+typedef std::tuple<int, int, std::string> cell_key;
+
 enum UNDO_STATUS
 {
 	UNDO_SUCCESS = 0,
@@ -25,6 +52,103 @@ struct cell_data
 	std::string cellName;
 	std::string contents;
 	std::vector<std::string> dependencies;
+	// Who made the edit that replaced this data, empty if nobody in particular
+	std::string owner;
+};
+
+/*
+ * One entry in a spreadsheet's edit log: the cell as it was before the edit
+ */
+struct edit_entry
+{
+	cell_data before;
+	// Position of the edit to the same cell before this one, or NO_EDIT
+	std::size_t previous;
+	// Undone by its owner while later edits were still in the log
+	bool undone;
+};
+
+/*
+ * What a range operation did: the cells it changed, and the cells it left
+ * alone because their new contents weren't valid
+ */
+struct range_change
+{
+	std::vector<std::string> changed;
+	std::vector<std::string> rejected;
+};
+
+/*
+ * One change to a spreadsheet: the version it produced and the cells it touched
+ */
+struct sheet_delta
+{
+	unsigned long version;
+	std::vector<std::string> cells;
+};
+
+/*
+ * A cell's earlier contents, newest on top. Pushing and popping never
+ * changes an entry, so copies of a cell share every entry they have in
+ * common and copying a cell doesn't copy its history.
+ */
+class cell_history
+{
+  private:
+	struct entry
+	{
+		cell_data data;
+		std::shared_ptr<const entry> below;
+	};
+
+	std::shared_ptr<const entry> top_;
+
+  public:
+	cell_history() = default;
+	cell_history(const cell_history &other) = default;
+	cell_history(cell_history &&other) = default;
+	cell_history &operator=(const cell_history &other) = default;
+	cell_history &operator=(cell_history &&other) = default;
+	~cell_history();
+
+	bool empty() const;
+	const cell_data &top() const;
+	void push(const cell_data &data);
+	void pop();
+	std::stack<cell_data> toStack() const;
+};
+
+/*
+ * Every cell ordered by (column, row) so a rectangle of cells can be
+ * found without looking at every cell, and so the cells can be walked a
+ * page at a time. The cells are kept in blocks of CELL_INDEX_BLOCK_ROWS
+ * rows of a column, which copies of the index share until one of them
+ * changes the block.
+ */
+class cell_index
+{
+  private:
+	// (column, row / CELL_INDEX_BLOCK_ROWS)
+	typedef std::pair<int, int> block_key;
+	typedef std::set<cell_key> block;
+	typedef std::map<block_key, std::shared_ptr<block>> block_map;
+
+	static block_key blockOf(const cell_key &key);
+
+	std::shared_ptr<block_map> blocks;
+
+  public:
+	void insert(const cell_key &key);
+	void erase(const cell_key &key);
+	void clear();
+	// Appends the names of the cells in col from first_row to last_row
+	void getColumnRange(int col, int first_row, int last_row, std::vector<std::string> &cellNames) const;
+	// Sets next to the first column after col with any cells in it.
+	// Returns false if there isn't one
+	bool getNextColumn(int col, int &next) const;
+	// Appends the names of up to count cells after key, or from the first
+	// cell if key is NULL
+	void getCellsAfter(const cell_key *key, std::size_t count, std::vector<std::string> &cellNames) const;
 };
 
 class cell
@@ -32,10 +156,15 @@ class cell
   private:
 	friend class spreadsheet;
 
-	std::stack<cell_data> history;
+	cell_history history;
+	// The cells the contents refer to on their own, and the ranges of
+	// more than one cell they refer to
 	std::vector<std::string> dependencies;
+	std::vector<cell_range> ranges;
 	std::string contents;
 	std::string cellName;
+	// Position of the edit that set the current contents, or NO_EDIT
+	std::size_t lastEdit;
 
   public:
 	// All of these constructors/desctructor need to be public
@@ -54,21 +183,65 @@ class spreadsheet
 {
   private:
 	std::string name;
-	//Worry about this data member later
-	std::stack<cell_data> edits;
-	std::unordered_map<std::string, cell> cells;
-	std::unordered_map<std::string, std::unordered_set<std::string>> dependents;
-	std::unordered_map<std::string, std::unordered_set<std::string>> dependees;
+	// Every edit in the order it was made, undone from the back. A user's
+	// own undo can also take an edit out of the middle, which leaves it in
+	// place marked undone
+	cow_vector<edit_entry> edits;
+	// Positions in edits of each owner's edits that haven't been undone
+	std::unordered_map<std::string, std::vector<std::size_t>> ownerEdits;
+	// The cells, the graph, the edit log and the index are copy on write,
+	// so copying a spreadsheet shares them until one of the copies changes
+	cow_table<cell> cells;
+	cow_table<std::unordered_set<std::string>> dependents;
+	cow_table<std::unordered_set<std::string>> dependees;
+	// Formulas that depend on a cell through a range aren't in dependents,
+	// they are found here by the cell's position
+	range_dependencies rangeDependents;
 	bool hasChanged;
+	// Bumped by every change, deltas is a ring buffer of the most recent ones
+	unsigned long version;
+	// Picked whenever the spreadsheet is made or loaded, so a version handed
+	// out before a restart (or before the spreadsheet was deleted and made
+	// again) is never mistaken for one of this spreadsheet's. Never 0
+	unsigned long epoch;
+	cow_vector<sheet_delta> deltas;
+	unsigned int deltaHead;
+	cell_index cellIndex;
+	// The value of every cell that has a number, typed in or worked out by
+	// a formula, packed by column for the range functions
+	numeric_columns numbers;
+	// Cells changed since the last recalculation
+	std::unordered_set<std::string> recalcPending;
 
 	void removeCell(const std::string &cellName);
+	bool applyCellContents(const std::string &cellName, const std::string &contents, std::vector<std::string> const &dependencies,
+						   const std::string &owner);
+	void logEdit(const cell_data &before);
+	void restoreCell(const edit_entry &entry);
+	void updateValue(const std::string &cellName, const std::string &contents);
+	void rebuildValues();
+	bool setValue(const std::string &cellName, double value);
+	bool isFormula(const std::string &cellName) const;
+	void recordChange(const std::string &cellName);
+	void recordChanges(const std::vector<std::string> &cellNames);
+	void remapCells(const reference_mapper &mapper, range_change &change, const range_mapper &rangeMapper = range_mapper());
+	static cell_key cellKey(const std::string &cellName);
 	//const std::string cellIsValid(const std::string &cellName) const;
-	const bool cellIsValid(const std::string &cellName, const std::string &contents, const std::vector<std::string> &deps) const;
+	const bool cellIsValid(const std::string &cellName, const std::string &contents, const std::vector<std::string> &deps,
+						   const std::vector<cell_range> &ranges) const;
 	const std::vector<std::string> getDirectDependents(std::string cellName);
 	//const int getCellsToRecalculate(const std::vector<std::string> & cellNames, const std::vector<std::string> *cellsToRecalculate) const;
 	//const int checkCellChain(const std::string & start, const std::string & cellName, std::unordered_set<std::string> *visited, std::unordered_set<std::string> *changed) const;
-	const int checkCircDeps(const std::string &start, const std::string &cellName, std::unordered_set<std::string> *visited) const;
+	const int checkCircDeps(const std::string &cellName, const std::unordered_set<std::string> &deps,
+						  const std::vector<cell_range> &ranges) const;
 	const int checkContents(const std::string &cellName, const std::string &contents) const;
+	bool hasCycle() const;
+	void getDependents(const std::string &cellName, std::vector<std::string> &found) const;
+	bool hasDependents(const std::string &cellName) const;
+	void setRanges(const std::string &cellName, const std::vector<cell_range> &ranges);
+	static std::vector<cell_range> formulaRanges(const std::string &contents);
+	static std::vector<std::string> uncoveredDependencies(const std::vector<std::string> &dependencies,
+														  const std::vector<cell_range> &ranges);
 	void addDependency(std::string s, std::string t);
 	void removeDependency(std::string s, std::string t);
 	void print_graph();
@@ -77,23 +250,53 @@ class spreadsheet
 	spreadsheet();
 	spreadsheet(std::string name);
 	spreadsheet(const spreadsheet &sheet);
+	spreadsheet(spreadsheet &&sheet) = default;
+	spreadsheet &operator=(const spreadsheet &sheet) = default;
+	spreadsheet &operator=(spreadsheet &&sheet) = default;
 	// Can't overload with the same parameter type...
 	// gonna need an object or something
 	// spreadsheet(std::string JSON_Data);
 	~spreadsheet();
+	// A read only copy for saving or sending to viewers. It shares
+	// everything with this spreadsheet except who can undo which edits,
+	// and has no numeric columns
+	spreadsheet snapshot() const;
 
 	const std::vector<std::string> getCellDependencies(const std::string &cellName) const;
 	const std::string getCellContents(const std::string &cellName) const;
 	const std::vector<std::string> getAllCellNames() const;
+	bool hasCell(const std::string &cellName) const;
+	std::size_t getCellCount() const;
+	void getCellNamesInRange(const cell_range &range, std::vector<std::string> &cellNames) const;
+	void getCellNamesAfter(const std::string &after, std::size_t count, std::vector<std::string> &cellNames) const;
+	range_stats getRangeStats(const cell_range &range) const;
+	bool getSumProduct(const cell_range &a, const cell_range &b, double &result) const;
+	double getCellValue(const std::string &cellName) const;
+	void recalculate(work_pool *pool, std::vector<std::string> &recalculated);
 	const std::string getName() const;
-	bool setCellContents(const std::string &cellName, const std::string &contents, std::vector<std::string> const &dependencies);
+	bool bulkLoad(const std::vector<cell_data> &loaded);
+	bool setCellContents(const std::string &cellName, const std::string &contents, std::vector<std::string> const &dependencies,
+						 const std::string &owner = "");
 	void saveSpreadsheet();
-	bool revertCell(const std::string &cellName);
+	bool revertCell(const std::string &cellName, const std::string &owner = "");
 	UNDO_STATUS undo(std::string &cellName);
+	UNDO_STATUS undo(const std::string &owner, std::string &cellName);
 	bool getSaveStatus();
+	void setSaved();
 	void setName(std::string name);
 	std::stack<cell_data> get_cell_history(std::string &cellName);
 	std::stack<cell_data> get_edits();
+	unsigned long getVersion() const;
+	unsigned long getEpoch() const;
+	void setVersion(unsigned long version);
+	bool getChangedCellsSince(unsigned long epoch, unsigned long version, std::vector<std::string> &cellNames) const;
+
+	// Range operations, each one makes a single new version
+	range_change fillRange(const std::string &source, const cell_range &target, const std::string &owner = "");
+	range_change clearRange(const cell_range &target, const std::string &owner = "");
+	range_change insertRows(int row, int count);
+	range_change deleteRows(int row, int count);
+	range_change moveRange(const cell_range &source, int col, int row);
 
 	// std::stack<std::string> get_cell_history(std::string cellName);
 };
@@ -6,62 +6,184 @@
 #endif
 
 #define SAVE_INTERVAL 5
+#define DEFAULT_PORT 2112
+#define MAX_CONNECTIONS 10000
+#define MAX_CONNECTIONS_PER_IP 500
+// Roughly how many bytes of cells go in each page of a spreadsheet sent in pages
+#define FULL_SEND_PAGE_SIZE 16384
+// How many cell names to look up at a time while filling a page
+#define FULL_SEND_BATCH 64
+// What a client puts in "compression" when opening to get lz_stream frames
+#define LZ_CODEC_NAME "lz"
+// Most cells (or rows) a single fill, clear, move, insert or delete may touch
+#define MAX_RANGE_CELLS 100000
+// How often viewed spreadsheets are copied into a new snapshot for their viewers
+#define SNAPSHOT_INTERVAL_MS 100
+// Where logins are kept, see user_store.h
+#define USERS_LOG_PATH "spreadsheets/users.log"
+// How long the spreadsheet names and logins files wait after a change before
+// being written, so a burst of logins is written once
+#define METADATA_DEBOUNCE_MS 250
 
+#include <atomic>
+#include <condition_variable>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include "spreadsheet.h"
 #include "asio.hpp"
 #include "tcp_server.h"
 #include "command.h"
+#include "metrics.h"
+#include "stats_listener.h"
+#include "user_store.h"
+#include "admin_tap.h"
+
+// Clients registered with the server, keyed by client ID. The server only
+// holds weak references, a client is owned by its own pending socket operations
+typedef std::unordered_map<int, std::weak_ptr<client>> client_registry;
+
+// Immutable copies of the spreadsheets viewers are watching, keyed by name.
+// A published map is never changed, the next one replaces it whole
+typedef std::unordered_map<std::string, std::shared_ptr<const spreadsheet>> snapshot_map;
+
+/*
+ * Everything that can be configured when starting a server.
+ * Defaults come from the defines above.
+ */
+struct server_options
+{
+  int port;
+  // Number of threads running the server, 0 means one per core
+  int io_threads;
+  accept_options accept;
+  // Port on localhost serving the metrics to Prometheus, 0 for none
+  int metrics_port;
+  // Undo only undoes the user's own edits, instead of the newest edit to the sheet
+  bool per_user_undo;
+  // Threads working out formulas together after an edit, 0 means one per
+  // core, 1 never spreads the work
+  int recalc_threads;
+
+  server_options();
+};
 
 class spreadsheet_server
 {
 private:
   tcp_server *server;
+  std::unique_ptr<stats_listener> stats;
   std::unordered_map<std::string, spreadsheet> sheets;
-  std::unordered_map<std::string, std::unordered_set<client *>> sprd_conns;
-  // This will probably have to be changed to a map later on
-  // so that we can track what client is connected to what spreadsheet
-  std::unordered_set<client *> clients;
+  std::unordered_map<std::string, client_registry> sprd_conns;
+  client_registry clients;
   // Usernames mapped to passwords (security is an issue but we're not concerned)
-  std::unordered_map<std::string, std::string> logins;
-  std::mutex lock;
+  user_store users;
+  // Guards sheets and sprd_conns, the editing lock. Records how long every
+  // caller waited for it in metrics::lock_wait_time
+  metered_mutex lock;
+  // Guards clients
+  std::mutex clients_lock;
+  // Guards admin
+  std::mutex user_lock;
   std::mutex io_lock;
-  bool is_running;
+  // Held for the whole of save_spreadsheets
+  std::mutex save_lock;
+  std::atomic<bool> is_running;
+  // The serialized list of spreadsheet names, rebuilt whenever a spreadsheet
+  // is added or removed. Only ever swapped with std::atomic_load/std::atomic_store
+  std::shared_ptr<const std::string> sheet_list;
   std::thread saver_thread;
-  client *admin;
+  std::weak_ptr<client> admin;
+  // The client messages the admin is sent
+  admin_tap tap;
+
+  // Read only clients never take lock. They are served from snapshots, which
+  // is only ever swapped with std::atomic_load/std::atomic_store
+  std::shared_ptr<const snapshot_map> snapshots;
+  std::unordered_map<std::string, client_registry> viewer_conns;
+  // Guards viewer_conns and viewers' viewports, and is held while a new
+  // snapshot is swapped in and sent out so no viewer misses a change
+  std::mutex viewer_lock;
+  std::thread publisher_thread;
+
+  // Whether the spreadsheet names or logins changed since they were last
+  // written. Both files are only ever written by persister_thread
+  bool names_dirty;
+  bool logins_dirty;
+  bool persister_stopping;
+  // Guards names_dirty, logins_dirty and persister_stopping
+  std::mutex persist_lock;
+  std::condition_variable persist_cond;
+  std::thread persister_thread;
+  unsigned long last_accepted;
+  unsigned long last_rejected;
+  bool per_user_undo;
+  // Helps whichever thread is recalculating, NULL to always go it alone
+  std::unique_ptr<work_pool> recalc_pool;
+
+  // One io_context per thread, every client lives on exactly one of them
+  std::vector<std::unique_ptr<asio::io_context>> io_contexts;
+  std::vector<asio::executor_work_guard<asio::io_context::executor_type>> work_guards;
+  std::vector<std::thread> io_threads;
 
   // Callbacks will be prefaced with handle_
-  asio::io_context io_context;
-  void handle_first_contact(client *c);
-  void handle_client_disconnect(client *c);
-  void handle_client_login(client *c);
-  void handle_edits(client *c);
-  void handle_admin(client *c);
-  void handle_admin_disconnect(client *c);
+  void handle_first_contact(const client_ptr &c);
+  void handle_message(const client_ptr &c);
+  void handle_client_disconnect(const client_ptr &c);
+  void handle_client_login(const client_ptr &c);
+  void handle_edits(const client_ptr &c);
+  void handle_admin(const client_ptr &c);
+  void handle_admin_disconnect(const client_ptr &c);
+  void handle_viewer(const client_ptr &c);
+  void handle_range(const client_ptr &c, command *cmd);
+  void broadcast(const std::string &sprd_name, const std::string &message);
+  void broadcast(const std::string &sprd_name, const std::string &message, const std::string &cell_name);
+  void broadcast(const std::string &sprd_name, const std::string &message, const std::vector<std::string> &cell_names);
+  void recalculate(const std::string &sprd_name);
 
   // Non-callbacks
   void save_sprd_names();
-  bool check_login(std::string username, std::string password);
+  bool check_login(const std::string &username, const std::string &password);
   std::vector<std::string> get_spreadsheet_names();
+  std::shared_ptr<const std::string> spreadsheet_list();
+  void update_spreadsheet_list();
   void open_all_spreadsheets();
-  void modify_user(user_command *cmd);
+  std::string modify_user(user_command *cmd);
   bool modify_sheets(sheet_command *cmd);
   void save_logins();
+  void mark_names_dirty();
+  void mark_logins_dirty();
+  void stop_persister();
   void shutdown_server();
+  void stop_io_contexts();
+  client_ptr get_admin();
+  void set_viewports(const client_ptr &c, const std::vector<std::string> &ranges);
+  std::string visible_send_message(const spreadsheet &s, const client_ptr &c);
+  message_stream full_send_stream(const std::shared_ptr<const spreadsheet> &snapshot);
+  void open_viewer(const client_ptr &c, const std::string &sprd_name, bool reconnecting, unsigned long last_epoch,
+                   unsigned long last_version, const std::vector<std::string> &ranges, const std::string &compression);
+  void publish_snapshots();
+  void send_snapshot_changes(const std::string &sprd_name, const std::shared_ptr<const spreadsheet> &snapshot,
+                             const spreadsheet *last);
+  void report_connections();
+  void report_registries();
 
 public:
   spreadsheet_server();
   spreadsheet_server(int port);
+  spreadsheet_server(const server_options &options);
   ~spreadsheet_server();
   void start();
   void save_spreadsheets();
   bool currently_running() const;
 
   static void spreadsheet_saver(spreadsheet_server *s);
+  static void snapshot_publisher(spreadsheet_server *s);
+  static void metadata_persister(spreadsheet_server *s);
 };
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
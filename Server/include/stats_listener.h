@@ -0,0 +1,23 @@
+#ifndef STATS_LISTENER_H
+#define STATS_LISTENER_H
+
+#include <memory>
+#include "asio.hpp"
+
+/*
+ * Serves the metrics in the Prometheus text format to anything that
+ * connects on localhost. Every connection gets the metrics as a plain
+ * HTTP response, whatever it asked for, then is closed.
+ */
+class stats_listener
+{
+public:
+  stats_listener(asio::io_context &io_context, short port);
+
+private:
+  void do_accept();
+
+  asio::ip::tcp::acceptor acceptor_;
+};
+
+#endif
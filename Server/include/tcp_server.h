@@ -11,24 +11,70 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "asio.hpp"
 #include "client.h"
 
+// How long an acceptor waits before accepting again after an error, e.g.
+// running out of file descriptors
+#define ACCEPT_RETRY_MS 100
 
-// typedef void (*callback)(client *);
+/*
+ * Limits on who gets to connect. A limit of 0 means unlimited.
+ */
+struct accept_options
+{
+  int max_connections;
+  int max_connections_per_ip;
+  // One SO_REUSEPORT acceptor per io_context instead of a single
+  // acceptor handing sockets out round robin
+  bool reuse_port;
+};
+
+/*
+ * Connection counts, shared between the tcp_server and every connection
+ * it admitted so a connection can give its slot back whenever it is freed.
+ */
+struct admission_state
+{
+  std::mutex lock;
+  int active;
+  std::unordered_map<std::string, int> per_ip;
+  std::atomic<unsigned long> accepted;
+  std::atomic<unsigned long> rejected;
+};
 
 class tcp_server
 {
 public:
-  tcp_server(asio::io_context &io_context, short port, std::function<void(client *)> accept_callback);
+  tcp_server(const std::vector<asio::io_context *> &io_contexts, short port, const accept_options &options,
+             std::function<void(const client_ptr &)> accept_callback);
+
+  unsigned long accepted_count() const;
+  unsigned long rejected_count() const;
+  int active_count() const;
 
 private:
-  void do_accept();
+  void do_accept(std::size_t index);
+  void retry_accept(std::size_t index, const std::error_code &error);
+  void admit(asio::ip::tcp::socket socket);
+  asio::io_context &next_io_context();
 
-  asio::ip::tcp::acceptor acceptor_;
-  std::function<void(client *)> accept_callback_;
-  static int current_id;
+  std::vector<asio::io_context *> io_contexts_;
+  std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors_;
+  // One for each acceptor, to wait out accept errors
+  std::vector<std::unique_ptr<asio::steady_timer>> retry_timers_;
+  accept_options options_;
+  std::shared_ptr<admission_state> admission_;
+  std::atomic<unsigned int> next_context_;
+  std::function<void(const client_ptr &)> accept_callback_;
+  static std::atomic<int> current_id;
 };
 
 #endif
@@ -0,0 +1,112 @@
+/* Usernames and passwords, kept apart from the rest of the server so
+ * logging in never waits on anything but the users it touches.
+ *
+ * Users are split over USER_STORE_SHARDS shards by a hash of the name, each
+ * with its own read-write lock. Checking a password only takes a shard's
+ * read lock, so logins of existing users never block each other.
+ *
+ * On disk the store is a log, one change per line, that flush() appends to:
+ *   + name<TAB>password
+ *   - name
+ * with tabs, newlines and backslashes escaped. Loading replays the log a
+ * line at a time. Once the log holds more than USER_LOG_COMPACT_RATIO
+ * lines per user it is rewritten with one line per user.
+ */
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Must be a power of two
+#define USER_STORE_SHARDS 16
+// The log is compacted once it is this many times longer than there are users...
+#define USER_LOG_COMPACT_RATIO 2
+// ...and has at least this many lines
+#define USER_LOG_COMPACT_MIN 1024
+
+/*
+ * A read-write lock, any number of readers or one writer. Writers waiting
+ * hold off new readers so a stream of logins can't starve them.
+ */
+class rw_lock
+{
+public:
+  rw_lock();
+
+  void lock_shared();
+  void unlock_shared();
+  void lock();
+  void unlock();
+
+private:
+  std::mutex mutex_;
+  std::condition_variable readers_cond_;
+  std::condition_variable writer_cond_;
+  int readers_;
+  int writers_waiting_;
+  bool writing_;
+};
+
+class user_store
+{
+public:
+  // Results of check_login
+  enum LOGIN_RESULT
+  {
+    LOGIN_OK = 0,
+    LOGIN_ADDED = 1,
+    LOGIN_BAD_PASSWORD = 2
+  };
+
+  explicit user_store(const std::string &path);
+
+  // Replays the log. Returns false if there is no log yet
+  bool load();
+  // Adds users from elsewhere, e.g. the old JSON users file. They are
+  // written out with the next flush
+  void import(const std::unordered_map<std::string, std::string> &users);
+
+  // Checks a user's password, adding the user if it doesn't exist yet
+  LOGIN_RESULT check_login(const std::string &username, const std::string &password);
+  void set(const std::string &username, const std::string &password);
+  bool erase(const std::string &username);
+
+  std::size_t size() const;
+  // Every user, for the admin
+  std::unordered_map<std::string, std::string> all() const;
+
+  // Appends the changes made since the last flush, compacting the log if
+  // it has gotten too long. Only one thread may flush at a time
+  void flush();
+
+private:
+  struct shard
+  {
+    mutable rw_lock lock;
+    std::unordered_map<std::string, std::string> users;
+  };
+
+  shard &shard_for(const std::string &username);
+  // Queues a line for the next flush, called with the user's shard locked
+  void log_change(const std::string &line);
+  bool compact();
+  void apply(const std::string &line);
+
+  std::string path_;
+  shard shards_[USER_STORE_SHARDS];
+
+  // Changes not written yet
+  std::mutex pending_lock_;
+  std::vector<std::string> pending_;
+  // Lines in the file, and whether it has to be rewritten whole. Only
+  // touched at startup and by flush
+  std::size_t log_lines_;
+  bool needs_compact_;
+};
+
+#endif
@@ -0,0 +1,70 @@
+/* A few threads that help one thread get through a batch of work, e.g.
+ * the formulas of one level of a recalculation.
+ *
+ * A batch is split into chunks, dealt out over a queue for each thread.
+ * A thread works from the back of its own queue and, once that's empty,
+ * steals from the front of another's, so a thread that drew cheap chunks
+ * takes work off one that drew expensive ones instead of going idle. The
+ * thread that hands over the batch works on it too, and gets it back
+ * once every chunk is done.
+ */
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class work_pool
+{
+public:
+  // Starts threads helpers, which with the caller makes threads + 1
+  explicit work_pool(std::size_t threads);
+  ~work_pool();
+
+  // Calls task(i) for every i in [0, count), grain at a time, and returns
+  // once they have all returned. task must not throw. One batch runs at a
+  // time, others wait for it
+  void run(std::size_t count, std::size_t grain, const std::function<void(std::size_t)> &task);
+  // Threads working on a batch, counting the caller
+  std::size_t size() const;
+
+private:
+  typedef std::pair<std::size_t, std::size_t> chunk;
+
+  struct work_queue
+  {
+    std::mutex lock;
+    std::deque<chunk> chunks;
+  };
+
+  void work(std::size_t self);
+  bool take(std::size_t self, chunk &found);
+  void helper(std::size_t self);
+
+  // One per helper, and the caller's last
+  std::vector<std::unique_ptr<work_queue>> queues;
+  std::vector<std::thread> threads;
+  const std::function<void(std::size_t)> *task;
+  // Chunks of the batch that haven't finished
+  std::atomic<std::size_t> remaining;
+
+  // Serializes run
+  std::mutex run_lock;
+  // Guards batch and stopping, helpers wait on wake for a new batch and
+  // the caller on done for the last chunk
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  unsigned long batch;
+  bool stopping;
+};
+
+#endif
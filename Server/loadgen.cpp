@@ -0,0 +1,764 @@
+/* Load generator for the spreadsheet server.
+ *
+ * Connects N simulated clients over loopback. Each one opens a spreadsheet,
+ * then sends a mix of edits, undos and reverts at a fixed rate. Every edit
+ * writes a value only that client uses ("lg<client>_<sequence>"), so when
+ * the server broadcasts the edit back, the client knows which edit it was
+ * and how long the round trip took.
+ *
+ * Prints one JSON object with throughput and latency percentiles, so
+ * runs can be compared by a script.
+ *
+ * Usage: loadgen [--host 127.0.0.1] [--port 2112] [--clients 50]
+ *                [--sheets 5] [--sheet-prefix loadgen] [--duration 10]
+ *                [--warmup 2] [--rate 10] [--edit 80] [--undo 10]
+ *                [--revert 10] [--rows 100] [--threads 1] [--compression]
+ *                [--churn-ms 0] [--check-registries 0] [--drain-timeout 15]
+ *
+ * --rate is operations per second per client, the mix is in percent.
+ * --churn-ms makes every client drop its connection and reconnect about
+ * that often, 0 keeps the connections open.
+ * --check-registries is the server's --metrics-port. Once every client has
+ * gone, loadgen waits up to --drain-timeout seconds for the server's client
+ * registries to empty, and fails if they don't. Nothing else may be
+ * connected to the server for that to happen. e.g. churn check:
+ *   ./server --metrics-port 9100 &
+ *   ./loadgen --clients 200 --churn-ms 50 --duration 20 --check-registries 9100
+ */
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "asio.hpp"
+#include "lib/rapidjson/document.h"
+#include "lib/rapidjson/writer.h"
+#include "lib/rapidjson/stringbuffer.h"
+#include "lz_stream.h"
+#include "metrics.h"
+
+using asio::ip::tcp;
+typedef std::chrono::steady_clock loadgen_clock;
+
+struct loadgen_options
+{
+    std::string host;
+    int port;
+    int clients;
+    int sheets;
+    std::string sheet_prefix;
+    double duration;
+    double warmup;
+    double rate;
+    int edit_percent;
+    int undo_percent;
+    int revert_percent;
+    int rows;
+    int threads;
+    bool compression;
+    int churn_ms;
+    int check_registries;
+    double drain_timeout;
+
+    loadgen_options()
+        : host("127.0.0.1"), port(2112), clients(50), sheets(5), sheet_prefix("loadgen"),
+          duration(10), warmup(2), rate(10), edit_percent(80), undo_percent(10), revert_percent(10),
+          rows(100), threads(1), compression(false), churn_ms(0),
+          check_registries(0), drain_timeout(15)
+    {
+    }
+};
+
+/*
+ * Totals shared by every simulated client
+ */
+struct loadgen_stats
+{
+    // Only count what happens after the warmup
+    std::atomic<bool> measuring;
+    std::atomic<unsigned long> edits;
+    std::atomic<unsigned long> undos;
+    std::atomic<unsigned long> reverts;
+    std::atomic<unsigned long> messages_received;
+    std::atomic<unsigned long> bytes_received;
+    std::atomic<unsigned long> errors;
+    std::atomic<unsigned long> connect_failures;
+    std::atomic<unsigned long> reconnects;
+    std::atomic<int> opened;
+    metric_histogram latency;
+
+    loadgen_stats()
+        : measuring(false), edits(0), undos(0), reverts(0), messages_received(0), bytes_received(0),
+          errors(0), connect_failures(0), reconnects(0), opened(0),
+          latency("loadgen_edit_latency_ns", "", "Time from sending an edit to seeing it broadcast back")
+    {
+    }
+};
+
+class sim_client
+    : public std::enable_shared_from_this<sim_client>
+{
+public:
+    sim_client(asio::io_context &io_context, int id, const loadgen_options &options, loadgen_stats &stats)
+        : io_context_(io_context), socket_(io_context), op_timer_(io_context), churn_timer_(io_context),
+          id_(id), options_(options), stats_(stats), rng_(id), generation_(0), sequence_(0), running_(false),
+          stopped_(false), opened_(false), open_sent_(false), paging_(false), compressed_(false), writing_(false)
+    {
+        prefix_ = "lg" + std::to_string(id_) + "_";
+        sheet_ = options_.sheet_prefix + std::to_string(id_ % options_.sheets);
+    }
+
+    void start()
+    {
+        connect();
+    }
+
+    void stop()
+    {
+        auto self(shared_from_this());
+        asio::post(io_context_, [this, self]() {
+            stopped_ = true;
+            close();
+        });
+    }
+
+private:
+    void connect()
+    {
+        tcp::endpoint endpoint(asio::ip::make_address(options_.host), options_.port);
+        auto self(shared_from_this());
+        unsigned long generation = generation_;
+        socket_.async_connect(endpoint, [this, self, generation](std::error_code ec) {
+            if (generation != generation_)
+                return;
+            if (ec)
+            {
+                stats_.connect_failures++;
+                return;
+            }
+
+            socket_.set_option(tcp::no_delay(true));
+            do_read();
+        });
+    }
+
+    void close()
+    {
+        running_ = false;
+        std::error_code ignored;
+        op_timer_.cancel(ignored);
+        churn_timer_.cancel(ignored);
+        socket_.shutdown(tcp::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+    }
+
+    /*
+     * Drops the connection and opens the spreadsheet again on a new one
+     */
+    void reconnect()
+    {
+        close();
+        stats_.reconnects++;
+
+        // Handlers still pending on the old socket see a new generation and do nothing
+        generation_++;
+        socket_ = tcp::socket(io_context_);
+        stream_.clear();
+        write_queue_.clear();
+        writing_ = false;
+        compressed_ = false;
+        decompressor_.reset();
+        pending_.clear();
+        open_sent_ = false;
+        paging_ = false;
+        connect();
+    }
+
+    void do_read()
+    {
+        auto self(shared_from_this());
+        unsigned long generation = generation_;
+        socket_.async_read_some(asio::buffer(buffer_, sizeof(buffer_)),
+                                [this, self, generation](std::error_code ec, std::size_t length) {
+                                    if (ec || generation != generation_)
+                                        return;
+
+                                    if (stats_.measuring)
+                                        stats_.bytes_received += length;
+                                    stream_.append(buffer_, length);
+                                    if (!read_messages())
+                                    {
+                                        stats_.errors++;
+                                        close();
+                                        return;
+                                    }
+                                    do_read();
+                                });
+    }
+
+    /*
+     * Splits the stream into messages. Before compression is turned on they
+     * end in "\n\n", after it they are length prefixed lz_stream frames.
+     * Returns false if a frame can't be decompressed.
+     */
+    bool read_messages()
+    {
+        std::size_t start = 0;
+
+        while (true)
+        {
+            std::string message;
+
+            if (!compressed_)
+            {
+                std::size_t end = stream_.find("\n\n", start);
+                if (end == std::string::npos)
+                    break;
+                message.assign(stream_, start, end - start);
+                start = end + 2;
+            }
+            else
+            {
+                if (stream_.size() - start < 4)
+                    break;
+                const unsigned char *header = (const unsigned char *)stream_.data() + start;
+                std::size_t size = ((std::size_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+                if (stream_.size() - start - 4 < size)
+                    break;
+
+                if (!decompressor_->decompress(stream_.substr(start + 4, size), message))
+                    return false;
+                start += 4 + size;
+
+                if (message.size() >= 2 && message.compare(message.size() - 2, 2, "\n\n") == 0)
+                    message.resize(message.size() - 2);
+            }
+
+            handle_message(message);
+        }
+
+        stream_.erase(0, start);
+        return true;
+    }
+
+    void handle_message(const std::string &message)
+    {
+        if (message.empty() || message.find_first_not_of(" \r\n\t") == std::string::npos)
+            return;
+
+        // The list and the "1"/"0" admin replies aren't counted
+        rapidjson::Document doc;
+        if (doc.Parse(message.c_str()).HasParseError() || !doc.IsObject() || !doc.HasMember("type") || !doc["type"].IsString())
+            return;
+
+        if (stats_.measuring)
+            stats_.messages_received++;
+
+        std::string type = doc["type"].GetString();
+
+        if (type == "list")
+        {
+            // The list comes again after a failed login, only try once
+            if (!open_sent_)
+                send_open();
+        }
+        else if (type == "compression")
+        {
+            compressed_ = true;
+            decompressor_.reset(new lz_decompressor());
+        }
+        else if (type == "full send")
+        {
+            if (doc.HasMember("spreadsheet") && doc["spreadsheet"].IsObject())
+                match_edits(doc["spreadsheet"]);
+
+            // A server that doesn't send in pages is done after one full send
+            if (!running_ && !paging_)
+                begin_running();
+        }
+        else if (type == "full send begin")
+        {
+            paging_ = true;
+        }
+        else if (type == "full send end")
+        {
+            paging_ = false;
+            if (!running_)
+                begin_running();
+        }
+        else if (type == "error")
+        {
+            // An error before the spreadsheet opened is a failed login
+            if (!running_ && !paging_)
+            {
+                stats_.connect_failures++;
+                close();
+            }
+            else if (stats_.measuring)
+            {
+                stats_.errors++;
+            }
+        }
+    }
+
+    /*
+     * Finds this client's edits among the broadcast cells and records how
+     * long each took to come back
+     */
+    void match_edits(const rapidjson::Value &cells)
+    {
+        loadgen_clock::time_point now = loadgen_clock::now();
+
+        for (auto it = cells.MemberBegin(); it != cells.MemberEnd(); ++it)
+        {
+            if (!it->value.IsString())
+                continue;
+
+            std::string value = it->value.GetString();
+            if (value.compare(0, prefix_.size(), prefix_) != 0)
+                continue;
+
+            unsigned long sequence = std::strtoul(value.c_str() + prefix_.size(), NULL, 10);
+            auto pending = pending_.find(sequence);
+            if (pending == pending_.end())
+                continue;
+
+            if (stats_.measuring)
+            {
+                std::chrono::nanoseconds latency = now - pending->second;
+                stats_.latency.record(latency.count());
+            }
+            pending_.erase(pending);
+        }
+    }
+
+    void send_open()
+    {
+        open_sent_ = true;
+
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("open");
+        writer.Key("name");
+        writer.String(sheet_.c_str());
+        writer.Key("username");
+        writer.String(("loadgen" + std::to_string(id_)).c_str());
+        writer.Key("password");
+        writer.String("loadgen");
+        if (options_.compression)
+        {
+            writer.Key("compression");
+            writer.String("lz");
+        }
+        writer.EndObject();
+
+        send(sb.GetString());
+    }
+
+    void begin_running()
+    {
+        running_ = true;
+        if (!opened_)
+            stats_.opened++;
+        opened_ = true;
+
+        // Spread the clients out over the first interval
+        std::uniform_real_distribution<double> offset(0, 1.0 / options_.rate);
+        next_op_ = loadgen_clock::now() + std::chrono::duration_cast<loadgen_clock::duration>(std::chrono::duration<double>(offset(rng_)));
+        schedule_op();
+
+        if (options_.churn_ms > 0)
+            schedule_churn();
+    }
+
+    /*
+     * Operations go out on a fixed schedule, whether or not the server has
+     * answered the last one, so a slow server shows up as latency
+     */
+    void schedule_op()
+    {
+        op_timer_.expires_at(next_op_);
+        auto self(shared_from_this());
+        op_timer_.async_wait([this, self](std::error_code ec) {
+            if (ec || !running_)
+                return;
+
+            send_op();
+            next_op_ += std::chrono::duration_cast<loadgen_clock::duration>(std::chrono::duration<double>(1.0 / options_.rate));
+            schedule_op();
+        });
+    }
+
+    void schedule_churn()
+    {
+        std::uniform_int_distribution<int> jitter(options_.churn_ms / 2, options_.churn_ms * 3 / 2);
+        churn_timer_.expires_after(std::chrono::milliseconds(jitter(rng_)));
+        auto self(shared_from_this());
+        churn_timer_.async_wait([this, self](std::error_code ec) {
+            if (ec || stopped_)
+                return;
+            reconnect();
+        });
+    }
+
+    void send_op()
+    {
+        std::uniform_int_distribution<int> percent(0, 99);
+        int roll = percent(rng_);
+
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartObject();
+        writer.Key("type");
+
+        if (roll < options_.edit_percent)
+        {
+            unsigned long sequence = sequence_++;
+            std::string value = prefix_ + std::to_string(sequence);
+            pending_[sequence] = loadgen_clock::now();
+
+            writer.String("edit");
+            writer.Key("cell");
+            writer.String(random_cell().c_str());
+            writer.Key("value");
+            writer.String(value.c_str());
+            writer.Key("dependencies");
+            writer.StartArray();
+            writer.EndArray();
+
+            if (stats_.measuring)
+                stats_.edits++;
+        }
+        else if (roll < options_.edit_percent + options_.undo_percent)
+        {
+            writer.String("undo");
+            if (stats_.measuring)
+                stats_.undos++;
+        }
+        else
+        {
+            writer.String("revert");
+            writer.Key("cell");
+            writer.String(random_cell().c_str());
+            if (stats_.measuring)
+                stats_.reverts++;
+        }
+
+        writer.EndObject();
+        send(sb.GetString());
+    }
+
+    std::string random_cell()
+    {
+        std::uniform_int_distribution<int> column(0, 9);
+        std::uniform_int_distribution<int> row(1, options_.rows);
+        return std::string(1, (char)('A' + column(rng_))) + std::to_string(row(rng_));
+    }
+
+    void send(const std::string &message)
+    {
+        write_queue_.push_back(message + "\n\n");
+        if (!writing_)
+            do_write();
+    }
+
+    void do_write()
+    {
+        writing_ = true;
+        auto self(shared_from_this());
+        unsigned long generation = generation_;
+        asio::async_write(socket_, asio::buffer(write_queue_.front()),
+                          [this, self, generation](std::error_code ec, std::size_t length) {
+                              if (generation != generation_)
+                                  return;
+                              if (ec)
+                              {
+                                  writing_ = false;
+                                  return;
+                              }
+
+                              write_queue_.pop_front();
+                              if (!write_queue_.empty())
+                                  do_write();
+                              else
+                                  writing_ = false;
+                          });
+    }
+
+    asio::io_context &io_context_;
+    tcp::socket socket_;
+    asio::steady_timer op_timer_;
+    asio::steady_timer churn_timer_;
+    int id_;
+    const loadgen_options &options_;
+    loadgen_stats &stats_;
+    std::mt19937 rng_;
+    std::string prefix_;
+    std::string sheet_;
+    // Bumped on every reconnect
+    unsigned long generation_;
+    unsigned long sequence_;
+    bool running_;
+    bool stopped_;
+    bool opened_;
+    bool open_sent_;
+    bool paging_;
+    bool compressed_;
+    bool writing_;
+    loadgen_clock::time_point next_op_;
+    char buffer_[8192];
+    std::string stream_;
+    std::deque<std::string> write_queue_;
+    std::unique_ptr<lz_decompressor> decompressor_;
+    // Edits sent but not seen broadcast yet, by sequence number
+    std::unordered_map<unsigned long, loadgen_clock::time_point> pending_;
+};
+
+static bool parse_options(int argc, char *argv[], loadgen_options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--compression")
+            options.compression = true;
+        else if (!has_value)
+            return false;
+        else if (arg == "--host")
+            options.host = argv[++i];
+        else if (arg == "--port")
+            options.port = std::atoi(argv[++i]);
+        else if (arg == "--clients")
+            options.clients = std::atoi(argv[++i]);
+        else if (arg == "--sheets")
+            options.sheets = std::atoi(argv[++i]);
+        else if (arg == "--sheet-prefix")
+            options.sheet_prefix = argv[++i];
+        else if (arg == "--duration")
+            options.duration = std::atof(argv[++i]);
+        else if (arg == "--warmup")
+            options.warmup = std::atof(argv[++i]);
+        else if (arg == "--rate")
+            options.rate = std::atof(argv[++i]);
+        else if (arg == "--edit")
+            options.edit_percent = std::atoi(argv[++i]);
+        else if (arg == "--undo")
+            options.undo_percent = std::atoi(argv[++i]);
+        else if (arg == "--revert")
+            options.revert_percent = std::atoi(argv[++i]);
+        else if (arg == "--rows")
+            options.rows = std::atoi(argv[++i]);
+        else if (arg == "--threads")
+            options.threads = std::atoi(argv[++i]);
+        else if (arg == "--churn-ms")
+            options.churn_ms = std::atoi(argv[++i]);
+        else if (arg == "--check-registries")
+            options.check_registries = std::atoi(argv[++i]);
+        else if (arg == "--drain-timeout")
+            options.drain_timeout = std::atof(argv[++i]);
+        else
+            return false;
+    }
+
+    return options.clients > 0 && options.sheets > 0 && options.rate > 0 && options.rows > 0 && options.threads > 0 &&
+           options.edit_percent + options.undo_percent + options.revert_percent == 100;
+}
+
+/*
+ * The value of an unlabelled metric in the server's metrics page, -1 if the
+ * page couldn't be read or doesn't have it
+ */
+static long long scrape_metric(const loadgen_options &options, const std::string &name)
+{
+    std::string page;
+    try
+    {
+        asio::io_context io_context;
+        tcp::socket socket(io_context);
+        tcp::resolver resolver(io_context);
+        socket.connect(*resolver.resolve(options.host, std::to_string(options.check_registries)).begin());
+        asio::write(socket, asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+
+        // The server closes the connection once the page is written
+        std::error_code ec;
+        char buffer[8192];
+        while (!ec)
+        {
+            std::size_t length = socket.read_some(asio::buffer(buffer), ec);
+            page.append(buffer, length);
+        }
+    }
+    catch (std::exception &e)
+    {
+        return -1;
+    }
+
+    std::string line = "\n" + name + " ";
+    std::size_t found = page.find(line);
+    if (found == std::string::npos)
+        return -1;
+    return std::atoll(page.c_str() + found + line.size());
+}
+
+/*
+ * Whether the server let go of every client within the drain timeout. The
+ * server counts its registries every few seconds, so this polls
+ */
+static bool registries_drained(const loadgen_options &options)
+{
+    loadgen_clock::time_point deadline =
+        loadgen_clock::now() + std::chrono::duration_cast<loadgen_clock::duration>(std::chrono::duration<double>(options.drain_timeout));
+
+    while (true)
+    {
+        long long clients = scrape_metric(options, "horizon_registered_clients");
+        long long sheet_clients = scrape_metric(options, "horizon_registered_sheet_clients");
+        if (clients == 0 && sheet_clients == 0)
+            return true;
+
+        if (loadgen_clock::now() >= deadline)
+        {
+            std::cerr << "registries not empty: " << clients << " clients, " << sheet_clients << " spreadsheet clients"
+                      << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+}
+
+static void print_results(const loadgen_options &options, loadgen_stats &stats, double seconds, int drained)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.Key("clients");
+    writer.Int(options.clients);
+    writer.Key("opened");
+    writer.Int(stats.opened);
+    writer.Key("sheets");
+    writer.Int(options.sheets);
+    writer.Key("rate_per_client");
+    writer.Double(options.rate);
+    writer.Key("compression");
+    writer.Bool(options.compression);
+    writer.Key("seconds");
+    writer.Double(seconds);
+
+    unsigned long ops = stats.edits + stats.undos + stats.reverts;
+    writer.Key("edits");
+    writer.Uint64(stats.edits);
+    writer.Key("undos");
+    writer.Uint64(stats.undos);
+    writer.Key("reverts");
+    writer.Uint64(stats.reverts);
+    writer.Key("ops_per_s");
+    writer.Double(ops / seconds);
+    writer.Key("messages_received_per_s");
+    writer.Double(stats.messages_received / seconds);
+    writer.Key("bytes_received_per_s");
+    writer.Double(stats.bytes_received / seconds);
+    writer.Key("errors");
+    writer.Uint64(stats.errors);
+    writer.Key("connect_failures");
+    writer.Uint64(stats.connect_failures);
+    writer.Key("reconnects");
+    writer.Uint64(stats.reconnects);
+    if (drained >= 0)
+    {
+        writer.Key("registries_drained");
+        writer.Bool(drained == 1);
+    }
+
+    metric_sample latency = stats.latency.sample();
+    writer.Key("edit_latency_us");
+    writer.StartObject();
+    writer.Key("count");
+    writer.Uint64(latency.count);
+    writer.Key("mean");
+    writer.Double(latency.count > 0 ? latency.sum / 1000.0 / latency.count : 0);
+    writer.Key("p50");
+    writer.Double(latency.p50 / 1000.0);
+    writer.Key("p90");
+    writer.Double(latency.p90 / 1000.0);
+    writer.Key("p99");
+    writer.Double(latency.p99 / 1000.0);
+    writer.Key("p999");
+    writer.Double(stats.latency.percentile(0.999) / 1000.0);
+    writer.Key("max");
+    writer.Double(latency.max / 1000.0);
+    writer.EndObject();
+
+    writer.EndObject();
+
+    std::cout << sb.GetString() << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    loadgen_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "Usage: loadgen [--host H] [--port P] [--clients N] [--sheets N] [--sheet-prefix S]\n"
+                  << "               [--duration S] [--warmup S] [--rate OPS] [--edit %] [--undo %] [--revert %]\n"
+                  << "               [--rows N] [--threads N] [--compression] [--churn-ms MS]\n"
+                  << "               [--check-registries METRICS_PORT] [--drain-timeout S]\n"
+                  << "The edit, undo and revert percentages must add up to 100" << std::endl;
+        return 1;
+    }
+
+    loadgen_stats stats;
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts;
+    for (int i = 0; i < options.threads; i++)
+        contexts.push_back(std::unique_ptr<asio::io_context>(new asio::io_context(1)));
+
+    std::vector<std::shared_ptr<sim_client>> clients;
+    for (int i = 0; i < options.clients; i++)
+    {
+        clients.push_back(std::make_shared<sim_client>(*contexts[i % options.threads], i, options, stats));
+        clients.back()->start();
+    }
+
+    std::vector<std::thread> threads;
+    for (auto &context : contexts)
+    {
+        asio::io_context *c = context.get();
+        threads.push_back(std::thread([c]() { c->run(); }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+    stats.measuring = true;
+    loadgen_clock::time_point start = loadgen_clock::now();
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    stats.measuring = false;
+    std::chrono::duration<double> elapsed = loadgen_clock::now() - start;
+
+    for (auto &c : clients)
+        c->stop();
+    for (auto &thread : threads)
+        thread.join();
+
+    // -1 when not checked
+    int drained = -1;
+    if (options.check_registries > 0)
+        drained = registries_drained(options) ? 1 : 0;
+
+    print_results(options, stats, elapsed.count(), drained);
+    return stats.opened > 0 && drained != 0 ? 0 : 1;
+}
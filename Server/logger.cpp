@@ -0,0 +1,325 @@
+#include "logger.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+/*
+ * A slot in the ring. sequence says whose turn it is: a slot at position
+ * p is free for the producer of p when sequence == p, and holds a line for
+ * the consumer when sequence == p + 1.
+ */
+struct log_slot
+{
+    std::atomic<std::size_t> sequence;
+    LOG_LEVEL level;
+    std::chrono::system_clock::time_point time;
+    std::size_t length;
+    char text[LOG_LINE_LENGTH];
+};
+
+static log_slot ring[LOG_RING_SIZE];
+static std::atomic<std::size_t> enqueue_pos(0);
+static std::size_t dequeue_pos = 0; // Only touched by the drain thread
+
+static std::atomic<int> min_level(LOG_INFO);
+static std::atomic<bool> log_payloads(false);
+static std::atomic<bool> running(false);
+static std::thread drain_thread;
+
+// Lines dropped because the ring was full or the rate limit was hit
+static std::atomic<unsigned long> dropped_full(0);
+static std::atomic<unsigned long> dropped_rate(0);
+
+// The second the rate limit is counting, and how many lines were logged in it
+static std::atomic<long long> rate_second(0);
+static std::atomic<unsigned int> rate_count(0);
+
+static const char *LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+static bool init_ring()
+{
+    for (std::size_t i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    return true;
+}
+
+// Ready before main, lines logged before start() wait in the ring
+static bool ring_ready = init_ring();
+
+static bool under_rate_limit()
+{
+    long long now = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+
+    long long second = rate_second.load(std::memory_order_relaxed);
+    if (second != now && rate_second.compare_exchange_strong(second, now, std::memory_order_relaxed))
+        rate_count.store(0, std::memory_order_relaxed);
+
+    return rate_count.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_LIMIT;
+}
+
+/*
+ * Claims a slot and copies the line in. Never blocks, a full ring drops
+ * the line. Warnings and errors don't count towards the rate limit, so a
+ * flood of debug or info lines can't hide them
+ */
+static void push(LOG_LEVEL level, const char *text, std::size_t length)
+{
+    if (level < LOG_WARN && !under_rate_limit())
+    {
+        dropped_rate.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    log_slot *slot;
+
+    while (true)
+    {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        long diff = (long)sequence - (long)pos;
+
+        if (diff == 0)
+        {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            dropped_full.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->time = std::chrono::system_clock::now();
+    slot->length = length;
+    std::memcpy(slot->text, text, length);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+static void append_time(std::string &out, std::chrono::system_clock::time_point time)
+{
+    std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+    long millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+    std::tm utc;
+    gmtime_r(&seconds, &utc);
+
+    char buffer[32];
+    std::size_t length = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+    std::snprintf(buffer + length, sizeof(buffer) - length, ".%03ldZ ", millis);
+    out += buffer;
+}
+
+static void append_line(std::string &out, std::chrono::system_clock::time_point time, LOG_LEVEL level,
+                        const char *text, std::size_t length)
+{
+    append_time(out, time);
+    out += "level=";
+    out += LEVEL_NAMES[level];
+    out += ' ';
+    out.append(text, length);
+    out += '\n';
+}
+
+/*
+ * Moves every queued line into out. Returns false if there weren't any.
+ */
+static bool drain(std::string &out)
+{
+    bool drained = false;
+
+    while (true)
+    {
+        log_slot &slot = ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+            break;
+
+        append_line(out, slot.time, slot.level, slot.text, slot.length);
+
+        slot.sequence.store(dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+        dequeue_pos++;
+        drained = true;
+    }
+
+    return drained;
+}
+
+/*
+ * Writes lines out in batches, one write per batch. Reports dropped
+ * lines whenever the ring runs dry, at most once a second. The report is
+ * written straight out, were it logged it could be dropped itself, and
+ * counted as another line to report.
+ */
+static void drain_loop()
+{
+    unsigned long reported_full = 0;
+    unsigned long reported_rate = 0;
+    std::chrono::steady_clock::time_point last_report;
+    std::string out;
+
+    while (true)
+    {
+        bool stopping = !running.load();
+
+        out.clear();
+        if (drain(out))
+        {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+            continue;
+        }
+
+        unsigned long full = dropped_full.load();
+        unsigned long rate = dropped_rate.load();
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if ((full != reported_full || rate != reported_rate) &&
+            (stopping || now - last_report >= std::chrono::seconds(1)))
+        {
+            char report[128];
+            int length = std::snprintf(report, sizeof(report), "msg=\"log lines dropped\" ring_full=%lu rate_limited=%lu",
+                                       full - reported_full, rate - reported_rate);
+            append_line(out, std::chrono::system_clock::now(), LOG_WARN, report, length);
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+            reported_full = full;
+            reported_rate = rate;
+            last_report = now;
+        }
+
+        if (stopping)
+            return;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+// ======== Record ========
+log_record::log_record(LOG_LEVEL level, const char *event)
+    : level_(level), length_(0)
+{
+    append_key("msg");
+    append_quoted(event, std::strlen(event));
+}
+
+log_record::~log_record()
+{
+    push(level_, text_, length_);
+}
+
+log_record &log_record::field(const char *key, const std::string &value)
+{
+    append_key(key);
+    append_quoted(value.data(), value.size());
+    return *this;
+}
+
+log_record &log_record::field(const char *key, const char *value)
+{
+    append_key(key);
+    append_quoted(value, std::strlen(value));
+    return *this;
+}
+
+void log_record::append_key(const char *key)
+{
+    if (length_ > 0)
+        append(" ");
+    append(key);
+    append("=");
+}
+
+/*
+ * Values are always quoted, with quotes, backslashes and newlines
+ * escaped so a line stays one line.
+ */
+void log_record::append_quoted(const char *value, std::size_t length)
+{
+    std::string quoted = "\"";
+    for (std::size_t i = 0; i < length; i++)
+    {
+        char ch = value[i];
+        if (ch == '"' || ch == '\\')
+        {
+            quoted += '\\';
+            quoted += ch;
+        }
+        else if (ch == '\n')
+            quoted += "\\n";
+        else if (ch == '\r')
+            quoted += "\\r";
+        else if (ch == '\t')
+            quoted += "\\t";
+        else
+            quoted += ch;
+
+        // Cut long values short rather than build them all up
+        if (length_ + quoted.size() >= LOG_LINE_LENGTH)
+            break;
+    }
+    quoted += '"';
+    append(quoted);
+}
+
+void log_record::append(const std::string &text)
+{
+    std::size_t room = LOG_LINE_LENGTH - length_;
+    std::size_t count = text.size() < room ? text.size() : room;
+    std::memcpy(text_ + length_, text.data(), count);
+    length_ += count;
+}
+
+namespace logger
+{
+void start(LOG_LEVEL level, bool payloads)
+{
+    min_level = level;
+    log_payloads = payloads;
+
+    if (running.exchange(true))
+        return;
+
+    drain_thread = std::thread(drain_loop);
+}
+
+void stop()
+{
+    if (!running.exchange(false))
+        return;
+
+    drain_thread.join();
+}
+
+bool enabled(LOG_LEVEL level)
+{
+    return level >= min_level.load(std::memory_order_relaxed);
+}
+
+bool payloads_enabled()
+{
+    return log_payloads.load(std::memory_order_relaxed);
+}
+
+bool parse_level(const std::string &name, LOG_LEVEL &level)
+{
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+    {
+        if (name == LEVEL_NAMES[i])
+        {
+            level = (LOG_LEVEL)i;
+            return true;
+        }
+    }
+    return false;
+}
+} // namespace logger
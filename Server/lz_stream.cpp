@@ -0,0 +1,187 @@
+#include "lz_stream.h"
+#include <cstring>
+
+// Marks a hash table slot that was never filled
+static const std::uint64_t NO_POSITION = ~(std::uint64_t)0;
+
+static std::uint32_t read32(const unsigned char *p)
+{
+    std::uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static std::uint32_t hash32(std::uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Writes the part of a length that didn't fit in the token
+ */
+static void write_length(std::string &out, std::size_t length)
+{
+    while (length >= 255)
+    {
+        out += (char)255;
+        length -= 255;
+    }
+    out += (char)length;
+}
+
+/*
+ * Reads the part of a length that didn't fit in the token.
+ * Returns false if the payload ends first.
+ */
+static bool read_length(const std::string &payload, std::size_t &pos, std::size_t &length)
+{
+    unsigned char byte;
+    do
+    {
+        if (pos >= payload.size())
+            return false;
+        byte = (unsigned char)payload[pos++];
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+lz_compressor::lz_compressor()
+    : window_start_(0), table_(1 << LZ_HASH_BITS, NO_POSITION)
+{
+}
+
+std::string lz_compressor::compress(const std::string &message)
+{
+    // The message goes on the end of the window, so matches can
+    // reach back into everything sent before it
+    std::size_t start = window_.size();
+    window_ += message;
+
+    const unsigned char *buf = (const unsigned char *)window_.data();
+    std::size_t end = window_.size();
+    std::size_t anchor = start;
+    std::size_t i = start;
+
+    std::string payload;
+
+    while (i + LZ_MIN_MATCH <= end)
+    {
+        std::uint32_t sequence = read32(buf + i);
+        std::uint32_t hash = hash32(sequence);
+        std::uint64_t candidate = table_[hash];
+        table_[hash] = window_start_ + i;
+
+        if (candidate == NO_POSITION || candidate < window_start_)
+        {
+            i++;
+            continue;
+        }
+
+        std::size_t match = candidate - window_start_;
+        if (i - match > LZ_WINDOW || read32(buf + match) != sequence)
+        {
+            i++;
+            continue;
+        }
+
+        std::size_t length = LZ_MIN_MATCH;
+        while (i + length < end && buf[match + length] == buf[i + length])
+            length++;
+
+        std::size_t literals = i - anchor;
+        std::size_t extra = length - LZ_MIN_MATCH;
+        std::size_t offset = i - match;
+
+        payload += (char)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+        if (literals >= 15)
+            write_length(payload, literals - 15);
+        payload.append((const char *)buf + anchor, literals);
+        payload += (char)(offset & 0xff);
+        payload += (char)(offset >> 8);
+        if (extra >= 15)
+            write_length(payload, extra - 15);
+
+        i += length;
+        anchor = i;
+    }
+
+    // Whatever is left goes out as literals
+    std::size_t literals = end - anchor;
+    payload += (char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        write_length(payload, literals - 15);
+    payload.append((const char *)buf + anchor, literals);
+
+    // Let the window grow to twice its size before sliding it, so the
+    // bytes are only moved once in a while
+    if (window_.size() > 2 * LZ_WINDOW)
+    {
+        std::size_t drop = window_.size() - LZ_WINDOW;
+        window_.erase(0, drop);
+        window_start_ += drop;
+    }
+
+    std::string frame;
+    std::uint32_t size = payload.size();
+    frame += (char)(size >> 24);
+    frame += (char)(size >> 16);
+    frame += (char)(size >> 8);
+    frame += (char)size;
+    frame += payload;
+    return frame;
+}
+
+lz_decompressor::lz_decompressor()
+{
+}
+
+bool lz_decompressor::decompress(const std::string &payload, std::string &out)
+{
+    std::size_t start = window_.size();
+    std::size_t pos = 0;
+
+    while (pos < payload.size())
+    {
+        unsigned char token = (unsigned char)payload[pos++];
+
+        std::size_t literals = token >> 4;
+        if (literals == 15 && !read_length(payload, pos, literals))
+            return false;
+        if (payload.size() - pos < literals)
+            return false;
+
+        window_.append(payload, pos, literals);
+        pos += literals;
+
+        // The last sequence has no match
+        if (pos == payload.size())
+            break;
+
+        if (payload.size() - pos < 2)
+            return false;
+        std::size_t offset = (unsigned char)payload[pos] | ((unsigned char)payload[pos + 1] << 8);
+        pos += 2;
+
+        std::size_t length = token & 15;
+        if (length == 15 && !read_length(payload, pos, length))
+            return false;
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > window_.size())
+            return false;
+
+        // Byte by byte, a match can overlap the bytes it produces
+        std::size_t from = window_.size() - offset;
+        for (std::size_t k = 0; k < length; k++)
+            window_ += window_[from + k];
+    }
+
+    out.append(window_, start, std::string::npos);
+
+    if (window_.size() > 2 * LZ_WINDOW)
+        window_.erase(0, window_.size() - LZ_WINDOW);
+
+    return true;
+}
@@ -0,0 +1,325 @@
+#include "metrics.h"
+#include <sstream>
+
+/*
+ * Every metric that was ever constructed. Metrics are globals, so this
+ * only changes at startup. The lock is never taken when recording.
+ */
+static std::vector<metric *> &registry()
+{
+    static std::vector<metric *> metrics;
+    return metrics;
+}
+
+static std::mutex &registry_lock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+metric::metric(const std::string &name, const std::string &labels, const std::string &help, METRIC_TYPE type)
+    : name_(name), labels_(labels), help_(help), type_(type)
+{
+    std::lock_guard<std::mutex> guard(registry_lock());
+    registry().push_back(this);
+}
+
+metric::~metric()
+{
+    std::lock_guard<std::mutex> guard(registry_lock());
+    std::vector<metric *> &metrics = registry();
+    for (auto it = metrics.begin(); it != metrics.end(); ++it)
+    {
+        if (*it == this)
+        {
+            metrics.erase(it);
+            break;
+        }
+    }
+}
+
+metric_sample metric::describe() const
+{
+    metric_sample s;
+    s.name = name_;
+    s.labels = labels_;
+    s.help = help_;
+    s.type = type_;
+    s.value = 0;
+    s.count = 0;
+    s.sum = 0;
+    s.p50 = 0;
+    s.p90 = 0;
+    s.p99 = 0;
+    s.max = 0;
+    return s;
+}
+
+// ======== Counter ========
+metric_counter::metric_counter(const std::string &name, const std::string &labels, const std::string &help)
+    : metric(name, labels, help, METRIC_COUNTER), value_(0)
+{
+}
+
+void metric_counter::add(std::uint64_t amount)
+{
+    value_.fetch_add(amount, std::memory_order_relaxed);
+}
+
+metric_sample metric_counter::sample() const
+{
+    metric_sample s = describe();
+    s.value = value_.load(std::memory_order_relaxed);
+    return s;
+}
+
+// ======== Gauge ========
+metric_gauge::metric_gauge(const std::string &name, const std::string &labels, const std::string &help)
+    : metric(name, labels, help, METRIC_GAUGE), value_(0)
+{
+}
+
+void metric_gauge::set(std::int64_t value)
+{
+    value_.store(value, std::memory_order_relaxed);
+}
+
+void metric_gauge::add(std::int64_t amount)
+{
+    value_.fetch_add(amount, std::memory_order_relaxed);
+}
+
+metric_sample metric_gauge::sample() const
+{
+    metric_sample s = describe();
+    s.value = value_.load(std::memory_order_relaxed);
+    return s;
+}
+
+// ======== Histogram ========
+metric_histogram::metric_histogram(const std::string &name, const std::string &labels, const std::string &help)
+    : metric(name, labels, help, METRIC_HISTOGRAM), count_(0), sum_(0), max_(0)
+{
+    for (std::size_t i = 0; i < METRICS_BUCKETS; i++)
+        buckets_[i] = 0;
+}
+
+/*
+ * Values below METRICS_SUB_BUCKETS are their own bucket. Above that the
+ * bucket is picked by the highest set bit, then by the next
+ * METRICS_SUB_BUCKET_BITS bits.
+ */
+std::size_t metric_histogram::bucket_index(std::uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+        return value;
+
+    int high_bit = 63 - __builtin_clzll(value);
+    int shift = high_bit - METRICS_SUB_BUCKET_BITS;
+    return (high_bit - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + ((value >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// The smallest value that lands in the bucket
+std::uint64_t metric_histogram::bucket_value(std::size_t index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+        return index;
+
+    std::size_t power = index / METRICS_SUB_BUCKETS;
+    std::uint64_t sub_bucket = index % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub_bucket) << (power - 1);
+}
+
+void metric_histogram::record(std::uint64_t value)
+{
+    buckets_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    std::uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+/*
+ * The value below which p (0 to 1) of the recorded values fall, to within
+ * a bucket. Recording can carry on while this runs, so it's approximate.
+ */
+std::uint64_t metric_histogram::percentile(double p) const
+{
+    std::uint64_t count = count_.load(std::memory_order_relaxed);
+    if (count == 0)
+        return 0;
+
+    std::uint64_t wanted = (std::uint64_t)(p * count);
+    if (wanted == 0)
+        wanted = 1;
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < METRICS_BUCKETS; i++)
+    {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= wanted)
+            return bucket_value(i);
+    }
+
+    return max_.load(std::memory_order_relaxed);
+}
+
+metric_sample metric_histogram::sample() const
+{
+    metric_sample s = describe();
+    s.count = count_.load(std::memory_order_relaxed);
+    s.sum = sum_.load(std::memory_order_relaxed);
+    s.p50 = percentile(0.5);
+    s.p90 = percentile(0.9);
+    s.p99 = percentile(0.99);
+    s.max = max_.load(std::memory_order_relaxed);
+    return s;
+}
+
+// ======== Timer ========
+metric_timer::metric_timer(metric_histogram &histogram)
+    : histogram_(histogram), start_(std::chrono::steady_clock::now())
+{
+}
+
+metric_timer::~metric_timer()
+{
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+    histogram_.record(elapsed.count());
+}
+
+// ======== Metered mutex ========
+metered_mutex::metered_mutex(metric_histogram &wait_time)
+    : wait_time_(wait_time)
+{
+}
+
+void metered_mutex::lock()
+{
+    if (mutex_.try_lock())
+    {
+        wait_time_.record(0);
+        return;
+    }
+
+    metric_timer timer(wait_time_);
+    mutex_.lock();
+}
+
+void metered_mutex::unlock()
+{
+    mutex_.unlock();
+}
+
+bool metered_mutex::try_lock()
+{
+    return mutex_.try_lock();
+}
+
+namespace metrics
+{
+metric_histogram parse_time("horizon_parse_time_ns", "", "Time spent parsing a message");
+metric_histogram set_cell_time("horizon_set_cell_time_ns", "", "Time spent in setCellContents");
+metric_histogram range_op_time("horizon_range_op_time_ns", "", "Time spent applying a fill, clear, insert, delete or move");
+metric_histogram cycle_check_time("horizon_cycle_check_time_ns", "", "Time spent checking an edit for circular dependencies");
+metric_histogram broadcast_fanout("horizon_broadcast_fanout", "", "Clients a broadcast was queued on");
+metric_histogram serialized_bytes("horizon_serialized_bytes", "", "Size of each message serialized for clients");
+metric_counter bytes_sent("horizon_bytes_sent_total", "", "Bytes written to client sockets");
+metric_histogram write_queue_depth("horizon_write_queue_depth", "", "Messages waiting on a client when another is queued");
+metric_histogram save_time("horizon_save_time_ns", "", "Time spent saving every changed spreadsheet");
+metric_histogram metadata_save_time("horizon_metadata_save_time_ns", "", "Time spent writing the spreadsheet names and logins files");
+metric_histogram lock_wait_time("horizon_lock_wait_time_ns", "", "Time spent waiting for the server lock");
+metric_gauge connected_clients("horizon_connected_clients", "", "Clients currently connected");
+metric_counter admin_tap_dropped("horizon_admin_tap_dropped_total", "", "Client messages dropped because the admin fell behind");
+metric_gauge connected_viewers("horizon_connected_viewers", "", "Read only clients currently connected");
+metric_gauge registered_clients("horizon_registered_clients", "", "Entries in the server's client registry, live or not yet let go");
+metric_gauge registered_sheet_clients("horizon_registered_sheet_clients", "", "Entries in the per spreadsheet editor and viewer registries, live or not yet let go");
+metric_histogram snapshot_publish_time("horizon_snapshot_publish_time_ns", "", "Time spent publishing spreadsheet snapshots for viewers");
+metric_histogram recalc_time("horizon_recalc_time_ns", "", "Time spent recalculating the formulas an edit affected");
+metric_histogram recalc_formulas("horizon_recalc_formulas", "", "Formulas worked out by each recalculation");
+metric_histogram recalc_levels("horizon_recalc_levels", "", "Levels each recalculation's formulas were put in");
+metric_histogram recalc_unchanged("horizon_recalc_unchanged", "", "Formulas each recalculation worked out to the value they already had");
+metric_histogram recalc_pruned("horizon_recalc_pruned", "", "Formulas downstream of a change each recalculation skipped, as nothing they depend on changed value");
+metric_counter recalc_parallel_levels("horizon_recalc_parallel_levels_total", "", "Recalculation levels spread over the work pool");
+
+static const char *MESSAGE_HELP = "Messages parsed, by type";
+static metric_counter open_messages("horizon_messages_total", "type=\"open\"", MESSAGE_HELP);
+static metric_counter edit_messages("horizon_messages_total", "type=\"edit\"", MESSAGE_HELP);
+static metric_counter undo_messages("horizon_messages_total", "type=\"undo\"", MESSAGE_HELP);
+static metric_counter revert_messages("horizon_messages_total", "type=\"revert\"", MESSAGE_HELP);
+static metric_counter subscribe_messages("horizon_messages_total", "type=\"subscribe\"", MESSAGE_HELP);
+static metric_counter admin_messages("horizon_messages_total", "type=\"admin\"", MESSAGE_HELP);
+static metric_counter other_messages("horizon_messages_total", "type=\"other\"", MESSAGE_HELP);
+
+metric_counter &messages_parsed(const std::string &type)
+{
+    if (type == "edit")
+        return edit_messages;
+    if (type == "open")
+        return open_messages;
+    if (type == "undo")
+        return undo_messages;
+    if (type == "revert")
+        return revert_messages;
+    if (type == "subscribe")
+        return subscribe_messages;
+    if (type == "admin" || type == "close" || type == "user" || type == "sheet" || type == "stats" || type == "tap")
+        return admin_messages;
+    return other_messages;
+}
+
+std::vector<metric_sample> snapshot()
+{
+    std::vector<metric_sample> samples;
+
+    std::lock_guard<std::mutex> guard(registry_lock());
+    for (metric *m : registry())
+        samples.push_back(m->sample());
+
+    return samples;
+}
+
+/*
+ * Every metric in the Prometheus text format. Histograms are written as
+ * summaries: a few quantiles, the sum and the count.
+ */
+std::string prometheus_text()
+{
+    std::vector<metric_sample> samples = snapshot();
+    std::ostringstream out;
+    std::string last_name;
+
+    for (const metric_sample &s : samples)
+    {
+        // Metrics that only differ by label share their HELP and TYPE lines
+        if (s.name != last_name)
+        {
+            const char *type = s.type == METRIC_COUNTER ? "counter" : s.type == METRIC_GAUGE ? "gauge" : "summary";
+            out << "# HELP " << s.name << " " << s.help << "\n";
+            out << "# TYPE " << s.name << " " << type << "\n";
+            last_name = s.name;
+        }
+
+        std::string labels = s.labels.empty() ? "" : "{" + s.labels + "}";
+        std::string prefix = s.labels.empty() ? "{" : "{" + s.labels + ",";
+
+        if (s.type != METRIC_HISTOGRAM)
+        {
+            out << s.name << labels << " " << s.value << "\n";
+            continue;
+        }
+
+        out << s.name << prefix << "quantile=\"0.5\"} " << s.p50 << "\n";
+        out << s.name << prefix << "quantile=\"0.9\"} " << s.p90 << "\n";
+        out << s.name << prefix << "quantile=\"0.99\"} " << s.p99 << "\n";
+        out << s.name << prefix << "quantile=\"1\"} " << s.max << "\n";
+        out << s.name << "_sum" << labels << " " << s.sum << "\n";
+        out << s.name << "_count" << labels << " " << s.count << "\n";
+    }
+
+    return out.str();
+}
+} // namespace metrics
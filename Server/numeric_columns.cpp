@@ -0,0 +1,244 @@
+#include "numeric_columns.h"
+#include "numeric_kernels.h"
+#include "cow.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+range_stats::range_stats()
+    : sum(0), count(0), min(std::numeric_limits<double>::infinity()),
+      max(-std::numeric_limits<double>::infinity())
+{
+}
+
+void range_stats::add(const range_stats &part)
+{
+    sum += part.sum;
+    count += part.count;
+    min = std::min(min, part.min);
+    max = std::max(max, part.max);
+}
+
+/*
+ * The numbers in n packed values, with the kernels
+ */
+static range_stats scan(const double *values, std::size_t n)
+{
+    range_stats total;
+    total.sum = numeric_kernels::sum(values, n);
+    total.count = numeric_kernels::count(values, n);
+    total.min = numeric_kernels::min(values, n);
+    total.max = numeric_kernels::max(values, n);
+    return total;
+}
+
+// ======== chunk ========
+numeric_columns::chunk::chunk()
+{
+    std::fill(values, values + NUMERIC_CHUNK_ROWS, std::numeric_limits<double>::quiet_NaN());
+}
+
+void numeric_columns::chunk::update(int offset)
+{
+    int group = offset / NUMERIC_GROUP_ROWS;
+    std::size_t i = NUMERIC_GROUPS + group;
+    groups[i] = scan(values + group * NUMERIC_GROUP_ROWS, NUMERIC_GROUP_ROWS);
+    for (i /= 2; i > 0; i /= 2)
+    {
+        groups[i] = groups[2 * i];
+        groups[i].add(groups[2 * i + 1]);
+    }
+}
+
+/*
+ * Scans the rows of the groups the range only partly covers, and reads the
+ * groups in between off the tree
+ */
+range_stats numeric_columns::chunk::stats(int first, int last) const
+{
+    if (first == 0 && last == NUMERIC_CHUNK_ROWS - 1)
+        return groups[1];
+
+    range_stats total;
+    int first_group = first / NUMERIC_GROUP_ROWS;
+    int last_group = last / NUMERIC_GROUP_ROWS;
+    if (first_group == last_group)
+        return scan(values + first, last - first + 1);
+
+    if (first % NUMERIC_GROUP_ROWS != 0)
+    {
+        int group_end = (first_group + 1) * NUMERIC_GROUP_ROWS;
+        total.add(scan(values + first, group_end - first));
+        first_group++;
+    }
+    if (last % NUMERIC_GROUP_ROWS != NUMERIC_GROUP_ROWS - 1)
+    {
+        int group_begin = last_group * NUMERIC_GROUP_ROWS;
+        total.add(scan(values + group_begin, last - group_begin + 1));
+        last_group--;
+    }
+
+    // Walks up from both ends of [first_group, last_group], adding the
+    // nodes that fall wholly inside it
+    std::size_t begin = NUMERIC_GROUPS + first_group;
+    std::size_t end = NUMERIC_GROUPS + last_group + 1;
+    for (; begin < end; begin /= 2, end /= 2)
+    {
+        if (begin & 1)
+            total.add(groups[begin++]);
+        if (end & 1)
+            total.add(groups[--end]);
+    }
+
+    return total;
+}
+
+// ======== numeric_columns ========
+void numeric_columns::set(int col, int row, double value)
+{
+    if (row < 0 || std::isnan(value))
+        return;
+
+    column &values = cow_writable(cow_writable(columns)[col]);
+    chunk &rows = cow_writable(values[row / NUMERIC_CHUNK_ROWS]);
+    int offset = row % NUMERIC_CHUNK_ROWS;
+    rows.values[offset] = value;
+    rows.update(offset);
+}
+
+void numeric_columns::erase(int col, int row)
+{
+    if (!columns || row < 0)
+        return;
+
+    auto found = columns->find(col);
+    if (found == columns->end())
+        return;
+
+    std::size_t n;
+    const double *slot = rows(*found->second, row, n);
+    if (slot == NULL || std::isnan(*slot))
+        return;
+
+    column_map &writable_columns = cow_writable(columns);
+    auto it = writable_columns.find(col);
+    column &values = cow_writable(it->second);
+    auto changed = values.find(row / NUMERIC_CHUNK_ROWS);
+
+    chunk &rows = cow_writable(changed->second);
+    int offset = row % NUMERIC_CHUNK_ROWS;
+    rows.values[offset] = std::numeric_limits<double>::quiet_NaN();
+    rows.update(offset);
+
+    if (rows.groups[1].count == 0)
+        values.erase(changed);
+    if (values.empty())
+        writable_columns.erase(it);
+}
+
+void numeric_columns::clear()
+{
+    columns.reset();
+}
+
+double numeric_columns::get(int col, int row) const
+{
+    if (!columns || row < 0)
+        return std::numeric_limits<double>::quiet_NaN();
+
+    auto found = columns->find(col);
+    std::size_t n;
+    const double *slot = found == columns->end() ? NULL : rows(*found->second, row, n);
+    return slot == NULL ? std::numeric_limits<double>::quiet_NaN() : *slot;
+}
+
+const double *numeric_columns::rows(const column &values, int row, std::size_t &n)
+{
+    std::size_t offset = row % NUMERIC_CHUNK_ROWS;
+    n = NUMERIC_CHUNK_ROWS - offset;
+    auto found = values.find(row / NUMERIC_CHUNK_ROWS);
+    if (found == values.end())
+        return NULL;
+    return found->second->values + offset;
+}
+
+long long numeric_columns::end_row(const column &values)
+{
+    return values.empty() ? 0 : ((long long)values.rbegin()->first + 1) * NUMERIC_CHUNK_ROWS;
+}
+
+/*
+ * Only the columns in the range that have numbers, and the chunks of them
+ * that do, are looked at
+ */
+range_stats numeric_columns::stats(const cell_range &range) const
+{
+    range_stats total;
+    if (!columns || range.last_row < 0)
+        return total;
+
+    int first_row = std::max(range.first_row, 0);
+    auto it = columns->lower_bound(range.first_col);
+    auto end = columns->upper_bound(range.last_col);
+    for (; it != end; ++it)
+    {
+        const column &values = *it->second;
+        auto found = values.lower_bound(first_row / NUMERIC_CHUNK_ROWS);
+        auto chunks_end = values.upper_bound(range.last_row / NUMERIC_CHUNK_ROWS);
+        for (; found != chunks_end; ++found)
+        {
+            long long chunk_first = (long long)found->first * NUMERIC_CHUNK_ROWS;
+            int first = (int)std::max<long long>(first_row - chunk_first, 0);
+            int last = (int)std::min<long long>(range.last_row - chunk_first, NUMERIC_CHUNK_ROWS - 1);
+            total.add(found->second->stats(first, last));
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Walks both ranges a column at a time, in runs that end wherever either
+ * range reaches the end of a chunk
+ */
+bool numeric_columns::sumproduct(const cell_range &a, const cell_range &b, double &result) const
+{
+    if (a.last_col - a.first_col != b.last_col - b.first_col || a.last_row - a.first_row != b.last_row - b.first_row)
+        return false;
+
+    result = 0;
+    if (!columns || a.first_row < 0 || b.first_row < 0)
+        return true;
+
+    for (int col = 0; col <= a.last_col - a.first_col; col++)
+    {
+        auto a_column = columns->find(a.first_col + col);
+        auto b_column = columns->find(b.first_col + col);
+        if (a_column == columns->end() || b_column == columns->end())
+            continue;
+
+        const column &a_values = *a_column->second;
+        const column &b_values = *b_column->second;
+        long long a_end = end_row(a_values);
+        long long b_end = end_row(b_values);
+        long long height = a.last_row - a.first_row + 1;
+        for (long long offset = 0; offset < height;)
+        {
+            long long a_row = a.first_row + offset;
+            long long b_row = b.first_row + offset;
+            // Past the last chunk of either column, every product is 0
+            if (a_row >= a_end || b_row >= b_end)
+                break;
+
+            std::size_t a_n, b_n;
+            const double *a_found = rows(a_values, a_row, a_n);
+            const double *b_found = rows(b_values, b_row, b_n);
+            std::size_t n = std::min<long long>(std::min(a_n, b_n), height - offset);
+            if (a_found != NULL && b_found != NULL)
+                result += numeric_kernels::sumproduct(a_found, b_found, n);
+            offset += n;
+        }
+    }
+
+    return true;
+}
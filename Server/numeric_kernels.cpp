@@ -0,0 +1,345 @@
+#include "numeric_kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NUMERIC_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// ======== Scalar ========
+static double sum_scalar(const double *values, std::size_t n)
+{
+    double total = 0;
+    for (std::size_t i = 0; i < n; i++)
+        if (!std::isnan(values[i]))
+            total += values[i];
+    return total;
+}
+
+static std::size_t count_scalar(const double *values, std::size_t n)
+{
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < n; i++)
+        if (!std::isnan(values[i]))
+            total++;
+    return total;
+}
+
+// A comparison with NaN is false, so NaNs never replace the result
+static double min_scalar(const double *values, std::size_t n)
+{
+    double result = std::numeric_limits<double>::infinity();
+    for (std::size_t i = 0; i < n; i++)
+        if (values[i] < result)
+            result = values[i];
+    return result;
+}
+
+static double max_scalar(const double *values, std::size_t n)
+{
+    double result = -std::numeric_limits<double>::infinity();
+    for (std::size_t i = 0; i < n; i++)
+        if (values[i] > result)
+            result = values[i];
+    return result;
+}
+
+static double sumproduct_scalar(const double *a, const double *b, std::size_t n)
+{
+    double total = 0;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        double product = a[i] * b[i];
+        if (!std::isnan(product))
+            total += product;
+    }
+    return total;
+}
+
+#ifdef NUMERIC_KERNELS_X86
+/*
+ * The vector versions work through 2 registers at a time so one add
+ * doesn't wait on the last, and leave the rows that don't fill a register
+ * to the scalar versions. A NaN isn't ordered, not even with itself, so
+ * comparing a register with itself gives the mask of its numbers.
+ */
+
+// ======== SSE2 ========
+__attribute__((target("sse2"))) static double sum_sse2(const double *values, std::size_t n)
+{
+    __m128d total0 = _mm_setzero_pd();
+    __m128d total1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128d a = _mm_loadu_pd(values + i);
+        __m128d b = _mm_loadu_pd(values + i + 2);
+        total0 = _mm_add_pd(total0, _mm_and_pd(a, _mm_cmpord_pd(a, a)));
+        total1 = _mm_add_pd(total1, _mm_and_pd(b, _mm_cmpord_pd(b, b)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(total0, total1));
+    return lanes[0] + lanes[1] + sum_scalar(values + i, n - i);
+}
+
+/*
+ * A mask lane is all ones, -1 as an integer, so subtracting the masks
+ * counts the numbers
+ */
+__attribute__((target("sse2"))) static std::size_t count_sse2(const double *values, std::size_t n)
+{
+    __m128i counts = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d a = _mm_loadu_pd(values + i);
+        counts = _mm_sub_epi64(counts, _mm_castpd_si128(_mm_cmpord_pd(a, a)));
+    }
+
+    long long lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, counts);
+    return lanes[0] + lanes[1] + count_scalar(values + i, n - i);
+}
+
+/*
+ * minpd gives its second operand when either is NaN, so with the values
+ * first a NaN leaves the result as it was
+ */
+__attribute__((target("sse2"))) static double min_sse2(const double *values, std::size_t n)
+{
+    __m128d result0 = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    __m128d result1 = result0;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        result0 = _mm_min_pd(_mm_loadu_pd(values + i), result0);
+        result1 = _mm_min_pd(_mm_loadu_pd(values + i + 2), result1);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(result0, result1));
+    return std::min(std::min(lanes[0], lanes[1]), min_scalar(values + i, n - i));
+}
+
+__attribute__((target("sse2"))) static double max_sse2(const double *values, std::size_t n)
+{
+    __m128d result0 = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+    __m128d result1 = result0;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        result0 = _mm_max_pd(_mm_loadu_pd(values + i), result0);
+        result1 = _mm_max_pd(_mm_loadu_pd(values + i + 2), result1);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_max_pd(result0, result1));
+    return std::max(std::max(lanes[0], lanes[1]), max_scalar(values + i, n - i));
+}
+
+__attribute__((target("sse2"))) static double sumproduct_sse2(const double *a, const double *b, std::size_t n)
+{
+    __m128d total0 = _mm_setzero_pd();
+    __m128d total1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128d product0 = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        __m128d product1 = _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        total0 = _mm_add_pd(total0, _mm_and_pd(product0, _mm_cmpord_pd(product0, product0)));
+        total1 = _mm_add_pd(total1, _mm_and_pd(product1, _mm_cmpord_pd(product1, product1)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(total0, total1));
+    return lanes[0] + lanes[1] + sumproduct_scalar(a + i, b + i, n - i);
+}
+
+// ======== AVX2 ========
+__attribute__((target("avx2"))) static double sum_avx2(const double *values, std::size_t n)
+{
+    __m256d total0 = _mm256_setzero_pd();
+    __m256d total1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256d a = _mm256_loadu_pd(values + i);
+        __m256d b = _mm256_loadu_pd(values + i + 4);
+        total0 = _mm256_add_pd(total0, _mm256_and_pd(a, _mm256_cmp_pd(a, a, _CMP_ORD_Q)));
+        total1 = _mm256_add_pd(total1, _mm256_and_pd(b, _mm256_cmp_pd(b, b, _CMP_ORD_Q)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(total0, total1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_scalar(values + i, n - i);
+}
+
+__attribute__((target("avx2"))) static std::size_t count_avx2(const double *values, std::size_t n)
+{
+    __m256i counts = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(values + i);
+        counts = _mm256_sub_epi64(counts, _mm256_castpd_si256(_mm256_cmp_pd(a, a, _CMP_ORD_Q)));
+    }
+
+    long long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, counts);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_scalar(values + i, n - i);
+}
+
+__attribute__((target("avx2"))) static double min_avx2(const double *values, std::size_t n)
+{
+    __m256d result0 = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    __m256d result1 = result0;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        result0 = _mm256_min_pd(_mm256_loadu_pd(values + i), result0);
+        result1 = _mm256_min_pd(_mm256_loadu_pd(values + i + 4), result1);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_min_pd(result0, result1));
+    return std::min(std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3])),
+                    min_scalar(values + i, n - i));
+}
+
+__attribute__((target("avx2"))) static double max_avx2(const double *values, std::size_t n)
+{
+    __m256d result0 = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    __m256d result1 = result0;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        result0 = _mm256_max_pd(_mm256_loadu_pd(values + i), result0);
+        result1 = _mm256_max_pd(_mm256_loadu_pd(values + i + 4), result1);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_max_pd(result0, result1));
+    return std::max(std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])),
+                    max_scalar(values + i, n - i));
+}
+
+__attribute__((target("avx2"))) static double sumproduct_avx2(const double *a, const double *b, std::size_t n)
+{
+    __m256d total0 = _mm256_setzero_pd();
+    __m256d total1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256d product0 = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        __m256d product1 = _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+        total0 = _mm256_add_pd(total0, _mm256_and_pd(product0, _mm256_cmp_pd(product0, product0, _CMP_ORD_Q)));
+        total1 = _mm256_add_pd(total1, _mm256_and_pd(product1, _mm256_cmp_pd(product1, product1, _CMP_ORD_Q)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(total0, total1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumproduct_scalar(a + i, b + i, n - i);
+}
+#endif
+
+// ======== Dispatch ========
+struct kernel_set
+{
+    const char *name;
+    double (*sum)(const double *, std::size_t);
+    std::size_t (*count)(const double *, std::size_t);
+    double (*min)(const double *, std::size_t);
+    double (*max)(const double *, std::size_t);
+    double (*sumproduct)(const double *, const double *, std::size_t);
+};
+
+// Best first
+static const kernel_set kernel_sets[] = {
+#ifdef NUMERIC_KERNELS_X86
+    {"avx2", sum_avx2, count_avx2, min_avx2, max_avx2, sumproduct_avx2},
+    {"sse2", sum_sse2, count_sse2, min_sse2, max_sse2, sumproduct_sse2},
+#endif
+    {"scalar", sum_scalar, count_scalar, min_scalar, max_scalar, sumproduct_scalar},
+};
+
+static bool supported(const kernel_set &set)
+{
+#ifdef NUMERIC_KERNELS_X86
+    // Can run before main, when the CPU hasn't been looked at yet
+    __builtin_cpu_init();
+    std::string name = set.name;
+    if (name == "avx2")
+        return __builtin_cpu_supports("avx2");
+    if (name == "sse2")
+        return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+static const kernel_set *best()
+{
+    for (const kernel_set &set : kernel_sets)
+        if (supported(set))
+            return &set;
+    return &kernel_sets[0];
+}
+
+static const kernel_set *kernels = best();
+
+namespace numeric_kernels
+{
+double sum(const double *values, std::size_t n)
+{
+    return kernels->sum(values, n);
+}
+
+std::size_t count(const double *values, std::size_t n)
+{
+    return kernels->count(values, n);
+}
+
+double min(const double *values, std::size_t n)
+{
+    return kernels->min(values, n);
+}
+
+double max(const double *values, std::size_t n)
+{
+    return kernels->max(values, n);
+}
+
+double sumproduct(const double *a, const double *b, std::size_t n)
+{
+    return kernels->sumproduct(a, b, n);
+}
+
+const char *implementation()
+{
+    return kernels->name;
+}
+
+std::vector<std::string> implementations()
+{
+    std::vector<std::string> names;
+    for (const kernel_set &set : kernel_sets)
+        if (supported(set))
+            names.push_back(set.name);
+    return names;
+}
+
+bool use(const std::string &name)
+{
+    for (const kernel_set &set : kernel_sets)
+    {
+        if (name == set.name && supported(set))
+        {
+            kernels = &set;
+            return true;
+        }
+    }
+    return false;
+}
+} // namespace numeric_kernels
@@ -0,0 +1,226 @@
+#include "range_dependencies.h"
+#include "cow.h"
+#include <algorithm>
+#include <functional>
+#include <tuple>
+
+bool range_dependencies::before(const node &a, const node &b)
+{
+    return std::tie(a.first_row, a.last_row, a.formula, a.first_col, a.last_col) <
+           std::tie(b.first_row, b.last_row, b.formula, b.first_col, b.last_col);
+}
+
+/*
+ * A copy of n with new children
+ */
+range_dependencies::node_ptr range_dependencies::make(const node &n, const node_ptr &left, const node_ptr &right)
+{
+    std::shared_ptr<node> made = std::make_shared<node>();
+    made->first_col = n.first_col;
+    made->last_col = n.last_col;
+    made->first_row = n.first_row;
+    made->last_row = n.last_row;
+    made->formula = n.formula;
+    made->priority = n.priority;
+    made->left = left;
+    made->right = right;
+
+    made->max_last_row = n.last_row;
+    if (left)
+        made->max_last_row = std::max(made->max_last_row, left->max_last_row);
+    if (right)
+        made->max_last_row = std::max(made->max_last_row, right->max_last_row);
+    return made;
+}
+
+/*
+ * Splits tree into the nodes before key and the rest
+ */
+void range_dependencies::split(const node_ptr &tree, const node &key, node_ptr &less_than, node_ptr &rest)
+{
+    if (!tree)
+    {
+        less_than.reset();
+        rest.reset();
+        return;
+    }
+
+    node_ptr middle;
+    if (before(*tree, key))
+    {
+        split(tree->right, key, middle, rest);
+        less_than = make(*tree, tree->left, middle);
+    }
+    else
+    {
+        split(tree->left, key, less_than, middle);
+        rest = make(*tree, middle, tree->right);
+    }
+}
+
+/*
+ * Joins two trees, every node in left comes before every node in right
+ */
+range_dependencies::node_ptr range_dependencies::merge(const node_ptr &left, const node_ptr &right)
+{
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+
+    if (left->priority > right->priority)
+        return make(*left, left->left, merge(left->right, right));
+    return make(*right, merge(left, right->left), right->right);
+}
+
+range_dependencies::node_ptr range_dependencies::insert(const node_ptr &tree, const node &n)
+{
+    if (!tree)
+        return make(n, NULL, NULL);
+
+    if (n.priority > tree->priority)
+    {
+        node_ptr left, right;
+        split(tree, n, left, right);
+        return make(n, left, right);
+    }
+
+    if (before(n, *tree))
+        return make(*tree, insert(tree->left, n), tree->right);
+    return make(*tree, tree->left, insert(tree->right, n));
+}
+
+range_dependencies::node_ptr range_dependencies::erase(const node_ptr &tree, const node &key)
+{
+    if (!tree)
+        return tree;
+
+    if (before(key, *tree))
+    {
+        node_ptr left = erase(tree->left, key);
+        return left == tree->left ? tree : make(*tree, left, tree->right);
+    }
+    if (before(*tree, key))
+    {
+        node_ptr right = erase(tree->right, key);
+        return right == tree->right ? tree : make(*tree, tree->left, right);
+    }
+    return merge(tree->left, tree->right);
+}
+
+/*
+ * The node for the formula's range, without children
+ */
+range_dependencies::node range_dependencies::key(const std::string &formula, const cell_range &range)
+{
+    node n;
+    n.first_col = range.first_col;
+    n.last_col = range.last_col;
+    n.first_row = range.first_row;
+    n.last_row = range.last_row;
+    n.formula = formula;
+    // Any well mixed number keeps the treap balanced, a hash of the key
+    // keeps copies of the index that make the same changes the same shape
+    n.priority = std::hash<std::string>()(formula) ^ ((std::size_t)range.first_row * 0x9E3779B97F4A7C15ULL) ^
+                 ((std::size_t)range.last_row * 0xC2B2AE3D27D4EB4FULL) ^
+                 ((std::size_t)range.first_col * 0x165667B19E3779F9ULL);
+    return n;
+}
+
+void range_dependencies::stab(const node *tree, int col, int row, std::vector<std::string> &formulas)
+{
+    if (tree == NULL || tree->max_last_row < row)
+        return;
+
+    stab(tree->left.get(), col, row, formulas);
+    // Everything from here on starts below the row
+    if (tree->first_row > row)
+        return;
+    if (tree->last_row >= row && tree->first_col <= col && col <= tree->last_col)
+        formulas.push_back(tree->formula);
+    stab(tree->right.get(), col, row, formulas);
+}
+
+bool range_dependencies::stabs(const node *tree, int col, int row)
+{
+    if (tree == NULL || tree->max_last_row < row)
+        return false;
+
+    if (stabs(tree->left.get(), col, row))
+        return true;
+    if (tree->first_row > row)
+        return false;
+    if (tree->last_row >= row && tree->first_col <= col && col <= tree->last_col)
+        return true;
+    return stabs(tree->right.get(), col, row);
+}
+
+void range_dependencies::add(const std::string &formula, const cell_range &range)
+{
+    node n = key(formula, range);
+    if (range.last_col - range.first_col >= RANGE_INDEX_COLUMNS)
+    {
+        wide = insert(wide, n);
+        return;
+    }
+
+    column_map &writable_columns = cow_writable(columns);
+    for (int col = range.first_col; col <= range.last_col; col++)
+    {
+        node_ptr &tree = writable_columns[col];
+        tree = insert(tree, n);
+    }
+}
+
+void range_dependencies::remove(const std::string &formula, const cell_range &range)
+{
+    node n = key(formula, range);
+    if (range.last_col - range.first_col >= RANGE_INDEX_COLUMNS)
+    {
+        wide = erase(wide, n);
+        return;
+    }
+
+    if (!columns)
+        return;
+
+    column_map &writable_columns = cow_writable(columns);
+    auto it = writable_columns.lower_bound(range.first_col);
+    auto end = writable_columns.upper_bound(range.last_col);
+    while (it != end)
+    {
+        it->second = erase(it->second, n);
+        if (!it->second)
+            it = writable_columns.erase(it);
+        else
+            ++it;
+    }
+}
+
+void range_dependencies::clear()
+{
+    columns.reset();
+    wide.reset();
+}
+
+void range_dependencies::find(int col, int row, std::vector<std::string> &formulas) const
+{
+    stab(wide.get(), col, row, formulas);
+    if (!columns)
+        return;
+
+    auto column = columns->find(col);
+    if (column != columns->end())
+        stab(column->second.get(), col, row, formulas);
+}
+
+bool range_dependencies::covers(int col, int row) const
+{
+    if (stabs(wide.get(), col, row))
+        return true;
+    if (!columns)
+        return false;
+
+    auto column = columns->find(col);
+    return column != columns->end() && stabs(column->second.get(), col, row);
+}
@@ -22,6 +22,7 @@
 #include "client.h"
 #include "JSON_message.h"
 #include "spreadsheet_server.h"
+#include "logger.h"
 
 using asio::ip::tcp;
 
@@ -32,23 +33,60 @@ void send_server_message(client *c);
 
 client *c_;
 
+/*
+ * Usage: server [port] [--io-threads N] [--max-connections N]
+ *               [--max-connections-per-ip N] [--reuse-port] [--metrics-port N]
+ *               [--log-level debug|info|warn|error] [--log-payloads]
+ *               [--per-user-undo] [--recalc-threads N]
+ * A limit of 0 means unlimited.
+ */
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
-  {
-    spreadsheet_server server;
-    // Create our spreadsheet_server
-    // start it (blocking)
-    server.start();
-  }
-  else
+  server_options options;
+  LOG_LEVEL log_level = LOG_INFO;
+  bool log_payloads = false;
+
+  for (int i = 1; i < argc; i++)
   {
-    spreadsheet_server server (std::atoi(argv[1])); 
-    server.start();
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if (arg == "--io-threads" && has_value)
+      options.io_threads = std::atoi(argv[++i]);
+    else if (arg == "--max-connections" && has_value)
+      options.accept.max_connections = std::atoi(argv[++i]);
+    else if (arg == "--max-connections-per-ip" && has_value)
+      options.accept.max_connections_per_ip = std::atoi(argv[++i]);
+    else if (arg == "--reuse-port")
+      options.accept.reuse_port = true;
+    else if (arg == "--metrics-port" && has_value)
+      options.metrics_port = std::atoi(argv[++i]);
+    else if (arg == "--log-level" && has_value && logger::parse_level(argv[i + 1], log_level))
+      i++;
+    else if (arg == "--log-payloads")
+      log_payloads = true;
+    else if (arg == "--per-user-undo")
+      options.per_user_undo = true;
+    else if (arg == "--recalc-threads" && has_value)
+      options.recalc_threads = std::atoi(argv[++i]);
+    else if (arg[0] != '-')
+      options.port = std::atoi(argv[i]);
+    else
+    {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return 1;
+    }
   }
 
-  std::cout << "SERVER STOPPED. SHUTTING DOWN" << std::endl;
-  
+  logger::start(log_level, log_payloads);
+
+  // Create our spreadsheet_server
+  // start it (blocking)
+  spreadsheet_server server(options);
+  server.start();
+
+  LOG(LOG_INFO, "server stopped, shutting down");
+  logger::stop();
 
   return 0;
 }
@@ -1,6 +1,14 @@
 #include "spreadsheet.h"
+#include "metrics.h"
+#include "formula.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <random>
 #include <stdexcept>
 #include <iterator>
+#include <cmath>
+#include <limits>
 #include <JSON_message.h>
 #include <fstream>
 #include <iostream>
@@ -9,20 +17,24 @@
 cell::cell()
 {
 	this->contents = "";
+	this->lastEdit = NO_EDIT;
 }
 
 cell::cell(const std::string &cellName)
 {
 	this->cellName = cellName;
 	this->contents = "";
+	this->lastEdit = NO_EDIT;
 }
 
 cell::cell(const cell &other_cell)
 {
 	this->contents = other_cell.contents;
 	this->dependencies = other_cell.dependencies;
+	this->ranges = other_cell.ranges;
 	this->history = other_cell.history;
 	this->cellName = other_cell.cellName;
+	this->lastEdit = other_cell.lastEdit;
 }
 
 cell::cell(const std::string &contents, const std::vector<std::string> &dependencies,
@@ -32,6 +44,7 @@ cell::cell(const std::string &contents, const std::vector<std::string> &dependen
 	this->dependencies = dependencies;
 	this->contents = contents;
 	this->cellName = cellName;
+	this->lastEdit = NO_EDIT;
 }
 
 cell::~cell()
@@ -41,26 +54,204 @@ cell::~cell()
 	// nothing needs to be deleted
 }
 
+/* ========== CELL HISTORY FUNCTIONS ======= */
+cell_history::~cell_history()
+{
+	// Let go of the entries nothing else shares one at a time, letting the
+	// shared_ptrs do it would recurse once per entry
+	while (top_ && top_.use_count() == 1)
+	{
+		std::shared_ptr<const entry> below = top_->below;
+		top_ = below;
+	}
+}
+
+bool cell_history::empty() const
+{
+	return !top_;
+}
+
+const cell_data &cell_history::top() const
+{
+	return top_->data;
+}
+
+void cell_history::push(const cell_data &data)
+{
+	top_ = std::make_shared<const entry>(entry{data, top_});
+}
+
+void cell_history::pop()
+{
+	std::shared_ptr<const entry> below = top_->below;
+	top_ = below;
+}
+
+std::stack<cell_data> cell_history::toStack() const
+{
+	std::vector<const cell_data *> newestFirst;
+	for (const entry *e = top_.get(); e != NULL; e = e->below.get())
+		newestFirst.push_back(&e->data);
+
+	std::stack<cell_data> history;
+	for (auto it = newestFirst.rbegin(); it != newestFirst.rend(); ++it)
+		history.push(**it);
+	return history;
+}
+
+/* ========== CELL INDEX FUNCTIONS ======= */
+cell_index::block_key cell_index::blockOf(const cell_key &key)
+{
+	return block_key(std::get<0>(key), std::get<1>(key) / CELL_INDEX_BLOCK_ROWS);
+}
+
+void cell_index::insert(const cell_key &key)
+{
+	std::shared_ptr<block> &b = cow_writable(blocks)[blockOf(key)];
+	cow_writable(b).insert(key);
+}
+
+void cell_index::erase(const cell_key &key)
+{
+	if (!blocks)
+		return;
+
+	auto found = blocks->find(blockOf(key));
+	if (found == blocks->end() || found->second->count(key) == 0)
+		return;
+
+	block_map &writableBlocks = cow_writable(blocks);
+	auto b = writableBlocks.find(blockOf(key));
+	cow_writable(b->second).erase(key);
+	if (b->second->empty())
+		writableBlocks.erase(b);
+}
+
+void cell_index::clear()
+{
+	blocks.reset();
+}
+
+void cell_index::getColumnRange(int col, int first_row, int last_row, std::vector<std::string> &cellNames) const
+{
+	if (!blocks)
+		return;
+
+	auto it = blocks->lower_bound(block_key(col, first_row / CELL_INDEX_BLOCK_ROWS));
+	auto end = blocks->upper_bound(block_key(col, last_row / CELL_INDEX_BLOCK_ROWS));
+	for (; it != end; ++it)
+	{
+		const block &b = *it->second;
+		auto cellIt = b.lower_bound(cell_key(col, first_row, ""));
+		auto cellEnd = b.lower_bound(cell_key(col, last_row + 1, ""));
+		for (; cellIt != cellEnd; ++cellIt)
+			cellNames.push_back(std::get<2>(*cellIt));
+	}
+}
+
+bool cell_index::getNextColumn(int col, int &next) const
+{
+	if (!blocks)
+		return false;
+
+	// Empty blocks are dropped, so the first block past col has a cell
+	auto it = blocks->lower_bound(block_key(col + 1, std::numeric_limits<int>::min()));
+	if (it == blocks->end())
+		return false;
+
+	next = it->first.first;
+	return true;
+}
+
+void cell_index::getCellsAfter(const cell_key *key, std::size_t count, std::vector<std::string> &cellNames) const
+{
+	if (!blocks)
+		return;
+
+	auto it = key == NULL ? blocks->begin() : blocks->lower_bound(blockOf(*key));
+	for (; it != blocks->end() && count > 0; ++it)
+	{
+		const block &b = *it->second;
+		auto cellIt = key != NULL && it->first == blockOf(*key) ? b.upper_bound(*key) : b.begin();
+		for (; cellIt != b.end() && count > 0; ++cellIt, count--)
+			cellNames.push_back(std::get<2>(*cellIt));
+	}
+}
+
 /* ========== SPREADSHEET FUNCTIONS ====== */
 
+/*
+ * Epochs start somewhere random every run and step by an odd number, so
+ * no two spreadsheets in a run get the same one. Kept to 32 bits so clients
+ * that hold numbers as doubles get it exactly
+ */
+static unsigned long newEpoch()
+{
+	static std::random_device seed;
+	static std::atomic<std::uint32_t> next(seed());
+	std::uint32_t epoch = next.fetch_add(2654435761u);
+	return epoch != 0 ? epoch : newEpoch();
+}
+
 spreadsheet::spreadsheet()
 {
 	this->hasChanged = false;
+	this->version = 0;
+	this->epoch = newEpoch();
+	this->deltaHead = 0;
 }
 
 spreadsheet::spreadsheet(std::string name)
 {
 	this->name = name;
+	// A new spreadsheet has never been saved
+	this->hasChanged = true;
+	this->version = 0;
+	this->epoch = newEpoch();
+	this->deltaHead = 0;
 }
 
 spreadsheet::spreadsheet(const spreadsheet &sheet)
 {
 	this->name = sheet.name;
 	this->edits = sheet.edits;
+	this->ownerEdits = sheet.ownerEdits;
 	this->cells = sheet.cells;
 	this->dependents = sheet.dependents;
 	this->dependees = sheet.dependees;
+	this->rangeDependents = sheet.rangeDependents;
 	this->hasChanged = sheet.hasChanged;
+	this->version = sheet.version;
+	this->epoch = sheet.epoch;
+	this->deltas = sheet.deltas;
+	this->deltaHead = sheet.deltaHead;
+	this->cellIndex = sheet.cellIndex;
+	this->numbers = sheet.numbers;
+	this->recalcPending = sheet.recalcPending;
+}
+
+/*
+ * Everything but ownerEdits and the numeric columns is shared with this
+ * spreadsheet, so taking a snapshot costs the same however big the
+ * spreadsheet is. The numeric columns are left out because nothing reading
+ * a snapshot needs them.
+ */
+spreadsheet spreadsheet::snapshot() const
+{
+	spreadsheet copy;
+	copy.name = name;
+	copy.edits = edits;
+	copy.cells = cells;
+	copy.dependents = dependents;
+	copy.dependees = dependees;
+	copy.rangeDependents = rangeDependents;
+	copy.hasChanged = hasChanged;
+	copy.version = version;
+	copy.epoch = epoch;
+	copy.deltas = deltas;
+	copy.deltaHead = deltaHead;
+	copy.cellIndex = cellIndex;
+	return copy;
 }
 
 // spreadsheet::spreadsheet(std::string JSON_Data)
@@ -117,7 +308,7 @@ const std::vector<std::string> spreadsheet::getAllCellNames() const
 	std::vector<std::string> vec;
 	// Const itnerator because we say we won't modify this, so cbegin() and cend() return
 	// const begin and end values
-	for (std::unordered_map<std::string, cell>::const_iterator it = cells.cbegin(); it != cells.cend(); it++)
+	for (cow_table<cell>::const_iterator it = cells.begin(); it != cells.end(); it++)
 	{
 		// it->first returns the key...
 		vec.push_back(it->first);
@@ -126,6 +317,348 @@ const std::vector<std::string> spreadsheet::getAllCellNames() const
 	return vec;
 }
 
+/*
+ * Returns true if the cell has ever been set
+ */
+bool spreadsheet::hasCell(const std::string &cellName) const
+{
+	return cells.find(cellName) != cells.end();
+}
+
+std::size_t spreadsheet::getCellCount() const
+{
+	return cells.size();
+}
+
+/*
+ * Appends the names of the existing cells inside the range to cellNames,
+ * column by column. Only looks at the cells in the range.
+ */
+void spreadsheet::getCellNamesInRange(const cell_range &range, std::vector<std::string> &cellNames) const
+{
+	for (int col = range.first_col; col <= range.last_col; col++)
+	{
+		cellIndex.getColumnRange(col, range.first_row, range.last_row, cellNames);
+
+		// Skip straight to the next column that has any cells in it
+		int next;
+		if (!cellIndex.getNextColumn(col, next))
+			break;
+		if (next > col + 1)
+			col = next - 1;
+	}
+}
+
+/*
+ * Appends the names of up to count cells that come after the given cell
+ * in (column, row) order. An empty name starts from the first cell.
+ * The cell named by after doesn't have to exist anymore, so this can be
+ * used to walk a spreadsheet that changes between calls.
+ */
+void spreadsheet::getCellNamesAfter(const std::string &after, std::size_t count, std::vector<std::string> &cellNames) const
+{
+	if (after.empty())
+	{
+		cellIndex.getCellsAfter(NULL, count, cellNames);
+		return;
+	}
+
+	cell_key key = cellKey(after);
+	cellIndex.getCellsAfter(&key, count, cellNames);
+}
+
+/*
+ * The sum, count, min and max of the numbers in the range, typed in or
+ * worked out, the same ones formulas over the range see. Read off the
+ * numeric columns' trees without looking at every cell
+ */
+range_stats spreadsheet::getRangeStats(const cell_range &range) const
+{
+	return numbers.stats(range);
+}
+
+/*
+ * SUMPRODUCT over two ranges of the same shape, false if they aren't
+ */
+bool spreadsheet::getSumProduct(const cell_range &a, const cell_range &b, double &result) const
+{
+	return numbers.sumproduct(a, b, result);
+}
+
+/*
+ * Keeps the cell's number, if its contents are one, in the numeric
+ * columns, and leaves it for the next recalculation to work out
+ * what else changed. A formula keeps the value the cell had until then, so
+ * the recalculation can tell whether it really changed.
+ * Called whenever a cell's contents change.
+ */
+void spreadsheet::updateValue(const std::string &cellName, const std::string &contents)
+{
+	recalcPending.insert(cellName);
+
+	int col, row;
+	if (!cell_ref::parse(cellName, col, row))
+		return;
+
+	// Same test as checkContents, the whole of the contents has to parse
+	double value = 0;
+	std::size_t parse_len = 0;
+	if (!contents.empty() && contents[0] != '=')
+	{
+		try
+		{
+			value = std::stod(contents, &parse_len);
+		}
+		catch (std::exception &e)
+		{
+			parse_len = 0;
+		}
+	}
+
+	if (parse_len != 0 && parse_len == contents.size() && std::isfinite(value))
+	{
+		numbers.set(col, row, value);
+	}
+	else if (contents.empty() || contents[0] != '=')
+	{
+		numbers.erase(col, row);
+	}
+}
+
+void spreadsheet::rebuildValues()
+{
+	numbers.clear();
+	for (const auto &elem : cells)
+		updateValue(elem.first, elem.second.contents);
+}
+
+/*
+ * The value of a cell, typed in or worked out. NaN if it has none: it's
+ * empty, text, or a formula that doesn't work out or hasn't been worked
+ * out yet
+ */
+double spreadsheet::getCellValue(const std::string &cellName) const
+{
+	int col, row;
+	if (!cell_ref::parse(cellName, col, row))
+		return std::numeric_limits<double>::quiet_NaN();
+	return numbers.get(col, row);
+}
+
+/*
+ * False if the cell already had the value, no value counts the same as no
+ * value
+ */
+bool spreadsheet::setValue(const std::string &cellName, double value)
+{
+	int col, row;
+	if (!cell_ref::parse(cellName, col, row))
+		return false;
+
+	double old = numbers.get(col, row);
+	if (old == value || (std::isnan(old) && std::isnan(value)))
+		return false;
+
+	if (std::isnan(value))
+		numbers.erase(col, row);
+	else
+		numbers.set(col, row, value);
+	return true;
+}
+
+bool spreadsheet::isFormula(const std::string &cellName) const
+{
+	auto found = cells.find(cellName);
+	return found != cells.end() && !found->second.contents.empty() && found->second.contents[0] == '=';
+}
+
+/*
+ * Works out the value of every formula that changed since the last
+ * recalculation, or is downstream of a cell that did, and appends the names
+ * of the ones whose value changed to recalculated.
+ *
+ * The dirty formulas are put in levels: the first has the ones that don't
+ * depend on any other dirty formula, the next the ones that only depend on
+ * the first, and so on. The formulas in a level don't depend on each other,
+ * so a level of at least RECALC_PARALLEL_MIN of them is spread over pool,
+ * each thread reading the values the levels before wrote and keeping its
+ * results to itself. The values are written back between levels. Anything
+ * left over when the levels run out is on a cycle, and has no value.
+ *
+ * Only a formula that was edited, or that depends on a cell that was or on
+ * a formula whose value changed, is worked out. One that works out to the
+ * value it had stops the change there, everything downstream that only
+ * depends on it through that formula is skipped.
+ */
+void spreadsheet::recalculate(work_pool *pool, std::vector<std::string> &recalculated)
+{
+	if (recalcPending.empty())
+		return;
+
+	metric_timer timer(metrics::recalc_time);
+
+	// The changed cells and every formula downstream of them, only the
+	// formulas among them need working out
+	std::unordered_set<std::string> changed;
+	changed.swap(recalcPending);
+	std::vector<std::string> dirty;
+	std::vector<std::vector<std::string>> dirtyDependents;
+	std::unordered_map<std::string, std::size_t> dirtyIndex;
+	std::vector<std::string> toVisit(changed.begin(), changed.end());
+	std::unordered_set<std::string> seen(changed.begin(), changed.end());
+	// Formulas that depend straight on a changed cell
+	std::unordered_set<std::string> touched;
+
+	std::vector<std::string> found;
+	while (!toVisit.empty())
+	{
+		std::string cellName = toVisit.back();
+		toVisit.pop_back();
+
+		found.clear();
+		getDependents(cellName, found);
+		bool wasChanged = changed.count(cellName) > 0;
+		for (const auto &dependent : found)
+		{
+			// Something that isn't a formula doesn't change with what it
+			// claims to depend on
+			if (!isFormula(dependent))
+				continue;
+			if (wasChanged)
+				touched.insert(dependent);
+			if (seen.insert(dependent).second)
+				toVisit.push_back(dependent);
+		}
+
+		if (isFormula(cellName))
+		{
+			dirtyIndex[cellName] = dirty.size();
+			dirty.push_back(cellName);
+			dirtyDependents.push_back(found);
+		}
+	}
+
+	// The edges between dirty formulas, how many each one waits on, and
+	// whether it has to be worked out once they're done
+	std::vector<std::vector<std::size_t>> downstream(dirty.size());
+	std::vector<std::size_t> waiting(dirty.size(), 0);
+	std::vector<char> stale(dirty.size(), 0);
+	for (std::size_t i = 0; i < dirty.size(); i++)
+	{
+		stale[i] = changed.count(dirty[i]) > 0 || touched.count(dirty[i]) > 0;
+		for (const auto &dependent : dirtyDependents[i])
+		{
+			auto it = dirtyIndex.find(dependent);
+			if (it != dirtyIndex.end())
+			{
+				downstream[i].push_back(it->second);
+				waiting[it->second]++;
+			}
+		}
+	}
+	dirtyDependents.clear();
+	touched.clear();
+
+	std::vector<std::size_t> level;
+	for (std::size_t i = 0; i < dirty.size(); i++)
+	{
+		if (waiting[i] == 0)
+			level.push_back(i);
+	}
+
+	std::size_t levels = 0;
+	std::size_t evaluated = 0;
+	std::size_t unchanged = 0;
+	std::vector<std::size_t> evaluating;
+	std::vector<const std::string *> contents;
+	std::vector<double> results;
+	std::vector<std::size_t> next;
+	while (!level.empty())
+	{
+		evaluating.clear();
+		contents.clear();
+		for (std::size_t i : level)
+		{
+			if (stale[i])
+			{
+				evaluating.push_back(i);
+				contents.push_back(&cells.find(dirty[i])->second.contents);
+			}
+		}
+		results.assign(evaluating.size(), 0);
+
+		std::function<void(std::size_t)> evaluate = [&](std::size_t i) {
+			results[i] = formula::evaluate(*contents[i], numbers);
+		};
+		if (pool != NULL && evaluating.size() >= RECALC_PARALLEL_MIN)
+		{
+			pool->run(evaluating.size(), RECALC_GRAIN, evaluate);
+			metrics::recalc_parallel_levels.add();
+		}
+		else
+		{
+			for (std::size_t i = 0; i < evaluating.size(); i++)
+				evaluate(i);
+		}
+		evaluated += evaluating.size();
+
+		for (std::size_t i = 0; i < evaluating.size(); i++)
+		{
+			const std::string &cellName = dirty[evaluating[i]];
+			if (!setValue(cellName, results[i]))
+			{
+				unchanged++;
+				// Its contents changed, so whoever shows them wants the
+				// value even if it's the one the cell had before
+				if (changed.count(cellName) > 0)
+					recalculated.push_back(cellName);
+				continue;
+			}
+			recalculated.push_back(cellName);
+			for (std::size_t dependent : downstream[evaluating[i]])
+				stale[dependent] = 1;
+		}
+
+		next.clear();
+		for (std::size_t i : level)
+		{
+			for (std::size_t dependent : downstream[i])
+			{
+				if (--waiting[dependent] == 0)
+					next.push_back(dependent);
+			}
+		}
+
+		level.swap(next);
+		levels++;
+	}
+
+	for (std::size_t i = 0; i < dirty.size(); i++)
+	{
+		if (waiting[i] > 0 && setValue(dirty[i], std::numeric_limits<double>::quiet_NaN()))
+			recalculated.push_back(dirty[i]);
+	}
+
+	metrics::recalc_formulas.record(evaluated);
+	metrics::recalc_unchanged.record(unchanged);
+	metrics::recalc_pruned.record(dirty.size() - evaluated);
+	metrics::recalc_levels.record(levels);
+}
+
+/*
+ * The cell's place in the coordinate index. Cells whose names aren't
+ * a column and a row sort before every other cell and are never part
+ * of a range.
+ */
+cell_key spreadsheet::cellKey(const std::string &cellName)
+{
+	int col, row;
+	if (!cell_ref::parse(cellName, col, row))
+		return cell_key(-1, 0, cellName);
+
+	return cell_key(col, row, cellName);
+}
+
 /*
  * Returns the spreadsheet name as a string
  */
@@ -134,21 +667,254 @@ const std::string spreadsheet::getName() const
 	return name;
 }
 
+/*
+ * Replaces every cell with the loaded ones, for opening a saved spreadsheet.
+ * The cells aren't checked one at a time like setCellContents does, the
+ * cell table and dependency graph are built directly and then checked for
+ * cycles once. Loaded cells have no history to undo or revert.
+ * Returns false, leaving the spreadsheet empty, if there is a cycle.
+ */
+bool spreadsheet::bulkLoad(const std::vector<cell_data> &loaded)
+{
+	cells.clear();
+	dependents.clear();
+	dependees.clear();
+	rangeDependents.clear();
+	cellIndex.clear();
+	numbers.clear();
+
+	// Files saved before ranges were kept whole list every cell in them
+	for (const auto &data : loaded)
+	{
+		std::vector<cell_range> ranges = formulaRanges(data.contents);
+		cell &loadedCell = cells[data.cellName];
+		loadedCell = cell(data.contents, uncoveredDependencies(data.dependencies, ranges), data.cellName);
+		loadedCell.ranges = ranges;
+	}
+
+	for (const auto &elem : cells)
+	{
+		cellIndex.insert(cellKey(elem.first));
+		for (const auto &dep : elem.second.dependencies)
+			addDependency(dep, elem.first);
+		for (const auto &range : elem.second.ranges)
+			rangeDependents.add(elem.first, range);
+	}
+
+	bool cyclic;
+	{
+		metric_timer timer(metrics::cycle_check_time);
+		cyclic = hasCycle();
+	}
+
+	if (cyclic)
+	{
+		cells.clear();
+		dependents.clear();
+		dependees.clear();
+		rangeDependents.clear();
+		cellIndex.clear();
+		return false;
+	}
+
+	rebuildValues();
+	return true;
+}
+
+/*
+ * Looks for a cycle anywhere in the dependency graph with one depth first
+ * walk over every edge, without recursing. Every cell in a cycle depends
+ * on something, so starting from every cell finds them all.
+ */
+bool spreadsheet::hasCycle() const
+{
+	typedef std::unordered_set<std::string>::const_iterator edge_iterator;
+	static const std::unordered_set<std::string> noEdges;
+
+	// Cells on the path being walked are in progress, cells whose
+	// dependents have all been walked are done
+	enum
+	{
+		IN_PROGRESS = 1,
+		DONE = 2
+	};
+	std::unordered_map<std::string, int> state;
+	state.reserve(cells.size());
+
+	// A cell on the path and the rest of its dependents still to look at,
+	// the ones in dependents and then the ones with a range covering it
+	struct step
+	{
+		int *state;
+		edge_iterator next;
+		edge_iterator end;
+		std::vector<std::string> ranged;
+		std::size_t nextRanged;
+	};
+	std::vector<step> path;
+
+	auto visit = [&](const std::string &cellName, int &cellState) {
+		cellState = IN_PROGRESS;
+		auto direct = dependents.find(cellName);
+		const std::unordered_set<std::string> &edges = direct == dependents.end() ? noEdges : direct->second;
+		path.push_back(step{&cellState, edges.begin(), edges.end(), std::vector<std::string>(), 0});
+
+		int col, row;
+		if (cell_ref::parse(cellName, col, row))
+			rangeDependents.find(col, row, path.back().ranged);
+	};
+
+	for (const auto &root : cells)
+	{
+		int &rootState = state[root.first];
+		if (rootState != 0)
+			continue;
+		visit(root.first, rootState);
+
+		while (!path.empty())
+		{
+			step &top = path.back();
+			const std::string *next;
+			if (top.next != top.end)
+				next = &*top.next++;
+			else if (top.nextRanged < top.ranged.size())
+				next = &top.ranged[top.nextRanged++];
+			else
+			{
+				*top.state = DONE;
+				path.pop_back();
+				continue;
+			}
+
+			int &nextState = state[*next];
+			if (nextState == IN_PROGRESS)
+				return true;
+			if (nextState == 0)
+				visit(std::string(*next), nextState);
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Appends the cells that depend on the cell directly, on their own or
+ * through a range
+ */
+void spreadsheet::getDependents(const std::string &cellName, std::vector<std::string> &found) const
+{
+	auto direct = dependents.find(cellName);
+	if (direct != dependents.end())
+		found.insert(found.end(), direct->second.begin(), direct->second.end());
+
+	int col, row;
+	if (cell_ref::parse(cellName, col, row))
+		rangeDependents.find(col, row, found);
+}
+
+bool spreadsheet::hasDependents(const std::string &cellName) const
+{
+	if (dependents.find(cellName) != dependents.end())
+		return true;
+
+	int col, row;
+	return cell_ref::parse(cellName, col, row) && rangeDependents.covers(col, row);
+}
+
+/*
+ * Replaces the ranges the cell's formula refers to
+ */
+void spreadsheet::setRanges(const std::string &cellName, const std::vector<cell_range> &ranges)
+{
+	// Most cells have none before or after, don't copy their chunk
+	if (ranges.empty() && cells.at(cellName).ranges.empty())
+		return;
+
+	cell &current = cells[cellName];
+	for (const auto &range : current.ranges)
+		rangeDependents.remove(cellName, range);
+
+	current.ranges = ranges;
+	for (const auto &range : current.ranges)
+		rangeDependents.add(cellName, range);
+}
+
+/*
+ * The ranges of more than one cell the contents refer to
+ */
+std::vector<cell_range> spreadsheet::formulaRanges(const std::string &contents)
+{
+	std::vector<std::string> singles;
+	std::vector<cell_range> ranges;
+	cell_ref::references(contents, singles, ranges);
+	return ranges;
+}
+
+/*
+ * The dependencies that aren't in any of the ranges. Clients list every
+ * cell of a range as a dependency, the range covers those.
+ */
+std::vector<std::string> spreadsheet::uncoveredDependencies(const std::vector<std::string> &dependencies,
+															const std::vector<cell_range> &ranges)
+{
+	if (ranges.empty())
+		return dependencies;
+
+	std::vector<std::string> uncovered;
+	for (const auto &dep : dependencies)
+	{
+		int col, row;
+		bool covered = false;
+		if (cell_ref::parse(dep, col, row))
+		{
+			for (const auto &range : ranges)
+				covered = covered || range.contains(col, row);
+		}
+
+		if (!covered)
+			uncovered.push_back(dep);
+	}
+	return uncovered;
+}
+
 /*
  * Set a specific cells contents and dependencies.
+ * owner is who is making the edit, it's who can undo it with a per user undo.
  * 
  * If the cell cannot be added, the invalid cell name is returned.
  * Else null
  */
 bool spreadsheet::setCellContents(const std::string &cellName, const std::string &contents,
-								  std::vector<std::string> const &dependencies)
+								  std::vector<std::string> const &dependencies, const std::string &owner)
 {
+	if (!applyCellContents(cellName, contents, dependencies, owner))
+		return false;
+
+	recordChange(cellName);
+	return true;
+}
+
+/*
+ * Sets a cell like setCellContents, without making a new version.
+ * Range operations set many cells this way, then make one version.
+ */
+bool spreadsheet::applyCellContents(const std::string &cellName, const std::string &contents,
+									std::vector<std::string> const &allDependencies, const std::string &owner)
+{
+	std::vector<cell_range> ranges = formulaRanges(contents);
+	std::vector<std::string> dependencies = uncoveredDependencies(allDependencies, ranges);
+
 	// Check if the cell exists, if it doesn't, add it, if it does,
 	//  push the current cell onto the history stack,
 	//  change the contents, dependencies, check if it's a formula and change that
 
 	/* circ dep and valid cell checking */
-	if (!cellIsValid(cellName, contents, dependencies))
+	bool valid;
+	{
+		metric_timer timer(metrics::cycle_check_time);
+		valid = cellIsValid(cellName, contents, dependencies, ranges);
+	}
+	if (!valid)
 	{
 		return false;
 	}
@@ -165,8 +931,9 @@ bool spreadsheet::setCellContents(const std::string &cellName, const std::string
 		old_data.cellName = cellName;
 		old_data.contents = old_cell.contents;
 		old_data.dependencies = old_cell.dependencies;
+		old_data.owner = owner;
 
-		edits.push(old_data); // Push old cell data onto spreadsheet history stack
+		logEdit(old_data); // Push old cell data onto spreadsheet edit log
 
 		cells[cellName].history.push(old_data); // Push old cell contents and dependencies onto stack
 		// ENDCHANGE
@@ -183,13 +950,15 @@ bool spreadsheet::setCellContents(const std::string &cellName, const std::string
 		empty_data.cellName = cellName;
 		empty_data.contents = "";
 		empty_data.dependencies = std::vector<std::string>();
-
-		edits.push(empty_data); // Push an empty cell onto the edits, so that we know the cell was
+		empty_data.owner = owner;
 
 		cell new_cell = cell(contents, dependencies, cellName);
 		new_cell.history.push(empty_data);
 
 		cells[cellName] = new_cell;
+		cellIndex.insert(cellKey(cellName));
+
+		logEdit(empty_data); // Push an empty cell onto the edits, so that we know the cell was
 	}
 
 	/* remove old deps (if any) */
@@ -209,10 +978,30 @@ bool spreadsheet::setCellContents(const std::string &cellName, const std::string
 		addDependency(dependencies[i], cellName);
 	}
 
+	setRanges(cellName, ranges);
+	updateValue(cellName, contents);
 	hasChanged = true;
 	return true;
 }
 
+/*
+ * Appends an edit to the edit log and indexes it under its owner.
+ * The cell must exist, it remembers the edit as the one that set it.
+ */
+void spreadsheet::logEdit(const cell_data &before)
+{
+	cell &edited = cells[before.cellName];
+
+	edit_entry entry;
+	entry.before = before;
+	entry.previous = edited.lastEdit;
+	entry.undone = false;
+
+	edited.lastEdit = edits.size();
+	ownerEdits[before.owner].push_back(edits.size());
+	edits.push_back(entry);
+}
+
 /*
  * Saves the spreadsheet
  */
@@ -226,8 +1015,7 @@ void spreadsheet::saveSpreadsheet()
 	myfile.open(path.c_str());
 
 	std::string saved;
-	spreadsheet s = *this;
-	saved = JSON_message::save_spreadsheet(s);
+	saved = JSON_message::save_spreadsheet(*this);
 	myfile << saved;
 
 	myfile.close();
@@ -264,7 +1052,11 @@ void spreadsheet::removeCell(const std::string &cellName)
 	{
 	}
 
+	if (hasCell(cellName))
+		setRanges(cellName, std::vector<cell_range>());
 	cells.erase(cellName);
+	cellIndex.erase(cellKey(cellName));
+	updateValue(cellName, "");
 }
 
 /*
@@ -276,7 +1068,8 @@ void spreadsheet::removeCell(const std::string &cellName)
  * 	- if the contents are a formula, it must not cause a circular dependancy
  * 		either directly or indirectly
  */
-const bool spreadsheet::cellIsValid(const std::string &cellName, const std::string &contents, const std::vector<std::string> &deps) const
+const bool spreadsheet::cellIsValid(const std::string &cellName, const std::string &contents, const std::vector<std::string> &deps,
+									const std::vector<cell_range> &ranges) const
 {
 	int ret = checkContents(cellName, contents);
 
@@ -285,15 +1078,27 @@ const bool spreadsheet::cellIsValid(const std::string &cellName, const std::stri
 		return false;
 	}
 
-	for (unsigned int i = 0; i < deps.size(); i++)
+	// The sheet has no cycles now, so only dependencies and ranges the
+	// cell doesn't have yet can make one
+	std::unordered_set<std::string> addedDeps(deps.begin(), deps.end());
+	std::vector<cell_range> addedRanges = ranges;
+	auto existing = cells.find(cellName);
+	if (existing != cells.end())
 	{
-		std::unordered_set<std::string> visited;
-		ret = checkCircDeps(deps[i], cellName, &visited);
+		for (const auto &dep : existing->second.dependencies)
+			addedDeps.erase(dep);
+
+		const std::vector<cell_range> &oldRanges = existing->second.ranges;
+		addedRanges.erase(std::remove_if(addedRanges.begin(), addedRanges.end(),
+										 [&](const cell_range &range) {
+											 return std::find(oldRanges.begin(), oldRanges.end(), range) != oldRanges.end();
+										 }),
+						  addedRanges.end());
+	}
 
-		if (ret < 0)
-		{
-			return false;
-		}
+	if ((!addedDeps.empty() || !addedRanges.empty()) && checkCircDeps(cellName, addedDeps, addedRanges) < 0)
+	{
+		return false;
 	}
 
 	return true;
@@ -307,7 +1112,7 @@ const int spreadsheet::checkContents(const std::string &cellName, const std::str
 {
 	// Check too see if given cell is part of another cell's formula
 	// (meaning it is a dependent of another cell)
-	if (dependents.find(cellName) != dependents.end())
+	if (hasDependents(cellName))
 	{
 		//Check to see if the contents are a formula
 		if (contents[0] != '=')
@@ -334,121 +1139,79 @@ const int spreadsheet::checkContents(const std::string &cellName, const std::str
 	return 0;
 }
 
-/* This function is recursive and it will visit every 
- * cell associated with the given cell and return 
- * CIRCULAR_DEPENDENCY if such a dependency is ever found
+/* Visits every cell that depends on the given cell, directly, through
+ * other cells or through a range, and returns CIRCULAR_DEPENDENCY if one
+ * of them is in deps or inside one of ranges, the cell would then depend
+ * on itself. The cell itself is visited too. The walk keeps its own stack,
+ * a long chain of formulas would overflow the call stack
  */
-const int spreadsheet::checkCircDeps(const std::string &start, const std::string &cellName, std::unordered_set<std::string> *visited) const
+const int spreadsheet::checkCircDeps(const std::string &cellName, const std::unordered_set<std::string> &deps,
+									 const std::vector<cell_range> &ranges) const
 {
-	//std::unordered_set<std::string> directDependents = *(dependents.find(cellName));
-	std::unordered_set<std::string> directDependents;
+	std::unordered_set<std::string> visited;
+	std::vector<std::string> pending;
+	std::vector<std::string> next;
+	visited.insert(cellName);
+	pending.push_back(cellName);
 
-	if (dependents.find(cellName) != dependents.end())
-	{
-		directDependents = dependents.at(cellName);
-	}
-	else
+	while (!pending.empty())
 	{
-		return 0;
-	}
-
-	std::string curCell = cellName;
-	visited->insert(curCell);
+		std::string current = pending.back();
+		pending.pop_back();
 
-	for (auto it = directDependents.begin(); it != directDependents.end(); ++it)
-	{
-		if (*it == start)
+		if (deps.find(current) != deps.end())
 		{
 			return CIRCULAR_DEPENDENCY;
 		}
-		else if (visited->find(*it) != visited->end())
+
+		int col, row;
+		if (!ranges.empty() && cell_ref::parse(current, col, row))
+		{
+			for (const auto &range : ranges)
+			{
+				if (range.contains(col, row))
+					return CIRCULAR_DEPENDENCY;
+			}
+		}
+
+		next.clear();
+		getDependents(current, next);
+		for (const auto &dependent : next)
 		{
-			checkCircDeps(start, *it, visited);
+			if (visited.insert(dependent).second)
+				pending.push_back(dependent);
 		}
 	}
 
 	return 0;
 }
 
+/*
+ * Records that t depends on s. Both sets are changed in place, copying
+ * them made every edge cost as much as the cell's whole fan in or fan out.
+ */
 void spreadsheet::addDependency(std::string s, std::string t)
 {
-	std::unordered_set<std::string> dependent_list;
-	std::unordered_set<std::string> dependee_list;
-
-	if (dependents.find(s) != dependents.end())
-	{
-		dependent_list = dependents.at(s);
-
-		if (dependent_list.find(t) == dependent_list.end())
-		{
-			dependent_list.insert(t);
-		}
-		dependents[s] = dependent_list;
-	}
-	else
-	{
-		dependent_list.insert(t);
-		dependents[s] = dependent_list;
-	}
-
-	if (dependees.find(t) != dependees.end())
-	{
-		dependee_list = dependees.at(t);
-
-		if (dependee_list.find(s) == dependee_list.end())
-		{
-			dependee_list.insert(s);
-		}
-		dependees[t] = dependee_list;
-	}
-	else
-	{
-		dependee_list.insert(s);
-		dependees[t] = dependee_list;
-	}
+	dependents[s].insert(t);
+	dependees[t].insert(s);
 }
 
 void spreadsheet::removeDependency(std::string s, std::string t)
 {
-	std::unordered_set<std::string> dependent_list;
-	std::unordered_set<std::string> dependee_list;
-
-	if (dependents.find(s) != dependents.end())
+	std::unordered_set<std::string> *dependent_list = dependents.writable(s);
+	if (dependent_list != NULL)
 	{
-		dependent_list = dependents.at(s);
-
-		if (dependent_list.find(t) != dependent_list.end())
-		{
-			dependent_list.erase(t);
-		}
-
-		if (dependent_list.size() > 0)
-		{
-			dependents[s] = dependent_list;
-		}
-		else
-		{
+		dependent_list->erase(t);
+		if (dependent_list->empty())
 			dependents.erase(s);
-		}
 	}
 
-	if (dependees.find(t) != dependees.end())
+	std::unordered_set<std::string> *dependee_list = dependees.writable(t);
+	if (dependee_list != NULL)
 	{
-		dependee_list = dependees.at(t);
-
-		if (dependee_list.find(s) != dependee_list.end())
-		{
-			dependee_list.erase(s);
-		}
-
-		if (dependee_list.size() > 0)
-		{
-			dependees[t] = dependee_list;
-		}
-		else
-		{
+		dependee_list->erase(s);
+		if (dependee_list->empty())
 			dependees.erase(t);
-		}
 	}
 }
 
@@ -460,7 +1223,7 @@ void spreadsheet::removeDependency(std::string s, std::string t)
  * If reverting the cell causes a circular dependency, nothing is changed and 
  * false is returned.
  */
-bool spreadsheet::revertCell(const std::string &cellName)
+bool spreadsheet::revertCell(const std::string &cellName, const std::string &owner)
 {
 	if (cells.find(cellName) == cells.end()) // The cell currently has no contents
 		return true;
@@ -470,6 +1233,10 @@ bool spreadsheet::revertCell(const std::string &cellName)
 	{
 		cells[cellName].contents = "";
 		cells[cellName].dependencies = std::vector<std::string>();
+		setRanges(cellName, std::vector<cell_range>());
+		updateValue(cellName, "");
+		hasChanged = true;
+		recordChange(cellName);
 		return true;
 	}
 	// If the cell has a history
@@ -477,7 +1244,7 @@ bool spreadsheet::revertCell(const std::string &cellName)
 	{
 		// CHANGED
 		cell_data old_data = cells[cellName].history.top();
-		if (setCellContents(cellName, old_data.contents, old_data.dependencies))
+		if (setCellContents(cellName, old_data.contents, old_data.dependencies, owner))
 		{
 			cells[cellName].history.pop(); // Pop off the old value
 			cells[cellName].history.pop(); // Pop off the cell that setCellContents added
@@ -487,53 +1254,121 @@ bool spreadsheet::revertCell(const std::string &cellName)
 	}
 }
 
+/*
+ * Puts a cell back the way it was before the edit in entry.
+ * The caller has checked that the old contents are valid.
+ */
+void spreadsheet::restoreCell(const edit_entry &entry)
+{
+	const cell_data &old_data = entry.before;
+
+	// Changed in place, copying the cell would copy its whole history
+	cell &current_cell = cells[old_data.cellName];
+	for (auto const &dep : current_cell.dependencies)
+	{
+		removeDependency(dep, old_data.cellName);
+	}
+
+	//change the top of the cell to the old cell
+	current_cell.contents = old_data.contents;
+	current_cell.dependencies = old_data.dependencies;
+	if (!current_cell.history.empty())
+		current_cell.history.pop(); // Fairly certain this is the only way
+	current_cell.lastEdit = entry.previous;
+
+	//add the new dependencies
+	for (auto const &dep : current_cell.dependencies)
+	{
+		addDependency(dep, old_data.cellName);
+	}
+	setRanges(old_data.cellName, formulaRanges(old_data.contents));
+	updateValue(old_data.cellName, old_data.contents);
+	hasChanged = true;
+	recordChange(old_data.cellName);
+}
+
 /**
  * Undo a cell
  * Returns UNDO_SUCCESS for a successful undo
  * returns UNDO_FAIL for a failed undo
  * returns UNDO_EMPTY if undo was called on an empty spreadsheet
+ * Either way cellName is set to the cell the undo applied to.
  **/
 UNDO_STATUS spreadsheet::undo(std::string &cellName)
 {
+	// Edits their owners already undid were undone out of order, skip them
+	while (!edits.empty() && edits.back().undone)
+		edits.pop_back();
+
 	//gets the previous spreadsheet cell
 	if (edits.empty())
 		return UNDO_EMPTY;
 
-	// ALMOST ALL OF THIS CHANGED slightly
-	cell_data old_data = edits.top();
+	const edit_entry &entry = edits.back();
+	cellName = entry.before.cellName;
 
 	//check if old cell does not return circular dependencies
-	if (cellIsValid(old_data.cellName, old_data.contents, old_data.dependencies))
-	{
-		cell current_cell = cells[old_data.cellName];
-		for (auto const &dep : current_cell.dependencies)
-		{
-			removeDependency(dep, current_cell.cellName);
-		}
+	if (!cellIsValid(entry.before.cellName, entry.before.contents, entry.before.dependencies, formulaRanges(entry.before.contents)))
+		return UNDO_FAIL;
 
-		//change the top of the cell to the old cell
-		// CHANGED
-		current_cell.contents = old_data.contents;
-		current_cell.dependencies = old_data.dependencies;
-		if (!current_cell.history.empty())
-			current_cell.history.pop(); // Fairly certain this is the only way
-		cells[old_data.cellName] = current_cell;
+	restoreCell(entry);
+
+	// The newest edit is also its owner's newest
+	std::vector<std::size_t> &owned = ownerEdits[entry.before.owner];
+	owned.pop_back();
+	if (owned.empty())
+		ownerEdits.erase(entry.before.owner);
+
+	// Pop off the edit we just applied
+	edits.pop_back();
+	return UNDO_SUCCESS;
+}
+
+/**
+ * Undo the newest edit the owner made that nobody has edited over since.
+ * Edits of the owner's that somebody else has since replaced are dropped
+ * on the way, undoing them would throw away the other person's edit.
+ * Returns the same as undo(cellName), UNDO_EMPTY when the owner has
+ * nothing left to undo.
+ **/
+UNDO_STATUS spreadsheet::undo(const std::string &owner, std::string &cellName)
+{
+	auto owned = ownerEdits.find(owner);
+	if (owned == ownerEdits.end())
+		return UNDO_EMPTY;
 
-		// Pop off the edit we just applied
-		edits.pop();
+	UNDO_STATUS status = UNDO_EMPTY;
+	while (!owned->second.empty())
+	{
+		std::size_t position = owned->second.back();
+		edit_entry &entry = edits.writable(position);
 
-		//add the new dependencies
-		for (auto const &dep : current_cell.dependencies)
+		auto current = cells.find(entry.before.cellName);
+		if (current != cells.end() && current->second.lastEdit == position)
 		{
-			addDependency(dep, current_cell.cellName);
+			cellName = entry.before.cellName;
+			if (!cellIsValid(entry.before.cellName, entry.before.contents, entry.before.dependencies, formulaRanges(entry.before.contents)))
+				return UNDO_FAIL;
+
+			restoreCell(entry);
+			status = UNDO_SUCCESS;
 		}
-		hasChanged = true;
-		return UNDO_SUCCESS;
+
+		entry.undone = true;
+		owned->second.pop_back();
+
+		if (status == UNDO_SUCCESS)
+			break;
 	}
 
-	//could not undo
-	cellName = old_data.cellName;
-	return UNDO_FAIL;
+	if (owned->second.empty())
+		ownerEdits.erase(owned);
+
+	// Nothing newer is waiting to be undone, so the log can shrink
+	while (!edits.empty() && edits.back().undone)
+		edits.pop_back();
+
+	return status;
 }
 
 /**
@@ -544,6 +1379,15 @@ bool spreadsheet::getSaveStatus()
 	return this->hasChanged;
 }
 
+/**
+ * Marks the spreadsheet as saved, for when a snapshot of it is saved
+ * instead
+ **/
+void spreadsheet::setSaved()
+{
+	this->hasChanged = false;
+}
+
 void spreadsheet::setName(std::string name)
 {
 	this->name = name;
@@ -575,7 +1419,7 @@ std::stack<cell_data> spreadsheet::get_cell_history(std::string &cellName)
 
 	if (cells.find(cellName) != cells.end())
 	{
-		return cells.at(cellName).history;
+		return cells.at(cellName).history.toStack();
 	}
 
 	return empty;
@@ -583,10 +1427,402 @@ std::stack<cell_data> spreadsheet::get_cell_history(std::string &cellName)
 
 std::stack<cell_data> spreadsheet::get_edits()
 {
-	return edits;
+	std::stack<cell_data> live;
+	for (const auto &entry : edits)
+	{
+		if (!entry.undone)
+			live.push(entry.before);
+	}
+	return live;
+}
+
+/*
+ * Returns the current version of the spreadsheet. Every change
+ * to a cell makes a new version.
+ */
+unsigned long spreadsheet::getVersion() const
+{
+	return version;
+}
+
+unsigned long spreadsheet::getEpoch() const
+{
+	return epoch;
+}
+
+/*
+ * Sets the version (e.g. the one it was saved at) and forgets
+ * the recent changes, since they belonged to the old numbering.
+ */
+void spreadsheet::setVersion(unsigned long version)
+{
+	this->version = version;
+	this->deltas.clear();
+	this->deltaHead = 0;
+}
+
+/*
+ * Bumps the version and remembers which cell the change touched.
+ * deltas holds at most DELTA_HISTORY changes, the oldest gets overwritten.
+ */
+void spreadsheet::recordChange(const std::string &cellName)
+{
+	recordChanges(std::vector<std::string>(1, cellName));
+}
+
+/*
+ * Bumps the version once for a change that touched all of the cells
+ */
+void spreadsheet::recordChanges(const std::vector<std::string> &cellNames)
+{
+	sheet_delta delta;
+	delta.version = ++version;
+	delta.cells = cellNames;
+
+	if (deltas.size() < DELTA_HISTORY)
+	{
+		deltas.push_back(delta);
+	}
+	else
+	{
+		deltas.writable(deltaHead) = delta;
+		deltaHead = (deltaHead + 1) % DELTA_HISTORY;
+	}
+}
+
+/*
+ * Puts the names of every cell changed after the given version in cellNames,
+ * each name once.
+ * Returns false if the changes aren't all remembered anymore (or the version
+ * is newer than this spreadsheet, or from another epoch), in which case the
+ * whole sheet has to be sent.
+ */
+bool spreadsheet::getChangedCellsSince(unsigned long epoch, unsigned long version, std::vector<std::string> &cellNames) const
+{
+	if (epoch != this->epoch || version > this->version)
+		return false;
+
+	if (version == this->version)
+		return true;
+
+	// deltaHead is the oldest change once the ring is full, otherwise it's 0
+	if (deltas.empty() || deltas[deltaHead].version > version + 1)
+		return false;
+
+	std::unordered_set<std::string> seen;
+	for (unsigned int i = 0; i < deltas.size(); i++)
+	{
+		const sheet_delta &delta = deltas[(deltaHead + i) % deltas.size()];
+		if (delta.version <= version)
+			continue;
+
+		for (const auto &cellName : delta.cells)
+		{
+			if (seen.insert(cellName).second)
+				cellNames.push_back(cellName);
+		}
+	}
+
+	return true;
 }
 
 // std::vector<std::string> spreadsheet::get_cell_history(std::string cellName)
 // {
 // 	return std::vector<std::string>();
-// }
\ No newline at end of file
+// }
+
+/*
+ * Copies the source cell into every cell of target. Relative references
+ * move with the cell they are copied to, $ references stay put, and each
+ * copy depends on the cells its own formula refers to. Cells whose copy
+ * isn't valid (e.g. it would be circular) keep their contents.
+ */
+range_change spreadsheet::fillRange(const std::string &source, const cell_range &target, const std::string &owner)
+{
+	range_change change;
+
+	int sourceCol, sourceRow;
+	if (!cell_ref::parse(source, sourceCol, sourceRow))
+		return change;
+
+	auto sourceCell = cells.find(source);
+	std::string contents = sourceCell == cells.end() ? "" : sourceCell->second.contents;
+
+	for (int col = target.first_col; col <= target.last_col; col++)
+	{
+		for (int row = target.first_row; row <= target.last_row; row++)
+		{
+			if (col == sourceCol && row == sourceRow)
+				continue;
+
+			int colOffset = col - sourceCol;
+			int rowOffset = row - sourceRow;
+			std::string filled = cell_ref::rewrite_references(contents, [colOffset, rowOffset](int &c, int &r, bool absCol, bool absRow) {
+				if (!absCol)
+					c += colOffset;
+				if (!absRow)
+					r += rowOffset;
+				return true;
+			});
+
+			std::vector<std::string> dependencies;
+			std::vector<cell_range> ranges;
+			cell_ref::references(filled, dependencies, ranges);
+
+			std::string cellName = cell_ref::name(col, row);
+			if (applyCellContents(cellName, filled, dependencies, owner))
+				change.changed.push_back(cellName);
+			else
+				change.rejected.push_back(cellName);
+		}
+	}
+
+	if (!change.changed.empty())
+		recordChanges(change.changed);
+	return change;
+}
+
+/*
+ * Empties every cell in target. Cells other cells depend on can't be
+ * emptied and keep their contents.
+ */
+range_change spreadsheet::clearRange(const cell_range &target, const std::string &owner)
+{
+	range_change change;
+
+	std::vector<std::string> cellNames;
+	getCellNamesInRange(target, cellNames);
+
+	for (const auto &cellName : cellNames)
+	{
+		const cell &current = cells.at(cellName);
+		if (current.contents.empty() && current.dependencies.empty())
+			continue;
+
+		if (applyCellContents(cellName, "", std::vector<std::string>(), owner))
+			change.changed.push_back(cellName);
+		else
+			change.rejected.push_back(cellName);
+	}
+
+	if (!change.changed.empty())
+		recordChanges(change.changed);
+	return change;
+}
+
+/*
+ * Inserts count empty rows before row, every cell from row down moves
+ * down and every reference to it follows.
+ */
+range_change spreadsheet::insertRows(int row, int count)
+{
+	range_change change;
+	remapCells([row, count](int &c, int &r, bool absCol, bool absRow) {
+		if (r >= row)
+			r += count;
+		return true;
+	},
+			   change);
+	return change;
+}
+
+/*
+ * Deletes count rows starting at row, the cells below move up. References
+ * to the deleted cells become #REF! A range loses the deleted rows and
+ * only becomes #REF! if every one of its rows is deleted.
+ */
+range_change spreadsheet::deleteRows(int row, int count)
+{
+	int last = row + count - 1;
+	// A deleted row at either end of a range moves that end to the nearest
+	// row that's left
+	range_mapper shrink = [row, last, count](cell_range &range) {
+		if (range.first_row >= row && range.last_row <= last)
+			return false;
+
+		if (range.first_row > last)
+			range.first_row -= count;
+		else if (range.first_row >= row)
+			range.first_row = row;
+		if (range.last_row > last)
+			range.last_row -= count;
+		else if (range.last_row >= row)
+			range.last_row = row - 1;
+		return true;
+	};
+
+	range_change change;
+	remapCells([row, count](int &c, int &r, bool absCol, bool absRow) {
+		if (r >= row + count)
+			r -= count;
+		else if (r >= row)
+			return false;
+		return true;
+	},
+			   change, shrink);
+	return change;
+}
+
+/*
+ * Moves the cells in source so its top left corner is at (col, row).
+ * References to the moved cells follow them, cells they land on are
+ * replaced and references to those become #REF!
+ */
+range_change spreadsheet::moveRange(const cell_range &source, int col, int row)
+{
+	int colOffset = col - source.first_col;
+	int rowOffset = row - source.first_row;
+
+	cell_range target;
+	target.first_col = source.first_col + colOffset;
+	target.last_col = source.last_col + colOffset;
+	target.first_row = source.first_row + rowOffset;
+	target.last_row = source.last_row + rowOffset;
+
+	range_change change;
+	remapCells([source, target, colOffset, rowOffset](int &c, int &r, bool absCol, bool absRow) {
+		if (source.contains(c, r))
+		{
+			c += colOffset;
+			r += rowOffset;
+			return true;
+		}
+		return !target.contains(c, r);
+	},
+			   change);
+	return change;
+}
+
+/*
+ * Moves cells around in one pass: every cell, formula, dependency and
+ * history entry is run through the mapper, then the dependency graph and
+ * the coordinate index are rebuilt from the moved cells. Edits to cells
+ * that are gone can't be undone any more. Ranges in formulas are moved by
+ * rangeMapper if there is one, see cell_ref::rewrite_references.
+ * Every cell that moved, went away or had a formula rewritten is changed.
+ */
+void spreadsheet::remapCells(const reference_mapper &mapper, range_change &change, const range_mapper &rangeMapper)
+{
+	// Cell names move like references, whatever their $ signs would say
+	auto mapName = [&mapper](const std::string &cellName, std::string &mapped) {
+		int col, row;
+		if (!cell_ref::parse(cellName, col, row))
+		{
+			mapped = cellName;
+			return true;
+		}
+		if (!mapper(col, row, false, false) || col < 0 || row < 1)
+			return false;
+		mapped = cell_ref::name(col, row);
+		return true;
+	};
+
+	auto mapData = [&mapper, &rangeMapper, &mapName](cell_data &data) {
+		data.contents = cell_ref::rewrite_references(data.contents, mapper, rangeMapper);
+
+		std::vector<std::string> dependencies;
+		for (const auto &dep : data.dependencies)
+		{
+			std::string mapped;
+			if (mapName(dep, mapped))
+				dependencies.push_back(mapped);
+		}
+		data.dependencies.swap(dependencies);
+	};
+
+	std::set<std::string> changed;
+	cow_table<cell> remapped;
+
+	for (const auto &elem : cells)
+	{
+		std::string cellName;
+		if (!mapName(elem.first, cellName))
+		{
+			changed.insert(elem.first);
+			continue;
+		}
+
+		cell moved = elem.second;
+		cell_data current;
+		current.contents = moved.contents;
+		current.dependencies = moved.dependencies;
+		mapData(current);
+
+		if (cellName != elem.first || current.contents != moved.contents)
+		{
+			changed.insert(elem.first);
+			changed.insert(cellName);
+		}
+
+		moved.cellName = cellName;
+		moved.contents.swap(current.contents);
+		moved.ranges = formulaRanges(moved.contents);
+		moved.dependencies = uncoveredDependencies(current.dependencies, moved.ranges);
+
+		// The history is a stack, take it apart and put it back together
+		std::vector<cell_data> history;
+		for (; !moved.history.empty(); moved.history.pop())
+			history.push_back(moved.history.top());
+		for (auto it = history.rbegin(); it != history.rend(); ++it)
+		{
+			it->cellName = cellName;
+			mapData(*it);
+			moved.history.push(*it);
+		}
+
+		remapped[cellName] = std::move(moved);
+	}
+	cells.swap(remapped);
+
+	dependents.clear();
+	dependees.clear();
+	rangeDependents.clear();
+	cellIndex.clear();
+	for (const auto &elem : cells)
+	{
+		cellIndex.insert(cellKey(elem.first));
+		for (const auto &dep : elem.second.dependencies)
+			addDependency(dep, elem.first);
+		for (const auto &range : elem.second.ranges)
+			rangeDependents.add(elem.first, range);
+	}
+	rebuildValues();
+
+	bool dropped = false;
+	for (std::size_t position = 0; position < edits.size(); position++)
+	{
+		edit_entry &entry = edits.writable(position);
+		std::string cellName;
+		if (!mapName(entry.before.cellName, cellName))
+		{
+			dropped = dropped || !entry.undone;
+			entry.undone = true;
+			continue;
+		}
+		entry.before.cellName = cellName;
+		mapData(entry.before);
+	}
+
+	// Owners only keep edits that can still be undone
+	if (dropped)
+	{
+		for (auto it = ownerEdits.begin(); it != ownerEdits.end();)
+		{
+			std::vector<std::size_t> &owned = it->second;
+			owned.erase(std::remove_if(owned.begin(), owned.end(), [this](std::size_t position) { return edits[position].undone; }),
+						owned.end());
+
+			if (owned.empty())
+				it = ownerEdits.erase(it);
+			else
+				++it;
+		}
+	}
+
+	change.changed.assign(changed.begin(), changed.end());
+	if (!change.changed.empty())
+	{
+		hasChanged = true;
+		recordChanges(change.changed);
+	}
+}
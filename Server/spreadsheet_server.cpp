@@ -1,14 +1,57 @@
 #include <iostream>
 #include "spreadsheet_server.h"
 #include "JSON_message.h"
+#include "logger.h"
 #include <functional>
 #include <vector>
 #include <thread>
 #include <chrono>
 #include <fstream>
+#include <algorithm>
 
 #define SET_CALLBACK(callback) (std::bind(&spreadsheet_server::callback, this, std::placeholders::_1))
 
+/*
+ * How far a paged full send has gotten
+ */
+enum FULL_SEND_STAGE
+{
+    FULL_SEND_BEGIN = 0,
+    FULL_SEND_PAGES = 1,
+    FULL_SEND_END = 2,
+    FULL_SEND_DONE = 3
+};
+
+struct full_send_cursor
+{
+    FULL_SEND_STAGE stage;
+    // The last cell sent, pages pick up after it
+    std::string last_cell;
+    bool sent_page;
+};
+
+server_options::server_options()
+{
+    port = DEFAULT_PORT;
+    io_threads = 0;
+    accept.max_connections = MAX_CONNECTIONS;
+    accept.max_connections_per_ip = MAX_CONNECTIONS_PER_IP;
+    accept.reuse_port = false;
+    metrics_port = 0;
+    per_user_undo = false;
+    recalc_threads = 0;
+}
+
+/*
+ * The default options, listening on the given port
+ */
+static server_options options_with_port(int port)
+{
+    server_options options;
+    options.port = port;
+    return options;
+}
+
 /*
  * Create a spreadsheet_server on port 2112. 
  * A spreadsheet_server handles network connections with spreadsheet clients, 
@@ -17,6 +60,31 @@
  * protocol version 1.1.1.
  */
 spreadsheet_server::spreadsheet_server()
+    : spreadsheet_server(server_options())
+{
+}
+
+/*
+ * Create a spreadsheet_server with the specified port number. Everything else is the
+ * same as the default constructor
+ * 
+ * Parameters:
+ *      int port - the port to run the spreadsheet_server on
+ */
+spreadsheet_server::spreadsheet_server(int port)
+    : spreadsheet_server(options_with_port(port))
+{
+}
+
+/*
+ * Create a spreadsheet_server with the given options.
+ */
+spreadsheet_server::spreadsheet_server(const server_options &options)
+    : server(NULL), users(USERS_LOG_PATH), lock(metrics::lock_wait_time),
+      sheet_list(std::make_shared<const std::string>(JSON_message::spreadsheet_list_message(std::vector<std::string>()))),
+      snapshots(std::make_shared<const snapshot_map>()),
+      names_dirty(false), logins_dirty(false), persister_stopping(false),
+      last_accepted(0), last_rejected(0), per_user_undo(options.per_user_undo)
 {
     // Default username and password
     // logins["admin"] = "password";
@@ -42,13 +110,33 @@ spreadsheet_server::spreadsheet_server()
     // sheets[sheet2.getName()] = sheet2;
     // sheets[sheet3.getName()] = sheet3;
 
+    int recalc_threads = options.recalc_threads;
+    if (recalc_threads <= 0)
+        recalc_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (recalc_threads > 1)
+        recalc_pool.reset(new work_pool(recalc_threads - 1));
+
     is_running = true;
     open_all_spreadsheets();
-    logins = JSON_message::deserialize_users();
-    admin = NULL;
+    // Servers from before the users log kept every login in one JSON file
+    if (!users.load())
+    {
+        users.import(JSON_message::deserialize_users());
+        mark_logins_dirty();
+    }
 
-    // Start spreadsheet saver thread
-    saver_thread = std::thread(spreadsheet_saver, this); //.detach();
+    int thread_count = options.io_threads;
+    if (thread_count <= 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<asio::io_context *> contexts;
+    for (int i = 0; i < thread_count; i++)
+    {
+        // Each io_context is only ever run by one thread
+        io_contexts.push_back(std::unique_ptr<asio::io_context>(new asio::io_context(1)));
+        work_guards.push_back(asio::make_work_guard(*io_contexts.back()));
+        contexts.push_back(io_contexts.back().get());
+    }
 
     try
     {
@@ -56,85 +144,160 @@ spreadsheet_server::spreadsheet_server()
         // with a new client. Callbacks must be bound in this format
         // default port for a server is 2112
         auto acceptor = SET_CALLBACK(handle_first_contact);
-        server = new tcp_server(this->io_context, 2112, acceptor);
+        server = new tcp_server(contexts, options.port, options.accept, acceptor);
     }
     catch (std::exception &e)
     {
-        std::cerr << "Exception: " << e.what() << "\n";
+        LOG(LOG_ERROR, "unable to listen").field("port", options.port).field("error", e.what());
     }
-}
 
-/*
- * Create a spreadsheet_server with the specified port number. Everything else is the
- * same as the default constructor
- * 
- * Parameters:
- *      int port - the port to run the spreadsheet_server on
- */
-spreadsheet_server::spreadsheet_server(int port)
-{
-    try
-    {
-        // accept_client is a callback function, called when a TCP connection is made
-        // with a new client
-        // default port for a server is 2112
-        auto acceptor = std::bind(&spreadsheet_server::handle_first_contact, this, std::placeholders::_1);
-        server = new tcp_server(this->io_context, port, acceptor);
-    }
-    catch (std::exception &e)
+    if (options.metrics_port > 0)
     {
-        std::cerr << "Exception: " << e.what() << "\n";
+        try
+        {
+            stats.reset(new stats_listener(*contexts[0], options.metrics_port));
+        }
+        catch (std::exception &e)
+        {
+            LOG(LOG_ERROR, "unable to serve metrics").field("port", options.metrics_port).field("error", e.what());
+        }
     }
+
+    // Start spreadsheet saver thread
+    saver_thread = std::thread(spreadsheet_saver, this); //.detach();
+    publisher_thread = std::thread(snapshot_publisher, this);
+    persister_thread = std::thread(metadata_persister, this);
 }
 
 spreadsheet_server::~spreadsheet_server()
 {
-    // Free the tcp_server
+    // Free the tcp_server, closing its acceptors
     delete (server);
+    stats.reset();
+
+    // Let every handler that is still queued finish (closed sockets, cross-thread
+    // writes) before any io_context goes away, since a handler on one io_context
+    // can hold a client that lives on another
+    bool ran = true;
+    while (ran)
+    {
+        ran = false;
+        for (auto &context : io_contexts)
+        {
+            context->restart();
+            if (context->poll() > 0)
+                ran = true;
+        }
+    }
 }
 
 /*
- * Run the server. If an exception is thrown, it's printed to standard error.
+ * Run the server on all of its threads, the calling thread included.
+ * Blocks until the server is stopped.
+ * If an exception is thrown, it's printed to standard error.
  */
 void spreadsheet_server::start()
 {
+    // Couldn't listen on the port, there is nothing to run
+    if (server == NULL)
+    {
+        shutdown_server();
+        return;
+    }
+
+    LOG(LOG_INFO, "server up and running").field("threads", io_contexts.size());
+
+    for (std::size_t i = 1; i < io_contexts.size(); i++)
+    {
+        asio::io_context *context = io_contexts[i].get();
+        io_threads.push_back(std::thread([context]() {
+            try
+            {
+                context->run();
+            }
+            catch (std::exception &e)
+            {
+                LOG(LOG_ERROR, "io thread stopped").field("error", e.what());
+            }
+        }));
+    }
+
     try
     {
-        std::cout << "Server up and running" << std::endl;
-        this->io_context.run();
+        io_contexts[0]->run();
     }
     catch (std::exception &e)
     {
-        std::cerr << "Exception: " << e.what() << "\n";
+        LOG(LOG_ERROR, "io thread stopped").field("error", e.what());
     }
+
+    for (auto &thread : io_threads)
+        thread.join();
+    io_threads.clear();
+}
+
+/*
+ * Stops every io_context, start() returns once all of them have stopped
+ */
+void spreadsheet_server::stop_io_contexts()
+{
+    for (auto &guard : work_guards)
+        guard.reset();
+
+    for (auto &context : io_contexts)
+        context->stop();
 }
 
 /*
  * First contact with a client. This is where the client is saved and 
  * the initial list of spreadsheets is sent to the client.
- * This function also sets the client's disconnect function and calls 
- * for more data from the client.
+ * This function also sets the client's message and disconnect functions
+ * and starts the client's read loop.
  */
-void spreadsheet_server::handle_first_contact(client *c)
+void spreadsheet_server::handle_first_contact(const client_ptr &c)
 {
-    std::cout << "Received connection, assigning ID: " << c->get_id() << std::endl;
+    LOG(LOG_INFO, "client connected").field("id", c->get_id());
+    metrics::connected_clients.add(1);
     // Add the client to the list of clients
-    lock.lock();
-    this->clients.insert(c);
-    lock.unlock();
+    clients_lock.lock();
+    this->clients[c->get_id()] = c;
+    clients_lock.unlock();
 
-    // Set the callback function for when data is recieved
-    c->callback_func = std::bind(&spreadsheet_server::handle_client_login, this, std::placeholders::_1);
+    // Set the callback function for when a message is recieved
+    c->message_func = SET_CALLBACK(handle_message);
     // Set the callback function for when a client disconnects
-    c->disconnect_func = std::bind(&spreadsheet_server::handle_client_disconnect, this, std::placeholders::_1);
+    c->disconnect_func = SET_CALLBACK(handle_client_disconnect);
 
     // Send list of spreadsheets
-    c->write_data(JSON_message::spreadsheet_list_message(this->get_spreadsheet_names()));
+    c->write_data(spreadsheet_list());
 
     // returns immediately
-    // asynchronously waits for data to come from the socket, then calls
-    // c->callback_func
-    c->client::get_data();
+    // the client reads from its socket for the rest of its life and
+    // calls c->message_func once for every complete message
+    c->start();
+}
+
+/*
+ * Called for every complete message a client sends. What the message
+ * means depends on where the client is in its lifecycle.
+ */
+void spreadsheet_server::handle_message(const client_ptr &c)
+{
+    switch (c->state)
+    {
+    case AWAITING_OPEN:
+        handle_client_login(c);
+        break;
+    case EDITING:
+        handle_edits(c);
+        break;
+    case ADMIN:
+        handle_admin(c);
+        break;
+    case VIEWING:
+        handle_viewer(c);
+        break;
+    }
 }
 
 /*
@@ -151,17 +314,20 @@ void spreadsheet_server::handle_first_contact(client *c)
  * 
  * If the password is correct, the server sends the requested spreadsheet.
  */
-void spreadsheet_server::handle_client_login(client *c)
+void spreadsheet_server::handle_client_login(const client_ptr &c)
 {
-    if (admin != NULL)
-        admin->write_data(c->message);
+    command *cmd = JSON_message::get_type(c->message.c_str());
 
-    command *cmd = JSON_message::get_type(c->message);
+    if (cmd != NULL && cmd->get_type() == "open")
+        tap.offer(((open_command *)(cmd))->get_name(), ((open_command *)(cmd))->get_username(), "open", c->message);
+    else
+        tap.offer("", "", cmd != NULL ? cmd->get_type() : "", c->message);
 
     // If the the data that the client sent isn't a proper JSON open command
     // then disconnect the client
     if (cmd == NULL || (cmd->get_type() != "open" && cmd->get_type() != "admin"))
     {
+        delete (cmd);
         c->disconnect_client();
         return;
     }
@@ -169,25 +335,39 @@ void spreadsheet_server::handle_client_login(client *c)
     //handle administrator
     if (cmd->get_type() == "admin")
     {
-        c->callback_func = SET_CALLBACK(handle_admin);
-        c->disconnect_func = SET_CALLBACK(handle_admin_disconnect);
-        lock.lock();
+        delete (cmd);
+        c->state = ADMIN;
+        user_lock.lock();
         admin = c;
-        c->write_data(JSON_message::state_message(logins));
-        lock.unlock();
-        // c->disconnect_func() =  // TODO set up admin disconnect
-        c->get_data();
+        user_lock.unlock();
+        c->write_data(JSON_message::state_message(users.all()));
+        // Until it asks for something else, the admin sees every client message
+        tap.subscribe(c, tap_filter());
         return;
     }
 
     std::string username = ((open_command *)(cmd))->get_username();
     std::string password = ((open_command *)(cmd))->get_password();
     std::string sprd_name = ((open_command *)(cmd))->get_name();
+    bool reconnecting = ((open_command *)(cmd))->has_last_version();
+    unsigned long last_epoch = ((open_command *)(cmd))->get_epoch();
+    unsigned long last_version = ((open_command *)(cmd))->get_version();
+    std::vector<std::string> ranges = ((open_command *)(cmd))->get_ranges();
+    std::string compression = ((open_command *)(cmd))->get_compression();
+    bool read_only = ((open_command *)(cmd))->is_read_only();
+    bool wants_values = ((open_command *)(cmd))->wants_values();
 
     delete (cmd);
 
     if (check_login(username, password))
     {
+        if (read_only)
+        {
+            c->username = username;
+            open_viewer(c, sprd_name, reconnecting, last_epoch, last_version, ranges, compression);
+            return;
+        }
+
         lock.lock();
 
         // If the spreadsheet doesn't currently exist
@@ -195,55 +375,95 @@ void spreadsheet_server::handle_client_login(client *c)
         {
             std::replace(sprd_name.begin(), sprd_name.end(), '/', '_');
             sheets[sprd_name] = spreadsheet(sprd_name); // Add a new spreadsheet to the database
+            update_spreadsheet_list();
 
             // Now that there is a new spreadsheet, save all of the names to a file
+            mark_names_dirty();
         }
 
-        c->write_data(JSON_message::full_send_message(this->sheets[sprd_name]));
+        set_viewports(c, ranges);
 
-        // Associate spreadsheet with this client
-        if (sprd_conns.find(sprd_name) == sprd_conns.end()) // didn't find a set
+        // Only compress when we know the codec, otherwise the client never
+        // gets the compression message and carries on uncompressed
+        if (compression == LZ_CODEC_NAME)
+        {
+            c->write_data(JSON_message::compression_message(compression));
+            c->enable_compression();
+        }
+
+        // A reconnecting client only needs the cells that changed since the
+        // version it last saw, unless it's too far behind or the version is
+        // from before the spreadsheet was last loaded
+        std::vector<std::string> changed_cells;
+        if (reconnecting && this->sheets[sprd_name].getChangedCellsSince(last_epoch, last_version, changed_cells))
+        {
+            std::vector<std::string> visible_cells;
+            for (const auto &cell_name : changed_cells)
+            {
+                if (c->sees_cell(cell_name))
+                    visible_cells.push_back(cell_name);
+            }
+            c->write_data(JSON_message::full_send_message(this->sheets[sprd_name], visible_cells));
+        }
+        else if (!c->viewports.empty())
         {
-            std::unordered_set<client *> clients;
-            clients.insert(c);
-            sprd_conns[sprd_name] = clients;
+            c->write_data(visible_send_message(this->sheets[sprd_name], c));
         }
         else
         {
-            sprd_conns[sprd_name].insert(c);
+            // The whole spreadsheet goes out a page at a time, as the client
+            // keeps up, from a snapshot so the pages show it as of now
+            std::shared_ptr<const spreadsheet> snapshot =
+                std::make_shared<const spreadsheet>(this->sheets[sprd_name].snapshot());
+            c->write_stream(full_send_stream(snapshot));
         }
 
-        lock.unlock();
-        if (admin != NULL)
-            admin->write_data(JSON_message::spreadsheet_list_message(this->get_spreadsheet_names()));
+        // Then the values of the formulas it can see, as of now. Anything
+        // a recalculation changes after this is sent on as it happens
+        c->wants_values = wants_values;
+        if (wants_values)
+        {
+            recalculate(sprd_name);
+
+            std::vector<std::string> formulas;
+            const spreadsheet &s = this->sheets[sprd_name];
+            for (const auto &cell_name : s.getAllCellNames())
+            {
+                std::string contents = s.getCellContents(cell_name);
+                if (!contents.empty() && contents[0] == '=' && c->sees_cell(cell_name))
+                    formulas.push_back(cell_name);
+            }
+            c->write_data(JSON_message::values_message(s, formulas));
+        }
+
+        // Associate spreadsheet with this client
+        sprd_conns[sprd_name][c->get_id()] = c;
 
-        save_sprd_names();
-        save_logins();
+        lock.unlock();
+        client_ptr admin_client = get_admin();
+        if (admin_client != NULL)
+            admin_client->write_data(spreadsheet_list());
 
         c->connected_spreadsheet = sprd_name;
-        c->callback_func = std::bind(&spreadsheet_server::handle_edits, this, std::placeholders::_1);
-        c->get_data();
+        c->username = username;
+        c->state = EDITING;
     }
     else // If the username is stored but the password doesn't match
     {
         c->write_data(JSON_message::error_message(INVALID_USER_PASS, ""));
 
         // Send the list of spreadsheets back and let them try again
-        c->write_data(JSON_message::spreadsheet_list_message(this->get_spreadsheet_names()));
-
-        // callback should still be this function
-        c->get_data();
+        // the client stays in AWAITING_OPEN
+        c->write_data(spreadsheet_list());
     }
 }
 
 /* Handles edits from the client
  */
-void spreadsheet_server::handle_edits(client *c)
+void spreadsheet_server::handle_edits(const client_ptr &c)
 {
-    if (admin != NULL)
-        admin->write_data(c->message);
-
-    command *cmd = JSON_message::get_type(c->message);
+    command *cmd = JSON_message::get_type(c->message.c_str());
+    tap.offer(c->connected_spreadsheet, c->username, cmd != NULL ? cmd->get_type() : "", c->message);
 
     if (cmd == NULL)
     {
@@ -260,17 +480,19 @@ void spreadsheet_server::handle_edits(client *c)
 
         lock.lock();
 
-        //Make sure the contents can be set, if they can be, full send the spreadsheet to the connected clients
-        if (sheets[c->connected_spreadsheet].setCellContents(cellName, contents, dependencies))
+        bool changed;
+        {
+            metric_timer timer(metrics::set_cell_time);
+            changed = sheets[c->connected_spreadsheet].setCellContents(cellName, contents, dependencies, c->username);
+        }
+
+        //Make sure the contents can be set, if they can be, send the changed cell to the connected clients
+        if (changed)
         {
-            std::string full_send = JSON_message::full_send_message(sheets[c->connected_spreadsheet]);
             // After the edit is made, go through all the clients connected to this
-            // spreadshseet and send them the new spreadsheet
-            // for (auto it = sprd_conns[c->connected_spreadsheet].cbegin(); it != sprd_conns[c->connected_spreadsheet].cbegin(); ++it)
-            for (const auto &elem : sprd_conns[c->connected_spreadsheet])
-            {
-                elem->write_data(full_send);
-            }
+            // spreadshseet and send them the new cell and version
+            broadcast(c->connected_spreadsheet, JSON_message::full_send_message(sheets[c->connected_spreadsheet], cellName), cellName);
+            recalculate(c->connected_spreadsheet);
             lock.unlock();
         }
         else // If there's a circular dependency error when trying to add the cell
@@ -284,16 +506,12 @@ void spreadsheet_server::handle_edits(client *c)
         std::string cellName = ((revert_command *)(cmd))->get_cell();
         // if we do not get a circ dep
         lock.lock();
-        if (sheets[c->connected_spreadsheet].revertCell(cellName))
+        if (sheets[c->connected_spreadsheet].revertCell(cellName, c->username))
         {
-            std::string full_send = JSON_message::full_send_message(sheets[c->connected_spreadsheet]);
             // After the edit is made, go through all the clients connected to this
-            // spreadshseet and send them the new spreadsheet
-            // for (auto it = sprd_conns[c->connected_spreadsheet].cbegin(); it != sprd_conns[c->connected_spreadsheet].cbegin(); ++it)
-            for (const auto &elem : sprd_conns[c->connected_spreadsheet])
-            {
-                elem->write_data(full_send);
-            }
+            // spreadshseet and send them the new cell and version
+            broadcast(c->connected_spreadsheet, JSON_message::full_send_message(sheets[c->connected_spreadsheet], cellName), cellName);
+            recalculate(c->connected_spreadsheet);
             lock.unlock();
         }
         //otherwise send a circ dep
@@ -309,18 +527,18 @@ void spreadsheet_server::handle_edits(client *c)
         // if we do not get a circ dep
         std::string undo_cell = "";
         lock.lock();
-        UNDO_STATUS status = sheets[c->connected_spreadsheet].undo(undo_cell);
+        UNDO_STATUS status;
+        if (per_user_undo)
+            status = sheets[c->connected_spreadsheet].undo(c->username, undo_cell);
+        else
+            status = sheets[c->connected_spreadsheet].undo(undo_cell);
 
         if (status == UNDO_SUCCESS)
         {
-            std::string full_send = JSON_message::full_send_message(sheets[c->connected_spreadsheet]);
             // After the edit is made, go through all the clients connected to this
-            // spreadshseet and send them the new spreadsheet
-            // for (auto it = sprd_conns[c->connected_spreadsheet].cbegin(); it != sprd_conns[c->connected_spreadsheet].cbegin(); ++it)
-            for (const auto &elem : sprd_conns[c->connected_spreadsheet])
-            {
-                elem->write_data(full_send);
-            }
+            // spreadshseet and send them the new cell and version
+            broadcast(c->connected_spreadsheet, JSON_message::full_send_message(sheets[c->connected_spreadsheet], undo_cell), undo_cell);
+            recalculate(c->connected_spreadsheet);
             lock.unlock();
         }
         else if (status == UNDO_FAIL)
@@ -330,226 +548,1012 @@ void spreadsheet_server::handle_edits(client *c)
         }
         else if (status == UNDO_EMPTY)
         {
-            std::string full_send = JSON_message::full_send_message(sheets[c->connected_spreadsheet]);
-            // After the edit is made, go through all the clients connected to this
-            // spreadshseet and send them the new spreadsheet
-            // for (auto it = sprd_conns[c->connected_spreadsheet].cbegin(); it != sprd_conns[c->connected_spreadsheet].cbegin(); ++it)
-            for (const auto &elem : sprd_conns[c->connected_spreadsheet])
-            {
-                elem->write_data(full_send);
-            }
+            // Nothing changed, just tell the client which version it's at
+            std::string empty_send = JSON_message::full_send_message(sheets[c->connected_spreadsheet], std::vector<std::string>());
             lock.unlock();
+            c->write_data(empty_send);
         }
         else
             lock.unlock();
     }
 
-    delete (cmd);
+    else if (cmd->get_type() == "subscribe")
+    {
+        // Send everything in the new viewports, from now on the client
+        // only hears about changes inside them
+        lock.lock();
+        set_viewports(c, ((subscribe_command *)(cmd))->get_ranges());
+        std::string visible_send = visible_send_message(sheets[c->connected_spreadsheet], c);
+        lock.unlock();
+        c->write_data(visible_send);
+    }
 
-    c->get_data();
-}
+    else if (cmd->get_type() == "fill" || cmd->get_type() == "clear" || cmd->get_type() == "move" ||
+             cmd->get_type() == "insert_rows" || cmd->get_type() == "delete_rows")
+    {
+        handle_range(c, cmd);
+    }
 
-void spreadsheet_server::handle_client_disconnect(client *c)
-{
-    lock.lock();
-    // Erase pointer to client from connected spreadsheets
-    sprd_conns[c->connected_spreadsheet].erase(c);
+    else if (cmd->get_type() == "aggregate")
+    {
+        // Any size of range is fine, it costs the same
+        std::string range_name = ((aggregate_command *)(cmd))->get_range();
+        cell_range range;
+        if (!cell_ref::parse_range(range_name, range))
+        {
+            c->write_data(JSON_message::error_message(INVALID_RANGE, range_name));
+        }
+        else
+        {
+            lock.lock();
+            const spreadsheet &s = sheets[c->connected_spreadsheet];
+            std::string reply = JSON_message::aggregate_message(range_name, s.getRangeStats(range), s.getVersion());
+            lock.unlock();
+            c->write_data(reply);
+        }
+    }
 
-    // Let go of the pointer and let the destructor clean everything up
-    this->clients.erase(c);
-    lock.unlock();
-    std::cout << "DISCONNECTED: " << c->get_id() << std::endl;
+    delete (cmd);
 }
 
-void spreadsheet_server::handle_admin_disconnect(client *c)
+static std::size_t range_size(const cell_range &range)
 {
-    lock.lock();
-    // Erase the admin
-    admin = NULL;
-
-    // Let go of the pointer and let the destructor clean everything up
-    this->clients.erase(c);
-    lock.unlock();
-    std::cout << "DISCONNECTED: " << c->get_id() << std::endl;
+    return (std::size_t)(range.last_col - range.first_col + 1) * (std::size_t)(range.last_row - range.first_row + 1);
 }
 
-void spreadsheet_server::handle_admin(client *c)
+/*
+ * Applies a fill, clear, move, insert_rows or delete_rows in one go and
+ * sends it out as one message. If some cells couldn't be changed, the
+ * client gets an error naming the first one and everyone gets the cells
+ * that did change instead of the operation.
+ */
+void spreadsheet_server::handle_range(const client_ptr &c, command *cmd)
 {
-    command *cmd = JSON_message::get_type(c->message);
+    std::string type = cmd->get_type();
+    cell_range range;
+    int col = 0, row = 0;
+    std::string bad_range;
 
-    if (cmd == NULL)
+    if (type == "fill")
     {
-        c->disconnect_client();
-        return;
+        fill_command *fill = (fill_command *)(cmd);
+        if (!cell_ref::parse(fill->get_source(), col, row) || !cell_ref::parse_range(fill->get_range(), range) ||
+            range_size(range) > MAX_RANGE_CELLS)
+            bad_range = fill->get_range();
     }
-
-    //Handle admin commands
-    std::string cmd_type = cmd->get_type();
-    if (cmd_type == "admin")
+    else if (type == "clear")
     {
-        // State of the spreadsheet
-        lock.lock();
-        c->write_data(JSON_message::state_message(logins));
-        lock.unlock();
-
-        c->write_data(JSON_message::spreadsheet_list_message(this->get_spreadsheet_names()));
+        clear_command *clear = (clear_command *)(cmd);
+        if (!cell_ref::parse_range(clear->get_range(), range) || range_size(range) > MAX_RANGE_CELLS)
+            bad_range = clear->get_range();
     }
-    else if (cmd_type == "close")
+    else if (type == "move")
     {
-        c->write_data("1");
-        shutdown_server();
-        // this->io_context.reset();
-        this->io_context.stop();
+        move_command *move = (move_command *)(cmd);
+        if (!cell_ref::parse_range(move->get_range(), range) || !cell_ref::parse(move->get_to(), col, row) ||
+            range_size(range) > MAX_RANGE_CELLS)
+            bad_range = move->get_range();
+    }
+    else
+    {
+        rows_command *rows = (rows_command *)(cmd);
+        row = rows->get_row();
+        if (row < 1 || rows->get_count() < 1 || rows->get_count() > MAX_RANGE_CELLS)
+            bad_range = std::to_string(row);
+    }
+
+    if (!bad_range.empty())
+    {
+        c->write_data(JSON_message::error_message(INVALID_RANGE, bad_range));
         return;
     }
-    else if (cmd_type == "user")
+
+    lock.lock();
+    spreadsheet &s = sheets[c->connected_spreadsheet];
+    range_change change;
     {
-        modify_user((user_command *)(cmd));
-        // State of the spreadsheet
-        lock.lock();
-        c->write_data(JSON_message::state_message(logins));
+        metric_timer timer(metrics::range_op_time);
+        if (type == "fill")
+            change = s.fillRange(((fill_command *)(cmd))->get_source(), range, c->username);
+        else if (type == "clear")
+            change = s.clearRange(range, c->username);
+        else if (type == "move")
+            change = s.moveRange(range, col, row);
+        else if (type == "insert_rows")
+            change = s.insertRows(row, ((rows_command *)(cmd))->get_count());
+        else
+            change = s.deleteRows(row, ((rows_command *)(cmd))->get_count());
+    }
+
+    if (change.changed.empty())
+    {
+        // Nothing changed, just tell the client which version it's at
+        std::string empty_send = JSON_message::full_send_message(s, std::vector<std::string>());
         lock.unlock();
-        save_logins();
+        if (change.rejected.empty())
+            c->write_data(empty_send);
     }
-    else if (cmd_type == "sheet")
+    else
     {
-        if (!modify_sheets((sheet_command *)(cmd)))
-        {
-            c->write_data("0");
-            // JSON_message::send_message("Unable to delete spreadsheet :" +
-            // ((sheet_command *)(cmd))->get_name() + ", currently active");
-        }
-        c->write_data(JSON_message::spreadsheet_list_message(this->get_spreadsheet_names()));
+        std::string message = change.rejected.empty() ? JSON_message::range_message(cmd, s.getVersion()) : "";
+        broadcast(c->connected_spreadsheet, message, change.changed);
+        recalculate(c->connected_spreadsheet);
+        lock.unlock();
     }
 
-    delete (cmd);
-
-    c->get_data();
+    if (!change.rejected.empty())
+        c->write_data(JSON_message::error_message(CIRC_DEP, change.rejected[0]));
 }
 
 /*
- * Check the username and password against the stored logins.
- * Returns true if the username exists and the password matches.
- * Returns true if the username doesn't exist and stores the username
- * and password.
- * 
- * 
- * Returns false if the username exists and the password doesn't match.
+ * Sends one message to every client connected to the given spreadsheet.
+ * The message is serialized once and shared by all of the recipients.
+ * Clients that have already gone away are dropped from the spreadsheet.
+ * The caller must hold lock.
  */
-bool spreadsheet_server::check_login(std::string username, std::string password)
+void spreadsheet_server::broadcast(const std::string &sprd_name, const std::string &message)
 {
-    lock.lock();
-    if (this->logins.find(username) == this->logins.end())
-    {
-        // Username doesn't exist - add it
-        this->logins[username] = password;
-        if (admin != NULL)
-            admin->write_data(JSON_message::state_message(logins));
-    }
-    else
+    std::shared_ptr<const std::string> shared_message = std::make_shared<const std::string>(message);
+    client_registry &conns = sprd_conns[sprd_name];
+    std::size_t fanout = 0;
+
+    for (auto it = conns.begin(); it != conns.end();)
     {
-        // Check if the password matches the one in the database
-        if (this->logins[username] != password)
+        client_ptr elem = it->second.lock();
+        if (elem == NULL)
         {
-            lock.unlock(); // return the lock before returning
-            return false;
+            it = conns.erase(it);
+            continue;
         }
+
+        elem->write_data(shared_message);
+        fanout++;
+        ++it;
     }
-    lock.unlock();
 
-    return true;
+    metrics::serialized_bytes.record(message.size());
+    metrics::broadcast_fanout.record(fanout);
 }
 
 /*
- * Returns the names of the stored spreadsheets
- * in a vector of strings.
- * Thread safe.
+ * Sends a change to one cell to every client connected to the given
+ * spreadsheet that has the cell in view.
+ * The caller must hold lock.
  */
-std::vector<std::string> spreadsheet_server::get_spreadsheet_names()
+void spreadsheet_server::broadcast(const std::string &sprd_name, const std::string &message, const std::string &cell_name)
 {
-    std::vector<std::string> list_of_sheets;
-    lock.lock();
-    for (const auto &sheet : this->sheets)
-        list_of_sheets.push_back(sheet.first);
-    lock.unlock();
-    return list_of_sheets;
-}
+    std::shared_ptr<const std::string> shared_message = std::make_shared<const std::string>(message);
+    client_registry &conns = sprd_conns[sprd_name];
+    std::size_t fanout = 0;
 
-void spreadsheet_server::save_spreadsheets()
-{
-    std::vector<std::string> list = get_spreadsheet_names();
-    lock.lock();
-    for (unsigned int i = 0; i < list.size(); i++)
+    for (auto it = conns.begin(); it != conns.end();)
     {
+        client_ptr elem = it->second.lock();
+        if (elem == NULL)
+        {
+            it = conns.erase(it);
+            continue;
+        }
 
-        //if the spreadsheet status has changed
-        if (sheets[list[i]].getSaveStatus())
+        if (elem->sees_cell(cell_name))
         {
-            //save the spreadsheet to the file
-            sheets[list[i]].saveSpreadsheet();
+            elem->write_data(shared_message);
+            fanout++;
         }
+        ++it;
     }
-    lock.unlock();
+
+    metrics::serialized_bytes.record(message.size());
+    metrics::broadcast_fanout.record(fanout);
 }
 
 /*
- * Saves spreadsheet names to a file with each
- * name on a new line
- * 
- *  THREAD SAFE 
+ * Sends a change to many cells to every client connected to the given
+ * spreadsheet. Clients showing all of it get message (a range operation
+ * they apply themselves), or the changed cells if message is empty.
+ * Clients with viewports get the changed cells they can see.
+ * The caller must hold lock.
  */
-void spreadsheet_server::save_sprd_names()
+void spreadsheet_server::broadcast(const std::string &sprd_name, const std::string &message, const std::vector<std::string> &cell_names)
 {
-    // Spreadsheet files wil have .sprd extensions and stored in the
-    // spreadsheets directory
-    std::vector<std::string> list = get_spreadsheet_names();
-
-    io_lock.lock();
-    std::ofstream names_file;
-
-    std::string path = "spreadsheets/sprd_names";
-    names_file.open(path.c_str());
+    const spreadsheet &s = sheets[sprd_name];
+    std::shared_ptr<const std::string> shared_message = std::make_shared<const std::string>(
+        message.empty() ? JSON_message::full_send_message(s, cell_names) : message);
+    client_registry &conns = sprd_conns[sprd_name];
+    std::size_t fanout = 0;
 
-    if (names_file.is_open())
+    for (auto it = conns.begin(); it != conns.end();)
     {
-        // Save a document with each spreadsheet name on a new line
-        for (unsigned int i = 0; i < list.size(); i++)
+        client_ptr elem = it->second.lock();
+        if (elem == NULL)
         {
-            names_file << list[i];
-            names_file << "\n";
+            it = conns.erase(it);
+            continue;
         }
-    }
+        ++it;
 
+        if (elem->viewports.empty())
+        {
+            elem->write_data(shared_message);
+            fanout++;
+            continue;
+        }
 
-    names_file.close();
-    io_lock.unlock();
+        std::vector<std::string> visible_cells;
+        for (const auto &cell_name : cell_names)
+        {
+            if (elem->sees_cell(cell_name))
+                visible_cells.push_back(cell_name);
+        }
+
+        if (!visible_cells.empty())
+        {
+            elem->write_data(JSON_message::full_send_message(s, visible_cells));
+            fanout++;
+        }
+    }
+
+    metrics::serialized_bytes.record(shared_message->size());
+    metrics::broadcast_fanout.record(fanout);
 }
 
-void spreadsheet_server::save_logins()
+/*
+ * Works out the formulas the changes since the last recalculation affect,
+ * and sends their values to the clients that asked for values and can see
+ * them.
+ * The caller must hold lock.
+ */
+void spreadsheet_server::recalculate(const std::string &sprd_name)
+{
+    spreadsheet &s = sheets[sprd_name];
+    std::vector<std::string> recalculated;
+    s.recalculate(recalc_pool.get(), recalculated);
+    if (recalculated.empty())
+        return;
+
+    client_registry &conns = sprd_conns[sprd_name];
+    for (auto it = conns.begin(); it != conns.end(); ++it)
+    {
+        client_ptr elem = it->second.lock();
+        if (elem == NULL || !elem->wants_values)
+            continue;
+
+        std::vector<std::string> visible_cells;
+        for (const auto &cell_name : recalculated)
+        {
+            if (elem->sees_cell(cell_name))
+                visible_cells.push_back(cell_name);
+        }
+
+        if (!visible_cells.empty())
+            elem->write_data(JSON_message::values_message(s, visible_cells));
+    }
+}
+
+/*
+ * Replaces the client's viewports with the given ranges. Ranges that
+ * can't be parsed are ignored, no ranges means the whole spreadsheet.
+ * The caller must hold lock, or viewer_lock for a viewer.
+ */
+void spreadsheet_server::set_viewports(const client_ptr &c, const std::vector<std::string> &ranges)
+{
+    c->viewports.clear();
+
+    for (const auto &range : ranges)
+    {
+        cell_range viewport;
+        if (cell_ref::parse_range(range, viewport))
+            c->viewports.push_back(viewport);
+    }
+}
+
+/*
+ * A full send of everything the client has in view.
+ * The caller must hold lock, or viewer_lock for a viewer.
+ */
+std::string spreadsheet_server::visible_send_message(const spreadsheet &s, const client_ptr &c)
+{
+    if (c->viewports.empty())
+        return JSON_message::full_send_message(s);
+
+    std::vector<std::string> cell_names;
+    for (const auto &viewport : c->viewports)
+        s.getCellNamesInRange(viewport, cell_names);
+
+    // Overlapping viewports find the same cell more than once
+    if (c->viewports.size() > 1)
+    {
+        std::sort(cell_names.begin(), cell_names.end());
+        cell_names.erase(std::unique(cell_names.begin(), cell_names.end()), cell_names.end());
+    }
+
+    return JSON_message::full_send_message(s, cell_names);
+}
+
+/*
+ * The next message of a paged full send of s: a full send begin message,
+ * pages of cells no bigger than about FULL_SEND_PAGE_SIZE, then a full send
+ * end message. NULL once the end message has gone out.
+ */
+static std::shared_ptr<const std::string> next_full_send_message(const spreadsheet &s, full_send_cursor &cursor)
+{
+    if (cursor.stage == FULL_SEND_DONE)
+        return NULL;
+
+    if (cursor.stage == FULL_SEND_BEGIN)
+    {
+        cursor.stage = FULL_SEND_PAGES;
+        return std::make_shared<const std::string>(JSON_message::full_send_begin_message(s, s.getCellCount()));
+    }
+
+    if (cursor.stage == FULL_SEND_PAGES)
+    {
+        std::vector<std::string> page;
+        std::size_t page_size = 0;
+        bool more = true;
+
+        while (more && page_size < FULL_SEND_PAGE_SIZE)
+        {
+            std::vector<std::string> batch;
+            s.getCellNamesAfter(cursor.last_cell, FULL_SEND_BATCH, batch);
+            more = batch.size() == FULL_SEND_BATCH;
+
+            for (const auto &cell_name : batch)
+            {
+                if (page_size >= FULL_SEND_PAGE_SIZE)
+                {
+                    more = true;
+                    break;
+                }
+
+                page.push_back(cell_name);
+                page_size += cell_name.size() + s.getCellContents(cell_name).size();
+                cursor.last_cell = cell_name;
+            }
+        }
+
+        if (!more)
+            cursor.stage = FULL_SEND_END;
+
+        // Always send at least one page, even for an empty spreadsheet,
+        // clients that don't know about pages only look for the full send
+        if (!page.empty() || !cursor.sent_page)
+        {
+            cursor.sent_page = true;
+            return std::make_shared<const std::string>(JSON_message::full_send_message(s, page));
+        }
+    }
+
+    cursor.stage = FULL_SEND_DONE;
+    return std::make_shared<const std::string>(JSON_message::full_send_end_message(s));
+}
+
+/*
+ * Sends a whole snapshot a page at a time, without taking any lock. Each
+ * page is built only once the previous one has gone out, so only a page of
+ * the spreadsheet is ever waiting on a slow client. The stream holds on to
+ * the snapshot until the last page is out.
+ *
+ * Changes made while the pages are going out reach the client as
+ * broadcasts, queued behind the last page. The pages never show them, so
+ * a change that isn't just new contents for a cell, e.g. inserting rows,
+ * is applied once, to the spreadsheet as the pages left it.
+ */
+message_stream spreadsheet_server::full_send_stream(const std::shared_ptr<const spreadsheet> &snapshot)
+{
+    std::shared_ptr<full_send_cursor> cursor = std::make_shared<full_send_cursor>();
+    cursor->stage = FULL_SEND_BEGIN;
+    cursor->sent_page = false;
+
+    return [snapshot, cursor]() -> std::shared_ptr<const std::string> {
+        return next_full_send_message(*snapshot, *cursor);
+    };
+}
+
+/*
+ * Opens a spreadsheet read only. The client gets the spreadsheet's
+ * published snapshot and, from then on, the changes in every snapshot
+ * published after it. A spreadsheet nobody was viewing has no snapshot
+ * yet, the client gets the whole spreadsheet once the next one is published.
+ * Never takes lock.
+ */
+void spreadsheet_server::open_viewer(const client_ptr &c, const std::string &sprd_name, bool reconnecting,
+                                     unsigned long last_epoch, unsigned long last_version,
+                                     const std::vector<std::string> &ranges, const std::string &compression)
+{
+    std::lock_guard<std::mutex> guard(viewer_lock);
+
+    set_viewports(c, ranges);
+
+    if (compression == LZ_CODEC_NAME)
+    {
+        c->write_data(JSON_message::compression_message(compression));
+        c->enable_compression();
+    }
+
+    std::shared_ptr<const snapshot_map> published = std::atomic_load(&snapshots);
+    auto found = published->find(sprd_name);
+    if (found != published->end())
+    {
+        const std::shared_ptr<const spreadsheet> &snapshot = found->second;
+
+        std::vector<std::string> changed_cells;
+        if (reconnecting && snapshot->getChangedCellsSince(last_epoch, last_version, changed_cells))
+        {
+            std::vector<std::string> visible_cells;
+            for (const auto &cell_name : changed_cells)
+            {
+                if (c->sees_cell(cell_name))
+                    visible_cells.push_back(cell_name);
+            }
+            c->write_data(JSON_message::full_send_message(*snapshot, visible_cells));
+        }
+        else if (!c->viewports.empty())
+        {
+            c->write_data(visible_send_message(*snapshot, c));
+        }
+        else
+        {
+            c->write_stream(full_send_stream(snapshot));
+        }
+    }
+
+    viewer_conns[sprd_name][c->get_id()] = c;
+    c->connected_spreadsheet = sprd_name;
+    c->state = VIEWING;
+    metrics::connected_viewers.add(1);
+}
+
+/*
+ * Handles messages from a viewer. Anything that would change the
+ * spreadsheet is turned away with a read only error.
+ */
+void spreadsheet_server::handle_viewer(const client_ptr &c)
+{
+    command *cmd = JSON_message::get_type(c->message.c_str());
+    tap.offer(c->connected_spreadsheet, c->username, cmd != NULL ? cmd->get_type() : "", c->message);
+
+    if (cmd == NULL)
+    {
+        c->disconnect_client();
+        return;
+    }
+
+    if (cmd->get_type() == "edit")
+    {
+        c->write_data(JSON_message::error_message(READ_ONLY, ((edit_command *)(cmd))->get_cell()));
+    }
+    else if (cmd->get_type() == "revert")
+    {
+        c->write_data(JSON_message::error_message(READ_ONLY, ((revert_command *)(cmd))->get_cell()));
+    }
+    else if (cmd->get_type() != "subscribe")
+    {
+        // undo, fill, clear, move, insert_rows and delete_rows. Viewers
+        // never take the editing lock, so they can't aggregate either
+        c->write_data(JSON_message::error_message(READ_ONLY, ""));
+    }
+    else if (cmd->get_type() == "subscribe")
+    {
+        std::lock_guard<std::mutex> guard(viewer_lock);
+        set_viewports(c, ((subscribe_command *)(cmd))->get_ranges());
+
+        std::shared_ptr<const snapshot_map> published = std::atomic_load(&snapshots);
+        auto found = published->find(c->connected_spreadsheet);
+        if (found != published->end())
+            c->write_data(visible_send_message(*found->second, c));
+    }
+
+    delete (cmd);
+}
+
+/*
+ * Copies every spreadsheet that has viewers and changed since its last
+ * snapshot, swaps in a map with the new snapshots and sends each viewer
+ * what changed. lock is only held while copying. Spreadsheets nobody is
+ * viewing any more lose their snapshot.
+ */
+void spreadsheet_server::publish_snapshots()
+{
+    metric_timer timer(metrics::snapshot_publish_time);
+
+    std::vector<std::string> viewed;
+    viewer_lock.lock();
+    for (auto it = viewer_conns.begin(); it != viewer_conns.end();)
+    {
+        client_registry &viewers = it->second;
+        for (auto viewer = viewers.begin(); viewer != viewers.end();)
+        {
+            if (viewer->second.expired())
+                viewer = viewers.erase(viewer);
+            else
+                ++viewer;
+        }
+
+        if (viewers.empty())
+        {
+            it = viewer_conns.erase(it);
+            continue;
+        }
+
+        viewed.push_back(it->first);
+        ++it;
+    }
+    viewer_lock.unlock();
+
+    std::shared_ptr<const snapshot_map> published = std::atomic_load(&snapshots);
+    std::shared_ptr<snapshot_map> next = std::make_shared<snapshot_map>();
+    std::vector<std::string> changed;
+
+    lock.lock();
+    for (const auto &sprd_name : viewed)
+    {
+        auto sheet = sheets.find(sprd_name);
+        auto previous = published->find(sprd_name);
+
+        if (sheet == sheets.end())
+        {
+            // Viewers of a spreadsheet that doesn't exist see it empty
+            if (previous != published->end())
+                (*next)[sprd_name] = previous->second;
+            else
+            {
+                (*next)[sprd_name] = std::make_shared<const spreadsheet>(spreadsheet(sprd_name));
+                changed.push_back(sprd_name);
+            }
+        }
+        else if (previous != published->end() && previous->second->getEpoch() == sheet->second.getEpoch() &&
+                 previous->second->getVersion() == sheet->second.getVersion())
+        {
+            (*next)[sprd_name] = previous->second;
+        }
+        else
+        {
+            (*next)[sprd_name] = std::make_shared<const spreadsheet>(sheet->second.snapshot());
+            changed.push_back(sprd_name);
+        }
+    }
+    lock.unlock();
+
+    std::lock_guard<std::mutex> guard(viewer_lock);
+    std::atomic_store(&snapshots, std::shared_ptr<const snapshot_map>(next));
+
+    for (const auto &sprd_name : changed)
+    {
+        auto previous = published->find(sprd_name);
+        if (previous == published->end())
+            send_snapshot_changes(sprd_name, (*next)[sprd_name], NULL);
+        else
+            send_snapshot_changes(sprd_name, (*next)[sprd_name], previous->second.get());
+    }
+}
+
+/*
+ * Sends the viewers of a spreadsheet the cells that changed between the
+ * last snapshot they were sent and this one. Viewers that were never sent
+ * a snapshot (last is NULL), or are too far behind for the spreadsheet's
+ * change history, get all of it. The caller must hold viewer_lock.
+ */
+void spreadsheet_server::send_snapshot_changes(const std::string &sprd_name, const std::shared_ptr<const spreadsheet> &snapshot,
+                                               const spreadsheet *last)
+{
+    auto conns = viewer_conns.find(sprd_name);
+    if (conns == viewer_conns.end())
+        return;
+
+    std::vector<std::string> changed_cells;
+    bool has_changes = last != NULL && snapshot->getChangedCellsSince(last->getEpoch(), last->getVersion(), changed_cells);
+
+    std::shared_ptr<const std::string> shared_message;
+    if (has_changes)
+        shared_message = std::make_shared<const std::string>(JSON_message::full_send_message(*snapshot, changed_cells));
+
+    std::size_t fanout = 0;
+    for (auto &elem : conns->second)
+    {
+        client_ptr viewer = elem.second.lock();
+        if (viewer == NULL)
+            continue;
+
+        if (!has_changes)
+        {
+            if (viewer->viewports.empty())
+                viewer->write_stream(full_send_stream(snapshot));
+            else
+                viewer->write_data(visible_send_message(*snapshot, viewer));
+        }
+        else if (viewer->viewports.empty())
+        {
+            viewer->write_data(shared_message);
+        }
+        else
+        {
+            std::vector<std::string> visible_cells;
+            for (const auto &cell_name : changed_cells)
+            {
+                if (viewer->sees_cell(cell_name))
+                    visible_cells.push_back(cell_name);
+            }
+
+            if (visible_cells.empty())
+                continue;
+            viewer->write_data(JSON_message::full_send_message(*snapshot, visible_cells));
+        }
+        fanout++;
+    }
+
+    if (shared_message != NULL)
+        metrics::serialized_bytes.record(shared_message->size());
+    metrics::broadcast_fanout.record(fanout);
+}
+
+void spreadsheet_server::handle_client_disconnect(const client_ptr &c)
+{
+    metrics::connected_clients.add(-1);
+
+    if (c->state == ADMIN)
+    {
+        handle_admin_disconnect(c);
+        return;
+    }
+
+    if (c->state == VIEWING)
+    {
+        metrics::connected_viewers.add(-1);
+        viewer_lock.lock();
+        auto conns = viewer_conns.find(c->connected_spreadsheet);
+        if (conns != viewer_conns.end())
+            conns->second.erase(c->get_id());
+        viewer_lock.unlock();
+    }
+    else
+    {
+        lock.lock();
+        // Erase the client from its connected spreadsheet
+        auto conns = sprd_conns.find(c->connected_spreadsheet);
+        if (conns != sprd_conns.end())
+            conns->second.erase(c->get_id());
+        lock.unlock();
+    }
+
+    // Let go of the client, it is freed once its last socket operation finishes
+    clients_lock.lock();
+    this->clients.erase(c->get_id());
+    clients_lock.unlock();
+    LOG(LOG_INFO, "client disconnected").field("id", c->get_id());
+}
+
+void spreadsheet_server::handle_admin_disconnect(const client_ptr &c)
+{
+    user_lock.lock();
+    // Erase the admin
+    if (admin.lock() == c)
+        admin.reset();
+    user_lock.unlock();
+    tap.unsubscribe(c);
+
+    // Let go of the client, it is freed once its last socket operation finishes
+    clients_lock.lock();
+    this->clients.erase(c->get_id());
+    clients_lock.unlock();
+    LOG(LOG_INFO, "client disconnected").field("id", c->get_id());
+}
+
+void spreadsheet_server::handle_admin(const client_ptr &c)
+{
+    command *cmd = JSON_message::get_type(c->message.c_str());
+
+    if (cmd == NULL)
+    {
+        c->disconnect_client();
+        return;
+    }
+
+    //Handle admin commands
+    std::string cmd_type = cmd->get_type();
+    if (cmd_type == "admin")
+    {
+        // State of the spreadsheet
+        c->write_data(JSON_message::state_message(users.all()));
+
+        c->write_data(spreadsheet_list());
+    }
+    else if (cmd_type == "stats")
+    {
+        c->write_data(JSON_message::stats_message(metrics::snapshot()));
+    }
+    else if (cmd_type == "close")
+    {
+        c->write_data("1");
+        delete (cmd);
+        shutdown_server();
+        stop_io_contexts();
+        return;
+    }
+    else if (cmd_type == "user")
+    {
+        // Only the user that changed, the admin got every user when it
+        // connected
+        std::string reply = modify_user((user_command *)(cmd));
+        if (!reply.empty())
+            c->write_data(reply);
+        mark_logins_dirty();
+    }
+    else if (cmd_type == "sheet")
+    {
+        if (!modify_sheets((sheet_command *)(cmd)))
+        {
+            c->write_data("0");
+            // JSON_message::send_message("Unable to delete spreadsheet :" +
+            // ((sheet_command *)(cmd))->get_name() + ", currently active");
+        }
+        c->write_data(spreadsheet_list());
+    }
+    else if (cmd_type == "tap")
+    {
+        tap_command *tap_cmd = (tap_command *)(cmd);
+        std::vector<std::string> sheets = tap_cmd->get_sheets();
+        std::vector<std::string> users = tap_cmd->get_users();
+        std::vector<std::string> types = tap_cmd->get_types();
+
+        tap_filter filter;
+        filter.sheets.insert(sheets.begin(), sheets.end());
+        filter.users.insert(users.begin(), users.end());
+        filter.types.insert(types.begin(), types.end());
+        filter.sample = tap_cmd->get_sample();
+        if (tap_cmd->get_rate() >= 0)
+            filter.rate = tap_cmd->get_rate();
+
+        if (filter.sample == 0)
+            tap.unsubscribe(c);
+        else
+            tap.subscribe(c, filter);
+    }
+
+    delete (cmd);
+}
+
+/*
+ * Check the username and password against the stored logins.
+ * Returns true if the username exists and the password matches.
+ * Returns true if the username doesn't exist and stores the username
+ * and password.
+ * 
+ * 
+ * Returns false if the username exists and the password doesn't match.
+ */
+bool spreadsheet_server::check_login(const std::string &username, const std::string &password)
+{
+    user_store::LOGIN_RESULT result = users.check_login(username, password);
+
+    if (result == user_store::LOGIN_ADDED)
+    {
+        mark_logins_dirty();
+        client_ptr admin_client = get_admin();
+        if (admin_client != NULL)
+            admin_client->write_data(JSON_message::user_state_message(username, &password));
+    }
+
+    return result != user_store::LOGIN_BAD_PASSWORD;
+}
+
+/*
+ * Returns the names of the stored spreadsheets
+ * in a vector of strings.
+ * Thread safe.
+ */
+std::vector<std::string> spreadsheet_server::get_spreadsheet_names()
+{
+    std::vector<std::string> list_of_sheets;
+    lock.lock();
+    for (const auto &sheet : this->sheets)
+        list_of_sheets.push_back(sheet.first);
+    lock.unlock();
+    return list_of_sheets;
+}
+
+/*
+ * The list message every client is sent, shared by all of them.
+ * Never takes lock.
+ */
+std::shared_ptr<const std::string> spreadsheet_server::spreadsheet_list()
+{
+    return std::atomic_load(&sheet_list);
+}
+
+/*
+ * Serializes the list message again after a spreadsheet was added or
+ * removed. Must be called with lock held, so two changes can't swap in
+ * their lists in the wrong order.
+ */
+void spreadsheet_server::update_spreadsheet_list()
 {
+    std::vector<std::string> names;
+    names.reserve(sheets.size());
+    for (const auto &sheet : sheets)
+        names.push_back(sheet.first);
+
+    std::shared_ptr<const std::string> message = std::make_shared<const std::string>(JSON_message::spreadsheet_list_message(names));
+    std::atomic_store(&sheet_list, message);
+}
+
+/*
+ * Saves every spreadsheet that changed since it was last saved. Only
+ * taking snapshots of them holds the editing lock, they are serialized and
+ * written out after it is let go. An edit made meanwhile marks its
+ * spreadsheet changed again, for the next save.
+ */
+void spreadsheet_server::save_spreadsheets()
+{
+    metric_timer timer(metrics::save_time);
+    // The saver thread and shutdown can both get here, and an older snapshot
+    // must not be written over a newer one
+    std::lock_guard<std::mutex> saving(save_lock);
+
+    std::vector<spreadsheet> changed;
     lock.lock();
-    std::string users = JSON_message::state_message(logins);
+    for (auto &elem : sheets)
+    {
+        //if the spreadsheet status has changed
+        if (elem.second.getSaveStatus())
+        {
+            changed.push_back(elem.second.snapshot());
+            elem.second.setSaved();
+        }
+    }
     lock.unlock();
 
+    for (auto &snapshot : changed)
+    {
+        //save the spreadsheet to the file
+        snapshot.saveSpreadsheet();
+    }
+}
+
+/*
+ * Saves spreadsheet names to a file with each
+ * name on a new line
+ * 
+ *  THREAD SAFE 
+ */
+void spreadsheet_server::save_sprd_names()
+{
+    // Spreadsheet files wil have .sprd extensions and stored in the
+    // spreadsheets directory
+    std::vector<std::string> list = get_spreadsheet_names();
+
     io_lock.lock();
-    std::ofstream logins_file;
+    std::ofstream names_file;
+
+    std::string path = "spreadsheets/sprd_names";
+    names_file.open(path.c_str());
 
-    std::string path = "spreadsheets/users";
-    logins_file.open(path.c_str());
-    logins_file << users;
-    logins_file.close();
+    if (names_file.is_open())
+    {
+        // Save a document with each spreadsheet name on a new line
+        for (unsigned int i = 0; i < list.size(); i++)
+        {
+            names_file << list[i];
+            names_file << "\n";
+        }
+    }
+
+
+    names_file.close();
+    io_lock.unlock();
+}
+
+/*
+ * Appends the login changes since the last save to the users log
+ */
+void spreadsheet_server::save_logins()
+{
+    io_lock.lock();
+    users.flush();
     io_lock.unlock();
 }
 
+/*
+ * Asks the persister to write the spreadsheet names file soon.
+ * Returns right away, never touches the disk.
+ */
+void spreadsheet_server::mark_names_dirty()
+{
+    {
+        std::lock_guard<std::mutex> guard(persist_lock);
+        names_dirty = true;
+    }
+    persist_cond.notify_one();
+}
+
+/*
+ * Asks the persister to write the logins file soon.
+ * Returns right away, never touches the disk.
+ */
+void spreadsheet_server::mark_logins_dirty()
+{
+    {
+        std::lock_guard<std::mutex> guard(persist_lock);
+        logins_dirty = true;
+    }
+    persist_cond.notify_one();
+}
+
+/*
+ * Writes out anything still dirty and waits for the persister to stop
+ */
+void spreadsheet_server::stop_persister()
+{
+    {
+        std::lock_guard<std::mutex> guard(persist_lock);
+        persister_stopping = true;
+    }
+    persist_cond.notify_one();
+
+    if (persister_thread.joinable())
+        persister_thread.join();
+}
+
 void spreadsheet_server::spreadsheet_saver(spreadsheet_server *s)
 {
     while (s->currently_running())
     {
         s->save_spreadsheets();
+        s->report_connections();
+        s->report_registries();
         std::this_thread::sleep_for(std::chrono::seconds(SAVE_INTERVAL));
     }
 }
 
+/*
+ * Writes the spreadsheet names and logins files when they change. After
+ * the first change it waits METADATA_DEBOUNCE_MS so everything else that
+ * changes meanwhile goes out in the same write. Only files that changed
+ * are written, and everything dirty is written before it stops.
+ */
+void spreadsheet_server::metadata_persister(spreadsheet_server *s)
+{
+    std::unique_lock<std::mutex> guard(s->persist_lock);
+
+    while (true)
+    {
+        s->persist_cond.wait(guard, [s]() { return s->names_dirty || s->logins_dirty || s->persister_stopping; });
+
+        if (!s->persister_stopping)
+            s->persist_cond.wait_for(guard, std::chrono::milliseconds(METADATA_DEBOUNCE_MS),
+                                     [s]() { return s->persister_stopping; });
+
+        bool names = s->names_dirty;
+        bool logins = s->logins_dirty;
+        bool stopping = s->persister_stopping;
+        s->names_dirty = false;
+        s->logins_dirty = false;
+
+        // Changes made while writing mark the files dirty again
+        guard.unlock();
+        {
+            metric_timer timer(metrics::metadata_save_time);
+            if (names)
+                s->save_sprd_names();
+            if (logins)
+                s->save_logins();
+        }
+        guard.lock();
+
+        if (stopping && !s->names_dirty && !s->logins_dirty)
+            return;
+    }
+}
+
+void spreadsheet_server::snapshot_publisher(spreadsheet_server *s)
+{
+    while (s->currently_running())
+    {
+        s->publish_snapshots();
+        std::this_thread::sleep_for(std::chrono::milliseconds(SNAPSHOT_INTERVAL_MS));
+    }
+}
+
 void spreadsheet_server::open_all_spreadsheets()
 {
     std::ifstream names_file;
@@ -557,38 +1561,76 @@ void spreadsheet_server::open_all_spreadsheets()
     std::string sprd_name;
 
     names_file.open(path.c_str(), std::fstream::in);
-    if (names_file.is_open())
+    if (!names_file.is_open())
     {
-        while (getline(names_file, sprd_name))
-        {
-            sheets[sprd_name] = JSON_message::open_spreadsheet(sprd_name);
-        }
+        // Names file doesn't exist, don't read in spreadsheets
+        return;
+    }
 
-        names_file.close();
+    std::vector<std::string> names;
+    while (getline(names_file, sprd_name))
+    {
+        names.push_back(sprd_name);
     }
-    else
+    names_file.close();
+
+    if (names.empty())
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Spreadsheets are independent of each other, so a pool of workers each
+    // takes the next one still to be opened until they've all been opened
+    std::vector<spreadsheet> loaded(names.size());
+    std::atomic<std::size_t> next(0);
+
+    unsigned int worker_count = std::max(1u, std::thread::hardware_concurrency());
+    worker_count = std::min<std::size_t>(worker_count, names.size());
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < worker_count; i++)
     {
-        // Names file doesn't exist, don't read in spreadsheets
+        workers.push_back(std::thread([&]() {
+            std::size_t index;
+            while ((index = next.fetch_add(1)) < names.size())
+                loaded[index] = JSON_message::open_spreadsheet(names[index]);
+        }));
     }
+
+    for (std::thread &worker : workers)
+        worker.join();
+
+    for (std::size_t i = 0; i < names.size(); i++)
+        sheets[names[i]] = std::move(loaded[i]);
+    update_spreadsheet_list();
+
+    LOG(LOG_INFO, "spreadsheets loaded")
+        .field("count", names.size())
+        .field("threads", worker_count)
+        .field("ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
 }
 
-void spreadsheet_server::modify_user(user_command *cmd)
+/*
+ * Adds, changes or deletes a user. Returns the state message for the
+ * admin with just that user in it, empty if the order isn't one of those
+ */
+std::string spreadsheet_server::modify_user(user_command *cmd)
 {
     std::string order = cmd->get_order();
     std::string username = cmd->get_username();
-
-    lock.lock();
+    std::string password = cmd->get_password();
 
     if (order == "new" || order == "change")
     {
-        logins[username] = cmd->get_password();
+        users.set(username, password);
+        return JSON_message::user_state_message(username, &password);
     }
     else if (order == "delete")
     {
-        logins.erase(username);
+        users.erase(username);
+        return JSON_message::user_state_message(username, NULL);
     }
-
-    lock.unlock();
+    return "";
 }
 
 bool spreadsheet_server::modify_sheets(sheet_command *cmd)
@@ -600,9 +1642,10 @@ bool spreadsheet_server::modify_sheets(sheet_command *cmd)
     {
         lock.lock();
         sheets[sprd_name] = spreadsheet(sprd_name);
+        update_spreadsheet_list();
         lock.unlock();
 
-        save_sprd_names();
+        mark_names_dirty();
         return true;
     }
     else if (order == "delete")
@@ -612,8 +1655,9 @@ bool spreadsheet_server::modify_sheets(sheet_command *cmd)
         {
             // Spreadsheet has no active clients
             sheets.erase(sprd_name);
+            update_spreadsheet_list();
             lock.unlock();
-            save_sprd_names();
+            mark_names_dirty();
             return true;
         }
         else
@@ -625,19 +1669,24 @@ bool spreadsheet_server::modify_sheets(sheet_command *cmd)
     }
     else
     {
-        std::cout << "Bad admin command" << std::endl;
+        LOG(LOG_WARN, "bad admin command").field("order", order);
         return false;
     }
 }
 
 void spreadsheet_server::shutdown_server()
 {
-    std::vector<client *> copy_clients;
+    std::vector<client_ptr> copy_clients;
     // disconnect all clients
+    // (copy them first, each disconnect erases itself from clients)
+    clients_lock.lock();
     for (auto &elem : clients)
     {
-        copy_clients.push_back(elem);
+        client_ptr c = elem.second.lock();
+        if (c != NULL)
+            copy_clients.push_back(c);
     }
+    clients_lock.unlock();
 
     for (auto &elem : copy_clients)
     {
@@ -649,9 +1698,70 @@ void spreadsheet_server::shutdown_server()
     is_running = false;
 
     saver_thread.join();
+    publisher_thread.join();
+    stop_persister();
 }
 
 bool spreadsheet_server::currently_running() const
 {
     return is_running;
 }
+
+/*
+ * Returns the admin client, or NULL if there isn't one.
+ * Thread safe.
+ */
+client_ptr spreadsheet_server::get_admin()
+{
+    std::lock_guard<std::mutex> guard(user_lock);
+    return admin.lock();
+}
+
+/*
+ * Prints how many connections were accepted and rejected since the
+ * last report, if any were.
+ */
+void spreadsheet_server::report_connections()
+{
+    if (server == NULL)
+        return;
+
+    unsigned long accepted = server->accepted_count();
+    unsigned long rejected = server->rejected_count();
+
+    if (accepted != last_accepted || rejected != last_rejected)
+    {
+        LOG(LOG_INFO, "connections")
+            .field("accepted_per_s", (accepted - last_accepted) / (double)SAVE_INTERVAL)
+            .field("rejected_per_s", (rejected - last_rejected) / (double)SAVE_INTERVAL)
+            .field("active", server->active_count());
+    }
+
+    last_accepted = accepted;
+    last_rejected = rejected;
+}
+
+/*
+ * Counts every entry in the client registries, whether or not the client is
+ * still alive, so one that is never let go shows up
+ */
+void spreadsheet_server::report_registries()
+{
+    clients_lock.lock();
+    std::size_t registered = clients.size();
+    clients_lock.unlock();
+
+    std::size_t sheet_clients = 0;
+    lock.lock();
+    for (const auto &conns : sprd_conns)
+        sheet_clients += conns.second.size();
+    lock.unlock();
+
+    viewer_lock.lock();
+    for (const auto &conns : viewer_conns)
+        sheet_clients += conns.second.size();
+    viewer_lock.unlock();
+
+    metrics::registered_clients.set(registered);
+    metrics::registered_sheet_clients.set(sheet_clients);
+}
@@ -0,0 +1,83 @@
+#include "stats_listener.h"
+#include "metrics.h"
+#include <string>
+
+using asio::ip::tcp;
+
+/*
+ * One scrape. Waits for the end of the request headers (or for the request
+ * to fill up) before answering, so the scraper doesn't get reset mid request.
+ */
+class stats_session
+    : public std::enable_shared_from_this<stats_session>
+{
+public:
+    stats_session(tcp::socket socket)
+        : socket_(std::move(socket))
+    {
+    }
+
+    void start()
+    {
+        do_read();
+    }
+
+private:
+    void do_read()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(buffer_, sizeof(buffer_)),
+                                [this, self](std::error_code ec, std::size_t length) {
+                                    if (ec)
+                                        return;
+
+                                    request_.append(buffer_, length);
+                                    if (request_.find("\r\n\r\n") == std::string::npos && request_.size() < 8192)
+                                        do_read();
+                                    else
+                                        respond();
+                                });
+    }
+
+    void respond()
+    {
+        std::string body = metrics::prometheus_text();
+        response_ = "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n" + body;
+
+        auto self(shared_from_this());
+        asio::async_write(socket_, asio::buffer(response_),
+                          [this, self](std::error_code ec, std::size_t length) {
+                              std::error_code ignored;
+                              socket_.shutdown(tcp::socket::shutdown_both, ignored);
+                          });
+    }
+
+    tcp::socket socket_;
+    char buffer_[1024];
+    std::string request_;
+    std::string response_;
+};
+
+stats_listener::stats_listener(asio::io_context &io_context, short port)
+    : acceptor_(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), port))
+{
+    do_accept();
+}
+
+void stats_listener::do_accept()
+{
+    acceptor_.async_accept(
+        [this](std::error_code ec, tcp::socket socket) {
+            // The acceptor was closed, the server is going away
+            if (ec == asio::error::operation_aborted)
+                return;
+
+            if (!ec)
+                std::make_shared<stats_session>(std::move(socket))->start();
+
+            do_accept();
+        });
+}
@@ -16,35 +16,177 @@
 #include "asio.hpp"
 #include "tcp_server.h"
 #include "client.h"
+#include "logger.h"
 
 using asio::ip::tcp;
 
-tcp_server::tcp_server(asio::io_context& io_context, short port, std::function<void(client *)> accept_callback)
-: acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), accept_callback_(accept_callback)
+#ifdef SO_REUSEPORT
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+#endif
+
+/*
+ * Listen on the given port. With reuse_port every io_context gets its own
+ * acceptor and the kernel spreads new connections across them. Otherwise a
+ * single acceptor runs on the first io_context and hands accepted sockets to
+ * the io_contexts round robin.
+ */
+tcp_server::tcp_server(const std::vector<asio::io_context *> &io_contexts, short port, const accept_options &options,
+                       std::function<void(const client_ptr &)> accept_callback)
+    : io_contexts_(io_contexts), options_(options), admission_(std::make_shared<admission_state>()),
+      next_context_(0), accept_callback_(accept_callback)
 {
-    do_accept();
+    admission_->active = 0;
+    admission_->accepted = 0;
+    admission_->rejected = 0;
+
+#ifndef SO_REUSEPORT
+    if (options_.reuse_port)
+    {
+        LOG(LOG_WARN, "SO_REUSEPORT is not supported here, using a single acceptor");
+        options_.reuse_port = false;
+    }
+#endif
+
+    std::size_t acceptor_count = options_.reuse_port ? io_contexts_.size() : 1;
+    tcp::endpoint endpoint(tcp::v4(), port);
+
+    for (std::size_t i = 0; i < acceptor_count; i++)
+    {
+        std::unique_ptr<tcp::acceptor> acceptor(new tcp::acceptor(*io_contexts_[i]));
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        if (options_.reuse_port)
+            acceptor->set_option(reuse_port_option(true));
+#endif
+        acceptor->bind(endpoint);
+        acceptor->listen(asio::socket_base::max_listen_connections);
+        acceptors_.push_back(std::move(acceptor));
+        retry_timers_.emplace_back(new asio::steady_timer(*io_contexts_[i]));
+    }
+
+    for (std::size_t i = 0; i < acceptors_.size(); i++)
+        do_accept(i);
 }
 
-/* When a new TCP connection is made, createa a new client, 
- * assign it a new ID (just count up), call the accept_callback 
- * then wait for more connections
+/* When a new TCP connection is made, createa a new client,
+ * assign it a new ID (just count up), call the accept_callback
+ * then wait for more connections.
+ * The client is shared, whoever wants to keep it around holds a client_ptr.
  */
-void tcp_server::do_accept()
+void tcp_server::do_accept(std::size_t index)
 {
-    acceptor_.async_accept(
-            [this](std::error_code ec, tcp::socket socket)
+    tcp::acceptor &acceptor = *acceptors_[index];
+    // A SO_REUSEPORT acceptor keeps its connections on its own io_context
+    asio::io_context &target = options_.reuse_port ? acceptor.get_executor().context() : next_io_context();
+
+    acceptor.async_accept(target,
+            [this, index](std::error_code ec, tcp::socket socket)
             {
-                if (!ec)
+                // The acceptor was closed, the server is going away
+                if (ec == asio::error::operation_aborted)
+                    return;
+
+                if (ec)
                 {
-                    client *c = new client(std::move(socket), current_id++);
-                    accept_callback_(c);
+                    retry_accept(index, ec);
+                    return;
                 }
 
-                do_accept();
+                admit(std::move(socket));
+                do_accept(index);
             });
 }
 
-// Static instantiation
-int tcp_server::current_id = 0;
+/*
+ * Accepting again straight after an error like EMFILE fails again straight
+ * away, and spins the thread until a descriptor is freed. Wait a while
+ * first instead.
+ */
+void tcp_server::retry_accept(std::size_t index, const std::error_code &error)
+{
+    LOG(LOG_WARN, "accept failed").field("error", error.message()).field("retry_ms", ACCEPT_RETRY_MS);
+
+    asio::steady_timer &timer = *retry_timers_[index];
+    timer.expires_after(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+    timer.async_wait([this, index](std::error_code ec) {
+        // The timer was cancelled, the server is going away
+        if (ec)
+            return;
+        do_accept(index);
+    });
+}
+
+/*
+ * Applies the connection limits. A connection over either limit is closed
+ * straight away. An admitted client holds a slot that gives its counts back
+ * when the client is freed.
+ */
+void tcp_server::admit(tcp::socket socket)
+{
+    std::error_code ec;
+    std::string ip = socket.remote_endpoint(ec).address().to_string();
+    if (ec)
+        return; // Peer already went away
+
+    std::shared_ptr<admission_state> admission = admission_;
+
+    admission->lock.lock();
+    bool over_total = options_.max_connections > 0 && admission->active >= options_.max_connections;
+    bool over_ip = options_.max_connections_per_ip > 0 && admission->per_ip[ip] >= options_.max_connections_per_ip;
+    if (over_total || over_ip)
+    {
+        if (admission->per_ip[ip] == 0)
+            admission->per_ip.erase(ip);
+        admission->lock.unlock();
+        admission->rejected++;
 
+        socket.close(ec);
+        return;
+    }
+    admission->active++;
+    admission->per_ip[ip]++;
+    admission->lock.unlock();
+    admission->accepted++;
 
+    // Messages are small and latency sensitive, don't let Nagle hold them back
+    socket.set_option(tcp::no_delay(true), ec);
+
+    client_ptr c = std::make_shared<client>(std::move(socket), current_id++);
+    c->connection_slot = std::shared_ptr<void>(nullptr, [admission, ip](void *) {
+        std::lock_guard<std::mutex> guard(admission->lock);
+        admission->active--;
+        if (--admission->per_ip[ip] == 0)
+            admission->per_ip.erase(ip);
+    });
+
+    // Everything the server does with a client happens on the client's own
+    // io_context. The handler can still be queued there once this tcp_server
+    // is freed, so it holds its own copy of the callback
+    std::function<void(const client_ptr &)> callback = accept_callback_;
+    asio::dispatch(c->get_executor(), [callback, c]() { callback(c); });
+}
+
+asio::io_context &tcp_server::next_io_context()
+{
+    return *io_contexts_[next_context_++ % io_contexts_.size()];
+}
+
+unsigned long tcp_server::accepted_count() const
+{
+    return admission_->accepted;
+}
+
+unsigned long tcp_server::rejected_count() const
+{
+    return admission_->rejected;
+}
+
+int tcp_server::active_count() const
+{
+    std::lock_guard<std::mutex> guard(admission_->lock);
+    return admission_->active;
+}
+
+// Static instantiation
+std::atomic<int> tcp_server::current_id(0);
@@ -0,0 +1,305 @@
+/* Regression checks for the spreadsheet core.
+ *
+ * Each check builds a small spreadsheet, does one thing to it and looks at
+ * the result. A failed expectation prints where it was and what it got,
+ * and makes the run exit non zero.
+ *
+ * Usage: tests [--only NAME]
+ *
+ * --only runs the checks whose name contains NAME. Nothing is written to
+ * disk.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "spreadsheet.h"
+#include "cell_ref.h"
+
+static int failures = 0;
+
+#define EXPECT(condition)                                                                 \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(condition))                                                                 \
+        {                                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #condition << "\n"; \
+            failures++;                                                                   \
+        }                                                                                 \
+    } while (0)
+
+#define EXPECT_EQ(actual, expected)                                                             \
+    do                                                                                          \
+    {                                                                                           \
+        auto actual_value = (actual);                                                           \
+        auto expected_value = (expected);                                                       \
+        if (!(actual_value == expected_value))                                                  \
+        {                                                                                       \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #actual << " is " << actual_value \
+                      << ", expected " << expected_value << "\n";                               \
+            failures++;                                                                         \
+        }                                                                                       \
+    } while (0)
+
+static bool set(spreadsheet &sheet, const std::string &cellName, const std::string &contents)
+{
+    std::vector<std::string> dependencies;
+    cell_ref::references(contents, dependencies);
+    return sheet.setCellContents(cellName, contents, dependencies);
+}
+
+static void recalculate(spreadsheet &sheet)
+{
+    std::vector<std::string> recalculated;
+    sheet.recalculate(NULL, recalculated);
+}
+
+/*
+ * How much memory the process has resident, in bytes
+ */
+static long resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static cell_range make_range(const std::string &text)
+{
+    cell_range range;
+    cell_ref::parse_range(text, range);
+    return range;
+}
+
+// ======== Aggregates ========
+static void aggregates_match_cells()
+{
+    spreadsheet sheet("tests");
+    std::map<std::pair<int, int>, double> numbers;
+    std::mt19937 rng(46);
+
+    // Rows either side of the block boundaries
+    for (int i = 0; i < 3000; i++)
+    {
+        int col = rng() % 3;
+        int row = 1 + rng() % 3000;
+        std::string cellName = cell_ref::name(col, row);
+        if (rng() % 4 == 0)
+        {
+            set(sheet, cellName, "");
+            numbers.erase(std::make_pair(col, row));
+        }
+        else
+        {
+            int value = (int)(rng() % 1000) - 500;
+            set(sheet, cellName, std::to_string(value));
+            numbers[std::make_pair(col, row)] = value;
+        }
+    }
+
+    for (int i = 0; i < 200; i++)
+    {
+        cell_range range;
+        range.first_col = rng() % 3;
+        range.last_col = range.first_col + rng() % 3;
+        range.first_row = 1 + rng() % 3000;
+        range.last_row = range.first_row + rng() % 2500;
+
+        range_stats expected;
+        for (const auto &number : numbers)
+        {
+            if (range.contains(number.first.first, number.first.second))
+            {
+                expected.sum += number.second;
+                expected.count++;
+                expected.min = std::min(expected.min, number.second);
+                expected.max = std::max(expected.max, number.second);
+            }
+        }
+
+        range_stats stats = sheet.getRangeStats(range);
+        EXPECT_EQ(stats.sum, expected.sum);
+        EXPECT_EQ(stats.count, expected.count);
+        EXPECT_EQ(stats.min, expected.min);
+        EXPECT_EQ(stats.max, expected.max);
+    }
+}
+
+static void aggregates_see_formula_values()
+{
+    spreadsheet sheet("tests");
+    set(sheet, "A1", "1");
+    set(sheet, "A2", "=A1*10");
+    set(sheet, "A3", "=A2+5");
+    set(sheet, "A4", "text");
+    set(sheet, "B1", "=SUM(A1:A4)");
+    set(sheet, "B2", "=COUNT(A1:A4)");
+    recalculate(sheet);
+
+    range_stats stats = sheet.getRangeStats(make_range("A1:A4"));
+    EXPECT_EQ(stats.sum, 26.0);
+    EXPECT_EQ(stats.count, (std::size_t)3);
+    EXPECT_EQ(stats.sum, sheet.getCellValue("B1"));
+    EXPECT_EQ((double)stats.count, sheet.getCellValue("B2"));
+
+    // A formula's new value shows up in both once it's worked out
+    set(sheet, "A1", "2");
+    recalculate(sheet);
+    EXPECT_EQ(sheet.getRangeStats(make_range("A1:A4")).sum, 47.0);
+    EXPECT_EQ(sheet.getCellValue("B1"), 47.0);
+}
+
+static void far_away_number_keeps_memory_small()
+{
+    long before = resident_bytes();
+    spreadsheet sheet("tests");
+    set(sheet, "A99999999", "1");
+    set(sheet, "ZZZ99999999", "2");
+    long grown = resident_bytes() - before;
+
+    EXPECT(grown < 16 * 1024 * 1024);
+    EXPECT_EQ(sheet.getRangeStats(make_range("A1:ZZZ99999999")).sum, 3.0);
+}
+
+// ======== Cycles ========
+static void three_cell_cycle_is_rejected()
+{
+    spreadsheet sheet("tests");
+    EXPECT(set(sheet, "B1", "=C1"));
+    EXPECT(set(sheet, "C1", "=A1"));
+    EXPECT(!set(sheet, "A1", "=B1"));
+    EXPECT(!sheet.hasCell("A1"));
+
+    // Setting a formula again with the same references is fine
+    EXPECT(set(sheet, "C1", "=A1"));
+    EXPECT(set(sheet, "A1", "=D1"));
+}
+
+static void cycle_through_range_is_rejected()
+{
+    spreadsheet sheet("tests");
+    EXPECT(!set(sheet, "A1", "=SUM(A1:A3)"));
+
+    // Into a range from the cells that depend on it
+    EXPECT(set(sheet, "A1", "=SUM(B1:B3)"));
+    EXPECT(set(sheet, "C1", "=A1+1"));
+    EXPECT(!set(sheet, "B2", "=C1"));
+    EXPECT(!sheet.hasCell("B2"));
+
+    // And the other way, a range over cells that depend on the formula
+    spreadsheet other("tests");
+    EXPECT(set(other, "B2", "=C1"));
+    EXPECT(set(other, "C1", "=A1+1"));
+    EXPECT(!set(other, "A1", "=SUM(B1:B3)"));
+    EXPECT(set(other, "A1", "=SUM(B3:B5)"));
+}
+
+// ======== Ranges ========
+static void wide_range_finds_its_dependents()
+{
+    spreadsheet sheet("tests");
+    EXPECT(set(sheet, "A1", "=SUM(B2:ZZZZ2)"));
+    EXPECT(set(sheet, "A2", "=SUM(C1:BZ3)"));
+
+    EXPECT(set(sheet, "B2", "1"));
+    EXPECT(set(sheet, "ZZZZ2", "2"));
+    EXPECT(set(sheet, "ZZZZ3", "4"));
+    EXPECT(set(sheet, "BZ2", "8"));
+    recalculate(sheet);
+    EXPECT_EQ(sheet.getCellValue("A1"), 11.0);
+    EXPECT_EQ(sheet.getCellValue("A2"), 8.0);
+
+    // Text is refused only in cells a formula depends on
+    EXPECT(!set(sheet, "ZZZ2", "text"));
+    EXPECT(set(sheet, "ZZZZ1", "text"));
+    EXPECT(set(sheet, "A3", "text"));
+    EXPECT(!set(sheet, "QQ2", "=A1"));
+
+    // Taking the formula away leaves nothing behind
+    EXPECT(set(sheet, "A1", "1"));
+    EXPECT(set(sheet, "ZZZ2", "text"));
+    EXPECT(!set(sheet, "BZ1", "text"));
+}
+
+// ======== Rows ========
+static void delete_rows_shrinks_ranges()
+{
+    struct
+    {
+        const char *formula;
+        int row;
+        int count;
+        const char *expected;
+    } cases[] = {
+        {"=SUM(A1:A10)", 1, 1, "=SUM(A1:A9)"},
+        {"=SUM(A1:A10)", 10, 1, "=SUM(A1:A9)"},
+        {"=SUM(A1:A10)", 3, 2, "=SUM(A1:A8)"},
+        {"=SUM(A1:A10)", 1, 10, "=SUM(#REF!)"},
+        {"=SUM(A5:A20)", 3, 8, "=SUM(A3:A12)"},
+        {"=SUM($A$1:B10)+A1", 1, 1, "=SUM($A$1:B9)+#REF!"},
+        {"=SUM(A10:A1)", 10, 1, "=SUM(A9:A1)"},
+    };
+
+    for (const auto &c : cases)
+    {
+        spreadsheet sheet("tests");
+        set(sheet, "C30", c.formula);
+        sheet.deleteRows(c.row, c.count);
+        EXPECT_EQ(sheet.getCellContents(cell_ref::name(2, 30 - c.count)), std::string(c.expected));
+    }
+}
+
+// ======== Runner ========
+struct test_case
+{
+    const char *name;
+    std::function<void()> run;
+};
+
+int main(int argc, char *argv[])
+{
+    std::string only;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else
+        {
+            std::cerr << "Usage: tests [--only NAME]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<test_case> tests = {
+        {"aggregates_match_cells", aggregates_match_cells},
+        {"aggregates_see_formula_values", aggregates_see_formula_values},
+        {"far_away_number_keeps_memory_small", far_away_number_keeps_memory_small},
+        {"three_cell_cycle_is_rejected", three_cell_cycle_is_rejected},
+        {"cycle_through_range_is_rejected", cycle_through_range_is_rejected},
+        {"wide_range_finds_its_dependents", wide_range_finds_its_dependents},
+        {"delete_rows_shrinks_ranges", delete_rows_shrinks_ranges},
+    };
+
+    int run = 0;
+    for (const auto &test : tests)
+    {
+        if (std::string(test.name).find(only) == std::string::npos)
+            continue;
+
+        int before = failures;
+        test.run();
+        run++;
+        std::cout << (failures == before ? "ok   " : "FAIL ") << test.name << std::endl;
+    }
+
+    std::cout << run << " checks, " << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
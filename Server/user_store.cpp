@@ -0,0 +1,297 @@
+#include "user_store.h"
+#include "logger.h"
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+// ======== rw_lock ========
+rw_lock::rw_lock()
+    : readers_(0), writers_waiting_(0), writing_(false)
+{
+}
+
+void rw_lock::lock_shared()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    readers_cond_.wait(guard, [this]() { return !writing_ && writers_waiting_ == 0; });
+    readers_++;
+}
+
+void rw_lock::unlock_shared()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (--readers_ == 0 && writers_waiting_ > 0)
+        writer_cond_.notify_one();
+}
+
+void rw_lock::lock()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    writers_waiting_++;
+    writer_cond_.wait(guard, [this]() { return !writing_ && readers_ == 0; });
+    writers_waiting_--;
+    writing_ = true;
+}
+
+void rw_lock::unlock()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    writing_ = false;
+    if (writers_waiting_ > 0)
+        writer_cond_.notify_one();
+    else
+        readers_cond_.notify_all();
+}
+
+// ======== Log lines ========
+static void append_escaped(std::string &out, const std::string &text)
+{
+    for (char ch : text)
+    {
+        if (ch == '\\')
+            out += "\\\\";
+        else if (ch == '\t')
+            out += "\\t";
+        else if (ch == '\n')
+            out += "\\n";
+        else
+            out += ch;
+    }
+}
+
+/*
+ * Reads an escaped field from text starting at pos, up to a tab or the
+ * end of the line. Leaves pos just past the tab.
+ */
+static std::string read_escaped(const std::string &text, std::size_t &pos)
+{
+    std::string out;
+    for (; pos < text.size() && text[pos] != '\t'; pos++)
+    {
+        char ch = text[pos];
+        if (ch == '\\' && pos + 1 < text.size())
+        {
+            ch = text[++pos];
+            if (ch == 't')
+                ch = '\t';
+            else if (ch == 'n')
+                ch = '\n';
+        }
+        out += ch;
+    }
+    pos++;
+    return out;
+}
+
+static std::string set_line(const std::string &username, const std::string &password)
+{
+    std::string line = "+ ";
+    append_escaped(line, username);
+    line += '\t';
+    append_escaped(line, password);
+    line += '\n';
+    return line;
+}
+
+static std::string erase_line(const std::string &username)
+{
+    std::string line = "- ";
+    append_escaped(line, username);
+    line += '\n';
+    return line;
+}
+
+// ======== user_store ========
+user_store::user_store(const std::string &path)
+    : path_(path), log_lines_(0), needs_compact_(false)
+{
+}
+
+user_store::shard &user_store::shard_for(const std::string &username)
+{
+    return shards_[std::hash<std::string>()(username) & (USER_STORE_SHARDS - 1)];
+}
+
+/*
+ * Applies one line of the log. Lines that don't parse are skipped.
+ */
+void user_store::apply(const std::string &line)
+{
+    if (line.size() < 2 || line[1] != ' ')
+        return;
+
+    std::size_t pos = 2;
+    std::string username = read_escaped(line, pos);
+    shard &s = shard_for(username);
+
+    if (line[0] == '+')
+        s.users[username] = read_escaped(line, pos);
+    else if (line[0] == '-')
+        s.users.erase(username);
+}
+
+bool user_store::load()
+{
+    std::ifstream log_file(path_.c_str());
+    if (!log_file.is_open())
+        return false;
+
+    std::string line;
+    while (std::getline(log_file, line))
+    {
+        apply(line);
+        log_lines_++;
+    }
+
+    LOG(LOG_INFO, "users loaded").field("users", size()).field("log_lines", log_lines_);
+    return true;
+}
+
+void user_store::import(const std::unordered_map<std::string, std::string> &users)
+{
+    for (const auto &user : users)
+        shard_for(user.first).users[user.first] = user.second;
+
+    needs_compact_ = true;
+}
+
+user_store::LOGIN_RESULT user_store::check_login(const std::string &username, const std::string &password)
+{
+    shard &s = shard_for(username);
+
+    s.lock.lock_shared();
+    auto it = s.users.find(username);
+    if (it != s.users.end())
+    {
+        bool matches = it->second == password;
+        s.lock.unlock_shared();
+        return matches ? LOGIN_OK : LOGIN_BAD_PASSWORD;
+    }
+    s.lock.unlock_shared();
+
+    // Username doesn't exist - add it, unless someone else did meanwhile
+    std::lock_guard<rw_lock> guard(s.lock);
+    auto inserted = s.users.insert(std::make_pair(username, password));
+    if (!inserted.second)
+        return inserted.first->second == password ? LOGIN_OK : LOGIN_BAD_PASSWORD;
+
+    log_change(set_line(username, password));
+    return LOGIN_ADDED;
+}
+
+void user_store::set(const std::string &username, const std::string &password)
+{
+    shard &s = shard_for(username);
+    std::lock_guard<rw_lock> guard(s.lock);
+    s.users[username] = password;
+    log_change(set_line(username, password));
+}
+
+bool user_store::erase(const std::string &username)
+{
+    shard &s = shard_for(username);
+    std::lock_guard<rw_lock> guard(s.lock);
+    if (s.users.erase(username) == 0)
+        return false;
+
+    log_change(erase_line(username));
+    return true;
+}
+
+std::size_t user_store::size() const
+{
+    std::size_t count = 0;
+    for (const shard &s : shards_)
+    {
+        s.lock.lock_shared();
+        count += s.users.size();
+        s.lock.unlock_shared();
+    }
+    return count;
+}
+
+std::unordered_map<std::string, std::string> user_store::all() const
+{
+    std::unordered_map<std::string, std::string> users;
+    for (const shard &s : shards_)
+    {
+        s.lock.lock_shared();
+        users.insert(s.users.begin(), s.users.end());
+        s.lock.unlock_shared();
+    }
+    return users;
+}
+
+void user_store::log_change(const std::string &line)
+{
+    std::lock_guard<std::mutex> guard(pending_lock_);
+    pending_.push_back(line);
+}
+
+void user_store::flush()
+{
+    std::vector<std::string> lines;
+    {
+        std::lock_guard<std::mutex> guard(pending_lock_);
+        lines.swap(pending_);
+    }
+
+    log_lines_ += lines.size();
+    if (needs_compact_ ||
+        (log_lines_ >= USER_LOG_COMPACT_MIN && log_lines_ > USER_LOG_COMPACT_RATIO * size()))
+    {
+        // The rewritten log has every change in lines already, and any made
+        // since will be appended again next time, which is harmless
+        if (compact())
+            return;
+    }
+
+    if (lines.empty())
+        return;
+
+    std::string out;
+    for (const std::string &line : lines)
+        out += line;
+
+    std::ofstream log_file(path_.c_str(), std::ios::app);
+    log_file << out;
+    if (!log_file)
+    {
+        LOG(LOG_ERROR, "unable to write users log").field("file", path_);
+    }
+}
+
+/*
+ * Rewrites the log with one line per user, into a new file that then
+ * replaces the old one so a crash midway leaves the old log whole.
+ */
+bool user_store::compact()
+{
+    std::string temp_path = path_ + ".tmp";
+    std::ofstream log_file(temp_path.c_str(), std::ios::trunc);
+
+    std::size_t lines = 0;
+    for (shard &s : shards_)
+    {
+        std::string out;
+        s.lock.lock_shared();
+        for (const auto &user : s.users)
+            out += set_line(user.first, user.second);
+        lines += s.users.size();
+        s.lock.unlock_shared();
+
+        log_file << out;
+    }
+    log_file.close();
+
+    if (!log_file || std::rename(temp_path.c_str(), path_.c_str()) != 0)
+    {
+        LOG(LOG_ERROR, "unable to compact users log").field("file", path_);
+        std::remove(temp_path.c_str());
+        return false;
+    }
+
+    log_lines_ = lines;
+    needs_compact_ = false;
+    return true;
+}
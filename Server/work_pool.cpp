@@ -0,0 +1,135 @@
+#include "work_pool.h"
+#include <algorithm>
+
+work_pool::work_pool(std::size_t threads)
+    : task(NULL), remaining(0), batch(0), stopping(false)
+{
+    for (std::size_t i = 0; i <= threads; i++)
+        queues.push_back(std::unique_ptr<work_queue>(new work_queue()));
+    for (std::size_t i = 0; i < threads; i++)
+        this->threads.push_back(std::thread(&work_pool::helper, this, i));
+}
+
+work_pool::~work_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+std::size_t work_pool::size() const
+{
+    return queues.size();
+}
+
+/*
+ * The chunks are dealt round robin, so every queue starts with about the
+ * same amount of work
+ */
+void work_pool::run(std::size_t count, std::size_t grain, const std::function<void(std::size_t)> &task)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    std::lock_guard<std::mutex> running(run_lock);
+
+    // Set before any chunk is queued, a helper still looking for work from
+    // the last batch may take one as soon as it is
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        this->task = &task;
+        remaining = (count + grain - 1) / grain;
+        batch++;
+    }
+
+    std::size_t chunks = 0;
+    for (std::size_t begin = 0; begin < count; begin += grain, chunks++)
+    {
+        work_queue &queue = *queues[chunks % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.chunks.push_back(chunk(begin, std::min(begin + grain, count)));
+    }
+    wake.notify_all();
+
+    work(queues.size() - 1);
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this]() { return remaining == 0; });
+    this->task = NULL;
+}
+
+/*
+ * Own queue from the back first, then the others from the front
+ */
+bool work_pool::take(std::size_t self, chunk &found)
+{
+    {
+        work_queue &own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.chunks.empty())
+        {
+            found = own.chunks.back();
+            own.chunks.pop_back();
+            return true;
+        }
+    }
+
+    for (std::size_t i = 1; i < queues.size(); i++)
+    {
+        work_queue &other = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.chunks.empty())
+        {
+            found = other.chunks.front();
+            other.chunks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Runs chunks until there are none left to take, by then the rest of the
+ * batch is being run by other threads
+ */
+void work_pool::work(std::size_t self)
+{
+    chunk found;
+    while (take(self, found))
+    {
+        // task was set before the chunk was queued, and the queue's lock
+        // orders that before the chunk was taken
+        const std::function<void(std::size_t)> &batch_task = *task;
+        for (std::size_t i = found.first; i < found.second; i++)
+            batch_task(i);
+
+        if (--remaining == 0)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.notify_all();
+        }
+    }
+}
+
+void work_pool::helper(std::size_t self)
+{
+    unsigned long seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&]() { return stopping || batch != seen; });
+            if (stopping)
+                return;
+            seen = batch;
+        }
+        work(self);
+    }
+}